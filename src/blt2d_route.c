@@ -0,0 +1,206 @@
+/*
+ * Copyright © 2013 Siarhei Siamashka <siarhei.siamashka@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <float.h>
+#include <time.h>
+
+#include "blt2d_route.h"
+
+/* Time every 16th blit and try the other option for every 256th one */
+#define SAMPLE_MASK          15
+#define EXPLORE_MASK         255
+/* The weight of a new sample in the moving average is 1/COST_SMOOTHING */
+#define COST_SMOOTHING       8
+#define CALIBRATION_REPEATS  2
+
+#define COST_MEASURED_BOTH   3
+
+/* The representative width or height for every size class */
+static const int class_size[BLT2D_ROUTE_SIZE_CLASSES] = { 8, 32, 128, 384 };
+
+static int size_class(int n)
+{
+    return n < 16 ? 0 : n < 64 ? 1 : n < 256 ? 2 : 3;
+}
+
+static int64_t gettime_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void blt2d_route_init(blt2d_route_t *route, int threshold, int threshold_16bpp)
+{
+    int b, wc, hc, dir;
+
+    for (b = 0; b < 2; b++) {
+        for (wc = 0; wc < BLT2D_ROUTE_SIZE_CLASSES; wc++) {
+            for (hc = 0; hc < BLT2D_ROUTE_SIZE_CLASSES; hc++) {
+                for (dir = 0; dir < BLT2D_ROUTE_DIRS; dir++) {
+                    blt2d_route_cell_t *cell = &route->cell[b][wc][hc][dir];
+                    cell->cost[0] = cell->cost[1] = 0;
+                    cell->measured = 0;
+                    cell->threshold = b ? threshold : threshold_16bpp;
+                    cell->calls = 0;
+                }
+            }
+        }
+    }
+    route->threshold = 0;
+    route->force = BLT2D_ROUTE_AUTO;
+    route->sampling = 1;
+    route->calibrating = 0;
+}
+
+blt2d_route_cell_t *blt2d_route_get_cell(blt2d_route_t *route,
+                                         uint32_t      *src_bits,
+                                         uint32_t      *dst_bits,
+                                         int            src_bpp,
+                                         int            dst_bpp,
+                                         int            src_x,
+                                         int            src_y,
+                                         int            dst_x,
+                                         int            dst_y,
+                                         int            w,
+                                         int            h)
+{
+    int b = !(src_bpp == 16 && dst_bpp == 16);
+    int dir = BLT2D_ROUTE_DIR_NONE;
+
+    if (src_bits == dst_bits &&
+        src_x < dst_x + w && dst_x < src_x + w &&
+        src_y < dst_y + h && dst_y < src_y + h) {
+        if (dst_y < src_y || (dst_y == src_y && dst_x <= src_x))
+            dir = BLT2D_ROUTE_DIR_FORWARD;
+        else
+            dir = BLT2D_ROUTE_DIR_BACKWARD;
+    }
+
+    return &route->cell[b][size_class(w)][size_class(h)][dir];
+}
+
+int blt2d_route_prefer_hw(blt2d_route_t *route, blt2d_route_cell_t *cell,
+                          int area)
+{
+    if (route->force)
+        return route->force == BLT2D_ROUTE_HW;
+    if (route->threshold > 0)
+        return area >= route->threshold;
+    if (cell->measured != COST_MEASURED_BOTH)
+        return area >= cell->threshold;
+    return cell->cost[1] < cell->cost[0];
+}
+
+int blt2d_route_start(blt2d_route_t *route, blt2d_route_cell_t *cell,
+                      int area, int64_t *t)
+{
+    int hw = blt2d_route_prefer_hw(route, cell, area);
+
+    *t = 0;
+    if (!route->sampling || (route->threshold > 0 && !route->force))
+        return hw;
+
+    if (!route->force) {
+        if ((++cell->calls & SAMPLE_MASK) != 0)
+            return hw;
+        /*
+         * Check the other option now and then, unless it is known to be
+         * much worse
+         */
+        if ((cell->calls & EXPLORE_MASK) == 0 &&
+            (!(cell->measured & (1 << !hw)) ||
+             cell->cost[!hw] < cell->cost[hw] * 2))
+            hw = !hw;
+    }
+
+    *t = gettime_ns();
+    return hw;
+}
+
+void blt2d_route_finish(blt2d_route_t *route, blt2d_route_cell_t *cell,
+                        int hw, int area, int64_t t)
+{
+    float cost;
+
+    if (!t || area <= 0)
+        return;
+
+    cost = (float)(gettime_ns() - t) / area;
+    if (route->calibrating) {
+        /* The best result of the repeated runs */
+        if (cost < cell->cost[hw])
+            cell->cost[hw] = cost;
+    }
+    else if (!(cell->measured & (1 << hw))) {
+        cell->cost[hw] = cost;
+    }
+    else {
+        cell->cost[hw] += (cost - cell->cost[hw]) / COST_SMOOTHING;
+    }
+    cell->measured |= 1 << hw;
+}
+
+int blt2d_route_calibrate(blt2d_route_t *route, blt2d_i *blt2d,
+                          uint32_t *bits, int stride, int rows, int bpp)
+{
+    int b = bpp != 16;
+    int max_w = stride * 32 / bpp;
+    int wc, hc, dir, hw, i;
+
+    if (max_w < class_size[0] || rows < class_size[0] * 2)
+        return 0;
+
+    route->calibrating = 1;
+    for (wc = 0; wc < BLT2D_ROUTE_SIZE_CLASSES; wc++) {
+        for (hc = 0; hc < BLT2D_ROUTE_SIZE_CLASSES; hc++) {
+            int w = class_size[wc] < max_w ? class_size[wc] : max_w;
+            int h = class_size[hc] < rows / 2 ? class_size[hc] : rows / 2;
+            /* Keep using the threshold if the area is too small */
+            if (size_class(w) != wc || size_class(h) != hc)
+                continue;
+            for (dir = 0; dir < BLT2D_ROUTE_DIRS; dir++) {
+                blt2d_route_cell_t *cell = &route->cell[b][wc][hc][dir];
+                int src_y = dir == BLT2D_ROUTE_DIR_FORWARD ? 1 : 0;
+                int dst_y = dir == BLT2D_ROUTE_DIR_NONE ? h :
+                            dir == BLT2D_ROUTE_DIR_BACKWARD ? 1 : 0;
+                for (hw = 0; hw < 2; hw++) {
+                    float old_cost = cell->cost[hw];
+                    cell->cost[hw] = FLT_MAX;
+                    route->force = hw ? BLT2D_ROUTE_HW : BLT2D_ROUTE_CPU;
+                    for (i = 0; i < CALIBRATION_REPEATS; i++)
+                        blt2d->overlapped_blt(blt2d->self, bits, bits,
+                                              stride, stride, bpp, bpp,
+                                              0, src_y, 0, dst_y, w, h);
+                    /* Nothing has been measured if the blits have failed */
+                    if (cell->cost[hw] == FLT_MAX)
+                        cell->cost[hw] = old_cost;
+                }
+            }
+        }
+    }
+    route->force = BLT2D_ROUTE_AUTO;
+    route->calibrating = 0;
+    return 1;
+}
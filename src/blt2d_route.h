@@ -0,0 +1,118 @@
+/*
+ * Copyright © 2013 Siarhei Siamashka <siarhei.siamashka@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef BLT2D_ROUTE_H
+#define BLT2D_ROUTE_H
+
+#include <inttypes.h>
+
+#include "interfaces.h"
+
+/*
+ * Choosing between a hardware blitter and its CPU fallback for each blit.
+ * The blits are classified by bpp, width, height and overlap direction,
+ * and the table stores the measured cost (nanoseconds per pixel) of both
+ * for every class. Until both costs of a class are known, the choice is
+ * made by the fixed area threshold of the hardware backend, just like
+ * without the table. The costs come from a startup calibration or from
+ * timing some of the blits, and the later results update the table.
+ */
+
+#define BLT2D_ROUTE_SIZE_CLASSES 4   /* < 16, < 64, < 256 and >= 256 pixels */
+
+#define BLT2D_ROUTE_DIR_NONE     0   /* different images or no overlap */
+#define BLT2D_ROUTE_DIR_FORWARD  1   /* the destination is before the source */
+#define BLT2D_ROUTE_DIR_BACKWARD 2   /* the destination is after the source */
+#define BLT2D_ROUTE_DIRS         3
+
+#define BLT2D_ROUTE_AUTO         0
+#define BLT2D_ROUTE_HW           1
+#define BLT2D_ROUTE_CPU          2
+
+typedef struct {
+    float       cost[2];    /* [0] for the CPU, [1] for the hardware */
+    int         measured;   /* bit 0 and bit 1 are set for the known costs */
+    int         threshold;  /* the area threshold used until both are known */
+    uint32_t    calls;
+} blt2d_route_cell_t;
+
+typedef struct {
+    /* [0] for 16bpp to 16bpp blits, [1] for everything else */
+    blt2d_route_cell_t cell[2][BLT2D_ROUTE_SIZE_CLASSES]
+                              [BLT2D_ROUTE_SIZE_CLASSES][BLT2D_ROUTE_DIRS];
+    /* If positive, just use the hardware for the areas this big or more */
+    int                threshold;
+    /* BLT2D_ROUTE_HW or BLT2D_ROUTE_CPU to force the choice */
+    int                force;
+    /* Whether timing the blits makes sense (it doesn't for async backends) */
+    int                sampling;
+    /* Set while the calibration is running */
+    int                calibrating;
+} blt2d_route_t;
+
+/*
+ * Reset the table, so that the hardware is chosen for the blits with
+ * the area of at least 'threshold' (or 'threshold_16bpp' for 16bpp to
+ * 16bpp blits) pixels until the costs are measured.
+ */
+void blt2d_route_init(blt2d_route_t *route, int threshold, int threshold_16bpp);
+
+blt2d_route_cell_t *blt2d_route_get_cell(blt2d_route_t *route,
+                                         uint32_t      *src_bits,
+                                         uint32_t      *dst_bits,
+                                         int            src_bpp,
+                                         int            dst_bpp,
+                                         int            src_x,
+                                         int            src_y,
+                                         int            dst_x,
+                                         int            dst_y,
+                                         int            w,
+                                         int            h);
+
+/* Returns 1 if the hardware is expected to be faster */
+int blt2d_route_prefer_hw(blt2d_route_t *route, blt2d_route_cell_t *cell,
+                          int area);
+
+/*
+ * The same as blt2d_route_prefer_hw, but occasionally picks the other
+ * option (if the costs are close) to keep its estimate up to date. Sets
+ * '*t' to the start time if the blit needs to be timed or to 0 otherwise.
+ */
+int blt2d_route_start(blt2d_route_t *route, blt2d_route_cell_t *cell,
+                      int area, int64_t *t);
+
+/* Update the table if the blit started by blt2d_route_start was timed */
+void blt2d_route_finish(blt2d_route_t *route, blt2d_route_cell_t *cell,
+                        int hw, int area, int64_t t);
+
+/*
+ * Measure both options for every class by doing the blits via 'blt2d'
+ * (which must use this routing table) in the area at 'bits', which has
+ * 'rows' rows and 'stride' (in 32-bit units). The contents of the area
+ * gets destroyed. Returns 0 if the area is too small.
+ */
+int blt2d_route_calibrate(blt2d_route_t *route, blt2d_i *blt2d,
+                          uint32_t *bits, int stride, int rows, int bpp);
+
+#endif
@@ -22,12 +22,163 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include "cpuinfo.h"
 #include "cpu_backend.h"
 
-#ifdef __arm__
+/*
+ * A pool of worker threads for splitting large blits into bands. The thread,
+ * which submits a job, also processes bands itself and then waits for the
+ * workers to finish the rest.
+ */
+
+#define MAX_THREADS 8
+
+typedef struct {
+    uint8_t   *dst_bytes;
+    uint8_t   *src_bytes;
+    uintptr_t  dst_stride;
+    uintptr_t  src_stride;
+    int        width;
+    int        height;
+} blt_band_t;
+
+struct cpu_backend_threads {
+    int              nthreads;
+    pthread_t        thread[MAX_THREADS];
+    pthread_mutex_t  lock;
+    /* held by the thread, which is using the pool for its current job */
+    pthread_mutex_t  job_lock;
+    pthread_cond_t   start_cond;
+    pthread_cond_t   done_cond;
+    int              quit;
+    /* the current job */
+    blt_band_t       band[MAX_THREADS + 1];
+    int              nbands;
+    int              next_band;
+    int              pending_bands;
+    size_t           scratchsize;
+    void (*run_band)(struct cpu_backend_threads *t, blt_band_t *band);
+    void (*twopass_memmove)(void *, const void *, size_t, size_t);
+    void (*writeback)(int size, void *dst, const void *src);
+};
+
+static void *worker_thread(void *arg)
+{
+    cpu_backend_threads_t *t = (cpu_backend_threads_t *)arg;
+    int i;
+
+    pthread_mutex_lock(&t->lock);
+    while (1) {
+        while (!t->quit && t->next_band >= t->nbands)
+            pthread_cond_wait(&t->start_cond, &t->lock);
+        if (t->quit)
+            break;
+        i = t->next_band++;
+        pthread_mutex_unlock(&t->lock);
+        t->run_band(t, &t->band[i]);
+        pthread_mutex_lock(&t->lock);
+        if (--t->pending_bands == 0)
+            pthread_cond_signal(&t->done_cond);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+/* Process 't->nbands' bands (already set up by the caller) and wait */
+static void run_bands(cpu_backend_threads_t *t, int nbands)
+{
+    int i;
+
+    pthread_mutex_lock(&t->lock);
+    t->nbands = nbands;
+    t->next_band = 0;
+    t->pending_bands = nbands;
+    pthread_cond_broadcast(&t->start_cond);
+    while (t->next_band < t->nbands) {
+        i = t->next_band++;
+        pthread_mutex_unlock(&t->lock);
+        t->run_band(t, &t->band[i]);
+        pthread_mutex_lock(&t->lock);
+        t->pending_bands--;
+    }
+    while (t->pending_bands > 0)
+        pthread_cond_wait(&t->done_cond, &t->lock);
+    t->nbands = 0;
+    t->next_band = 0;
+    pthread_mutex_unlock(&t->lock);
+}
+
+/*
+ * The pool runs one job at a time, but it is shared between the threads
+ * of the driver (the asynchronous FBIOCOPYAREA fallback runs its blits in
+ * a separate thread). If the pool is busy, the caller does the job alone.
+ */
+static int threads_acquire(cpu_backend_threads_t *t)
+{
+    return pthread_mutex_trylock(&t->job_lock) == 0;
+}
+
+static void threads_release(cpu_backend_threads_t *t)
+{
+    pthread_mutex_unlock(&t->job_lock);
+}
+
+static void stop_threads(cpu_backend_threads_t *t)
+{
+    int i;
+
+    pthread_mutex_lock(&t->lock);
+    t->quit = 1;
+    pthread_cond_broadcast(&t->start_cond);
+    pthread_mutex_unlock(&t->lock);
+
+    for (i = 0; i < t->nthreads; i++)
+        pthread_join(t->thread[i], NULL);
+
+    pthread_cond_destroy(&t->done_cond);
+    pthread_cond_destroy(&t->start_cond);
+    pthread_mutex_destroy(&t->job_lock);
+    pthread_mutex_destroy(&t->lock);
+    free(t);
+}
+
+static cpu_backend_threads_t *start_threads(int nthreads)
+{
+    cpu_backend_threads_t *t = calloc(sizeof(cpu_backend_threads_t), 1);
+    sigset_t sigset, old_sigset;
+
+    if (!t)
+        return NULL;
+
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_mutex_init(&t->job_lock, NULL);
+    pthread_cond_init(&t->start_cond, NULL);
+    pthread_cond_init(&t->done_cond, NULL);
+
+    /* the signals must be only delivered to the main thread */
+    sigfillset(&sigset);
+    pthread_sigmask(SIG_BLOCK, &sigset, &old_sigset);
+    while (t->nthreads < nthreads && t->nthreads < MAX_THREADS) {
+        if (pthread_create(&t->thread[t->nthreads], NULL, worker_thread, t))
+            break;
+        t->nthreads++;
+    }
+    pthread_sigmask(SIG_SETMASK, &old_sigset, NULL);
+
+    if (t->nthreads == 0) {
+        stop_threads(t);
+        return NULL;
+    }
+    return t;
+}
+
+#if defined(__arm__) || defined(__aarch64__) || defined(__x86_64__)
 
 #ifdef __GNUC__
 #define always_inline inline __attribute__((always_inline))
@@ -35,9 +186,19 @@
 #define always_inline inline
 #endif
 
-void memcpy_armv5te(void *dst, const void *src, int size);
+#if defined(__arm__) || defined(__aarch64__)
+
+/* Implemented in "arm_asm.S" for ARM and in "aarch64_asm.S" for AArch64 */
 void writeback_scratch_to_mem_neon(int size, void *dst, const void *src);
 void aligned_fetch_fbmem_to_scratch_neon(int size, void *dst, const void *src);
+void convert_8888_to_0565_neon(int n, uint16_t *dst, const uint32_t *src);
+void convert_0565_to_8888_neon(int n, uint32_t *dst, const uint16_t *src);
+
+#endif
+
+#ifdef __arm__
+
+void memcpy_armv5te(void *dst, const void *src, int size);
 void aligned_fetch_fbmem_to_scratch_vfp(int size, void *dst, const void *src);
 void aligned_fetch_fbmem_to_scratch_arm(int size, void *dst, const void *src);
 
@@ -47,7 +208,32 @@ writeback_scratch_to_mem_arm(int size, void *dst, const void *src)
     memcpy_armv5te(dst, src, size);
 }
 
-#define SCRATCHSIZE 2048
+#endif
+
+#ifdef __x86_64__
+
+/* Implemented in "x86_asm.S" */
+void aligned_fetch_fbmem_to_scratch_sse2(int size, void *dst, const void *src);
+void aligned_fetch_fbmem_to_scratch_sse4_1(int size, void *dst, const void *src);
+void aligned_fetch_fbmem_to_scratch_avx2(int size, void *dst, const void *src);
+void convert_8888_to_0565_sse2(int n, uint16_t *dst, const uint32_t *src);
+void convert_0565_to_8888_sse2(int n, uint32_t *dst, const uint16_t *src);
+
+/*
+ * The scratch buffer is always in the cache, so there is not much to gain
+ * from a custom implementation here (glibc memcpy is already well tuned and
+ * selects the best variant for the CPU by itself).
+ */
+static always_inline void
+writeback_scratch_to_mem_x86(int size, void *dst, const void *src)
+{
+    memcpy(dst, src, size);
+}
+
+#endif
+
+/* The largest scratch buffer size, which can be selected at runtime */
+#define SCRATCHSIZE_MAX 8192
 
 /*
  * This is a function similar to memmove, which tries to minimize uncached read
@@ -59,11 +245,11 @@ writeback_scratch_to_mem_arm(int size, void *dst, const void *src)
  * to the source buffer, the whole chunk is going to be read).
  */
 static always_inline void
-twopass_memmove(void *dst_, const void *src_, size_t size,
+twopass_memmove(void *dst_, const void *src_, size_t size, size_t scratchsize,
                 void (*aligned_fetch_fbmem_to_scratch)(int, void *, const void *),
                 void (*writeback_scratch_to_mem)(int, void *, const void *))
 {
-    uint8_t tmpbuf[SCRATCHSIZE + 32 + 31];
+    uint8_t tmpbuf[SCRATCHSIZE_MAX + 32 + 31];
     uint8_t *scratchbuf = (uint8_t *)((uintptr_t)(&tmpbuf[0] + 31) & ~31);
     uint8_t *dst = (uint8_t *)dst_;
     const uint8_t *src = (const uint8_t *)src_;
@@ -71,13 +257,13 @@ twopass_memmove(void *dst_, const void *src_, size_t size,
     uintptr_t extrasize = (alignshift == 0) ? 0 : 32;
 
     if (src > dst) {
-        while (size >= SCRATCHSIZE) {
-            aligned_fetch_fbmem_to_scratch(SCRATCHSIZE + extrasize,
+        while (size >= scratchsize) {
+            aligned_fetch_fbmem_to_scratch(scratchsize + extrasize,
                                            scratchbuf, src - alignshift);
-            writeback_scratch_to_mem(SCRATCHSIZE, dst, scratchbuf + alignshift);
-            size -= SCRATCHSIZE;
-            dst += SCRATCHSIZE;
-            src += SCRATCHSIZE;
+            writeback_scratch_to_mem(scratchsize, dst, scratchbuf + alignshift);
+            size -= scratchsize;
+            dst += scratchsize;
+            src += scratchsize;
         }
         if (size > 0) {
             aligned_fetch_fbmem_to_scratch(size + extrasize,
@@ -86,7 +272,7 @@ twopass_memmove(void *dst_, const void *src_, size_t size,
         }
     }
     else {
-        uintptr_t remainder = size % SCRATCHSIZE;
+        uintptr_t remainder = size % scratchsize;
         dst += size - remainder;
         src += size - remainder;
         size -= remainder;
@@ -96,40 +282,82 @@ twopass_memmove(void *dst_, const void *src_, size_t size,
             writeback_scratch_to_mem(remainder, dst, scratchbuf + alignshift);
         }
         while (size > 0) {
-            dst -= SCRATCHSIZE;
-            src -= SCRATCHSIZE;
-            size -= SCRATCHSIZE;
-            aligned_fetch_fbmem_to_scratch(SCRATCHSIZE + extrasize,
+            dst -= scratchsize;
+            src -= scratchsize;
+            size -= scratchsize;
+            aligned_fetch_fbmem_to_scratch(scratchsize + extrasize,
                                            scratchbuf, src - alignshift);
-            writeback_scratch_to_mem(SCRATCHSIZE, dst, scratchbuf + alignshift);
+            writeback_scratch_to_mem(scratchsize, dst, scratchbuf + alignshift);
         }
     }
 }
 
+#if defined(__arm__) || defined(__aarch64__)
+
 static void
-twopass_memmove_neon(void *dst, const void *src, size_t size)
+twopass_memmove_neon(void *dst, const void *src, size_t size,
+                     size_t scratchsize)
 {
-    twopass_memmove(dst, src, size,
+    twopass_memmove(dst, src, size, scratchsize,
                     aligned_fetch_fbmem_to_scratch_neon,
                     writeback_scratch_to_mem_neon);
 }
 
+#endif
+
+#ifdef __arm__
+
 static void
-twopass_memmove_vfp(void *dst, const void *src, size_t size)
+twopass_memmove_vfp(void *dst, const void *src, size_t size,
+                    size_t scratchsize)
 {
-    twopass_memmove(dst, src, size,
+    twopass_memmove(dst, src, size, scratchsize,
                     aligned_fetch_fbmem_to_scratch_vfp,
                     writeback_scratch_to_mem_arm);
 }
 
 static void
-twopass_memmove_arm(void *dst, const void *src, size_t size)
+twopass_memmove_arm(void *dst, const void *src, size_t size,
+                    size_t scratchsize)
 {
-    twopass_memmove(dst, src, size,
+    twopass_memmove(dst, src, size, scratchsize,
                     aligned_fetch_fbmem_to_scratch_arm,
                     writeback_scratch_to_mem_arm);
 }
 
+#endif
+
+#ifdef __x86_64__
+
+static void
+twopass_memmove_sse2(void *dst, const void *src, size_t size,
+                     size_t scratchsize)
+{
+    twopass_memmove(dst, src, size, scratchsize,
+                    aligned_fetch_fbmem_to_scratch_sse2,
+                    writeback_scratch_to_mem_x86);
+}
+
+static void
+twopass_memmove_sse4_1(void *dst, const void *src, size_t size,
+                       size_t scratchsize)
+{
+    twopass_memmove(dst, src, size, scratchsize,
+                    aligned_fetch_fbmem_to_scratch_sse4_1,
+                    writeback_scratch_to_mem_x86);
+}
+
+static void
+twopass_memmove_avx2(void *dst, const void *src, size_t size,
+                     size_t scratchsize)
+{
+    twopass_memmove(dst, src, size, scratchsize,
+                    aligned_fetch_fbmem_to_scratch_avx2,
+                    writeback_scratch_to_mem_x86);
+}
+
+#endif
+
 static void
 twopass_blt_8bpp(int        width,
                  int        height,
@@ -137,7 +365,8 @@ twopass_blt_8bpp(int        width,
                  uintptr_t  dst_stride,
                  uint8_t   *src_bytes,
                  uintptr_t  src_stride,
-                 void (*twopass_memmove)(void *, const void *, size_t))
+                 size_t     scratchsize,
+                 void (*memmove_fn)(void *, const void *, size_t, size_t))
 {
     if (src_bytes < dst_bytes + width &&
         src_bytes + src_stride * height > dst_bytes)
@@ -150,7 +379,7 @@ twopass_blt_8bpp(int        width,
         {
             while (--height >= 0)
             {
-                twopass_memmove(dst_bytes, src_bytes, width);
+                memmove_fn(dst_bytes, src_bytes, width, scratchsize);
                 dst_bytes += dst_stride;
                 src_bytes += src_stride;
             }
@@ -159,12 +388,443 @@ twopass_blt_8bpp(int        width,
     }
     while (--height >= 0)
     {
-        twopass_memmove(dst_bytes, src_bytes, width);
+        memmove_fn(dst_bytes, src_bytes, width, scratchsize);
         dst_bytes += dst_stride;
         src_bytes += src_stride;
     }
 }
 
+/*
+ * Narrow blits (scrollbars, text cursor, small boxes from miCopyRegion)
+ * are dominated by the per-row overhead of twopass_memmove. Instead
+ * several rows are fetched into the scratch buffer one after another
+ * (each row gets its own 32 bytes aligned slot), and then all of them
+ * are written back. This is safe for any overlap, as long as the batches
+ * are processed in the same order as the rows in twopass_blt_8bpp.
+ */
+
+/* The rows up to this size (in bytes) are batched */
+#define NARROW_ROW_MAX 256
+/* The rows up to this size are written back without a function call */
+#define SHORT_ROW_MAX  64
+
+static always_inline void
+writeback_short_row(uint8_t *dst, const uint8_t *src, int size)
+{
+    if (size & 64) {
+        memcpy(dst, src, 64);
+        dst += 64;
+        src += 64;
+    }
+    if (size & 32) {
+        memcpy(dst, src, 32);
+        dst += 32;
+        src += 32;
+    }
+    if (size & 16) {
+        memcpy(dst, src, 16);
+        dst += 16;
+        src += 16;
+    }
+    if (size & 8) {
+        memcpy(dst, src, 8);
+        dst += 8;
+        src += 8;
+    }
+    if (size & 4) {
+        memcpy(dst, src, 4);
+        dst += 4;
+        src += 4;
+    }
+    if (size & 2) {
+        memcpy(dst, src, 2);
+        dst += 2;
+        src += 2;
+    }
+    if (size & 1)
+        *dst = *src;
+}
+
+static always_inline void
+twopass_blt_narrow(int        width,
+                   int        height,
+                   uint8_t   *dst_bytes,
+                   uintptr_t  dst_stride,
+                   uint8_t   *src_bytes,
+                   uintptr_t  src_stride,
+                   size_t     scratchsize,
+                   int        short_rows,
+                   void (*aligned_fetch_fbmem_to_scratch)(int, void *, const void *),
+                   void (*writeback_scratch_to_mem)(int, void *, const void *))
+{
+    uint8_t tmpbuf[SCRATCHSIZE_MAX + 31];
+    uint8_t *scratchbuf = (uint8_t *)((uintptr_t)(&tmpbuf[0] + 31) & ~31);
+    uintptr_t slot = (width + 31 + 31) & ~31;
+    int batch = scratchsize / slot;
+    int i, n;
+
+    if (batch < 1)
+        batch = 1;
+
+    if (src_bytes < dst_bytes + width &&
+        src_bytes + src_stride * height > dst_bytes)
+    {
+        src_bytes += src_stride * height - src_stride;
+        dst_bytes += dst_stride * height - dst_stride;
+        dst_stride = -dst_stride;
+        src_stride = -src_stride;
+    }
+
+    while (height > 0)
+    {
+        uint8_t *buf = scratchbuf;
+        uint8_t *src = src_bytes;
+        n = height < batch ? height : batch;
+        for (i = 0; i < n; i++) {
+            uintptr_t alignshift = (uintptr_t)src & 31;
+            aligned_fetch_fbmem_to_scratch((alignshift + width + 31) & ~31,
+                                           buf, src - alignshift);
+            buf += slot;
+            src += src_stride;
+        }
+        buf = scratchbuf;
+        for (i = 0; i < n; i++) {
+            uintptr_t alignshift = (uintptr_t)src_bytes & 31;
+            if (short_rows)
+                writeback_short_row(dst_bytes, buf + alignshift, width);
+            else
+                writeback_scratch_to_mem(width, dst_bytes, buf + alignshift);
+            buf += slot;
+            src_bytes += src_stride;
+            dst_bytes += dst_stride;
+        }
+        height -= n;
+    }
+}
+
+#define DEFINE_TWOPASS_BLT_NARROW(impl, fetch, writeback)                   \
+static void                                                                 \
+twopass_blt_narrow_##impl(int width, int height,                            \
+                          uint8_t *dst_bytes, uintptr_t dst_stride,         \
+                          uint8_t *src_bytes, uintptr_t src_stride,         \
+                          size_t scratchsize)                               \
+{                                                                           \
+    if (width <= SHORT_ROW_MAX)                                             \
+        twopass_blt_narrow(width, height, dst_bytes, dst_stride,            \
+                           src_bytes, src_stride, scratchsize, 1,           \
+                           fetch, writeback);                               \
+    else                                                                    \
+        twopass_blt_narrow(width, height, dst_bytes, dst_stride,            \
+                           src_bytes, src_stride, scratchsize, 0,           \
+                           fetch, writeback);                               \
+}
+
+#if defined(__arm__) || defined(__aarch64__)
+DEFINE_TWOPASS_BLT_NARROW(neon, aligned_fetch_fbmem_to_scratch_neon,
+                          writeback_scratch_to_mem_neon)
+#endif
+
+#ifdef __arm__
+DEFINE_TWOPASS_BLT_NARROW(vfp, aligned_fetch_fbmem_to_scratch_vfp,
+                          writeback_scratch_to_mem_arm)
+DEFINE_TWOPASS_BLT_NARROW(arm, aligned_fetch_fbmem_to_scratch_arm,
+                          writeback_scratch_to_mem_arm)
+#endif
+
+#ifdef __x86_64__
+DEFINE_TWOPASS_BLT_NARROW(sse2, aligned_fetch_fbmem_to_scratch_sse2,
+                          writeback_scratch_to_mem_x86)
+DEFINE_TWOPASS_BLT_NARROW(sse4_1, aligned_fetch_fbmem_to_scratch_sse4_1,
+                          writeback_scratch_to_mem_x86)
+DEFINE_TWOPASS_BLT_NARROW(avx2, aligned_fetch_fbmem_to_scratch_avx2,
+                          writeback_scratch_to_mem_x86)
+#endif
+
+/*
+ * Overlapped blit for the normal cached memory (for example scrolling
+ * inside of a backing store pixmap). The non-overlapped blits are better
+ * handled by pixman, so only the cases which need a special copy direction
+ * (bottom to top, or right to left within the same rows) are done here.
+ * The rows are copied by memcpy/memmove from the C library, which already
+ * has well tuned SIMD implementations selected at runtime, and the next
+ * source row is prefetched because going from one row to another
+ * (especially backwards) breaks the automatic hardware prefetch.
+ */
+static int
+cached_overlapped_blt_8bpp(int        width,
+                           int        height,
+                           uint8_t   *dst_bytes,
+                           uint8_t   *src_bytes,
+                           uintptr_t  stride,
+                           int        dx,
+                           int        dy)
+{
+    /* no overlap, or the top to bottom, left to right order is fine */
+    if (dy < 0 || dy >= height || dx >= width || -dx >= width ||
+        (dy == 0 && dx <= 0))
+        return 0;
+
+    if (dy == 0) {
+        /* the same rows, right to left */
+        while (--height >= 0) {
+            memmove(dst_bytes, src_bytes, width);
+            dst_bytes += stride;
+            src_bytes += stride;
+        }
+        return 1;
+    }
+
+    /* bottom to top */
+    src_bytes += stride * (height - 1);
+    dst_bytes += stride * (height - 1);
+    while (--height >= 0) {
+#ifdef __GNUC__
+        if (height > 0) {
+            int i;
+            for (i = 0; i < width && i < 512; i += 64)
+                __builtin_prefetch(src_bytes - stride + i);
+        }
+#endif
+        memcpy(dst_bytes, src_bytes, width);
+        dst_bytes -= stride;
+        src_bytes -= stride;
+    }
+    return 1;
+}
+
+/*
+ * Convert 'n' pixels from a8r8g8b8/x8r8g8b8 to r5g6b5 format (if 'src_bpp'
+ * is 32) or the other way around. The SIMD functions from the CPU backend
+ * do the bulk of work and the remaining pixels are handled here.
+ */
+static void
+convert_pixels(cpu_backend_t *ctx, void *dst, const void *src, int n,
+               int src_bpp)
+{
+    int i = 0;
+
+    if (src_bpp == 32) {
+        const uint32_t *s = (const uint32_t *)src;
+        uint16_t *d = (uint16_t *)dst;
+        if (ctx->convert_8888_to_0565) {
+            ctx->convert_8888_to_0565(n, d, s);
+            i = n & ~7;
+        }
+        for (; i < n; i++)
+            d[i] = ((s[i] >> 8) & 0xF800) | ((s[i] >> 5) & 0x07E0) |
+                   ((s[i] >> 3) & 0x001F);
+    }
+    else {
+        const uint16_t *s = (const uint16_t *)src;
+        uint32_t *d = (uint32_t *)dst;
+        if (ctx->convert_0565_to_8888) {
+            ctx->convert_0565_to_8888(n, d, s);
+            i = n & ~7;
+        }
+        for (; i < n; i++) {
+            uint32_t p = s[i];
+            d[i] = 0xFF000000 |
+                   ((p & 0xF800) << 8) | ((p & 0xE000) << 3) |
+                   ((p & 0x07E0) << 5) | ((p & 0x0600) >> 1) |
+                   ((p & 0x001F) << 3) | ((p & 0x001C) >> 2);
+        }
+    }
+}
+
+/*
+ * Blit with r5g6b5 <-> a8r8g8b8/x8r8g8b8 format conversion. The uncached
+ * source is fetched into the scratch buffer in chunks, and each chunk is
+ * converted while it sits in the cache.
+ */
+static int
+convert_blt(cpu_backend_t *ctx,
+            uint32_t      *src_bits,
+            uint32_t      *dst_bits,
+            int            src_stride,
+            int            dst_stride,
+            int            src_bpp,
+            int            dst_bpp,
+            int            src_x,
+            int            src_y,
+            int            dst_x,
+            int            dst_y,
+            int            width,
+            int            height,
+            int            uncached_source)
+{
+    uint8_t tmpbuf[SCRATCHSIZE_MAX + 32 + 31];
+    uint8_t *scratchbuf = (uint8_t *)((uintptr_t)(&tmpbuf[0] + 31) & ~31);
+    int src_bytespp = src_bpp >> 3, dst_bytespp = dst_bpp >> 3;
+    int chunk = ctx->scratch_size / src_bytespp;
+    uint8_t *src_bytes, *dst_bytes;
+    int x;
+
+    if (!(src_bpp == 16 && dst_bpp == 32) && !(src_bpp == 32 && dst_bpp == 16))
+        return 0;
+    /* different formats can't really share the same memory */
+    if (src_bits == dst_bits || src_stride < 0 || dst_stride < 0)
+        return 0;
+
+    src_bytes = (uint8_t *)src_bits + (uintptr_t) src_y * src_stride * 4 +
+                                      (uintptr_t) src_x * src_bytespp;
+    dst_bytes = (uint8_t *)dst_bits + (uintptr_t) dst_y * dst_stride * 4 +
+                                      (uintptr_t) dst_x * dst_bytespp;
+
+    while (--height >= 0) {
+        if (!uncached_source) {
+            convert_pixels(ctx, dst_bytes, src_bytes, width, src_bpp);
+        }
+        else {
+            for (x = 0; x < width; x += chunk) {
+                uint8_t *src = src_bytes + x * src_bytespp;
+                uintptr_t alignshift = (uintptr_t)src & 31;
+                int n = width - x < chunk ? width - x : chunk;
+                ctx->aligned_fetch(n * src_bytespp + alignshift,
+                                   scratchbuf, src - alignshift);
+                convert_pixels(ctx, dst_bytes + x * dst_bytespp,
+                               scratchbuf + alignshift, n, src_bpp);
+            }
+        }
+        src_bytes += (uintptr_t) src_stride * 4;
+        dst_bytes += (uintptr_t) dst_stride * 4;
+    }
+    return 1;
+}
+
+/* The smallest band height, for which it still makes sense to use threads */
+#define MIN_BAND_ROWS 4
+/* The smallest strip width (when splitting a blit into vertical strips) */
+#define MIN_STRIP_BYTES 256
+
+static void
+run_twopass_blt_band(cpu_backend_threads_t *t, blt_band_t *band)
+{
+    twopass_blt_8bpp(band->width, band->height,
+                     band->dst_bytes, band->dst_stride,
+                     band->src_bytes, band->src_stride,
+                     t->scratchsize, t->twopass_memmove);
+}
+
+/* Split 'height' rows starting at 'row' into up to 'maxbands' bands */
+static int
+split_rows(cpu_backend_threads_t *t, int maxbands,
+           uint8_t *dst_bytes, uintptr_t dst_stride,
+           uint8_t *src_bytes, uintptr_t src_stride,
+           int width, int row, int height)
+{
+    int i, nbands = height / MIN_BAND_ROWS;
+    if (nbands > maxbands)
+        nbands = maxbands;
+    if (nbands < 1)
+        nbands = 1;
+
+    for (i = 0; i < nbands; i++) {
+        int y1 = row + height * i / nbands;
+        int y2 = row + height * (i + 1) / nbands;
+        t->band[i].dst_bytes  = dst_bytes + dst_stride * y1;
+        t->band[i].src_bytes  = src_bytes + src_stride * y1;
+        t->band[i].dst_stride = dst_stride;
+        t->band[i].src_stride = src_stride;
+        t->band[i].width      = width;
+        t->band[i].height     = y2 - y1;
+    }
+    return nbands;
+}
+
+/*
+ * Try to run twopass_blt_8bpp in multiple threads. The overlapping source
+ * and destination rectangles need special care:
+ *   - if the vertical offset 'dy' is zero, then each row is independent
+ *     (memmove takes care of the horizontal overlap within a row)
+ *   - if the horizontal offset 'dx' is zero, then the blit can be split
+ *     into independent vertical strips (each processed in the overlap
+ *     direction order)
+ *   - otherwise the rows are processed in waves of 'abs(dy)' rows, going
+ *     in the overlap direction order. The source and destination rows
+ *     do not intersect within a single wave, so it can be split into bands.
+ * Returns 0 if the blit is not worth splitting.
+ */
+static int
+threaded_blt_8bpp(cpu_backend_threads_t *t,
+                  int        width,
+                  int        height,
+                  uint8_t   *dst_bytes,
+                  uintptr_t  dst_stride,
+                  uint8_t   *src_bytes,
+                  uintptr_t  src_stride,
+                  int        dx,
+                  int        dy,
+                  int        same_buffer,
+                  size_t     scratchsize,
+                  void (*memmove_fn)(void *, const void *, size_t, size_t))
+{
+    int maxbands = t->nthreads + 1;
+    int independent, nbands, i;
+
+    independent = same_buffer ? (dy >= height || -dy >= height ||
+                                 dx >= width || -dx >= width) :
+                  (src_bytes >= dst_bytes + dst_stride * height ||
+                   dst_bytes >= src_bytes + src_stride * height);
+
+    if (!independent && !same_buffer)
+        return 0;
+
+    t->scratchsize = scratchsize;
+    t->twopass_memmove = memmove_fn;
+    t->run_band = run_twopass_blt_band;
+
+    if (independent || dy == 0) {
+        if (height < MIN_BAND_ROWS * 2)
+            return 0;
+        nbands = split_rows(t, maxbands, dst_bytes, dst_stride,
+                            src_bytes, src_stride, width, 0, height);
+        run_bands(t, nbands);
+        return 1;
+    }
+
+    if (dx == 0) {
+        int strip = ((width + maxbands - 1) / maxbands + 63) & ~63;
+        if (strip < MIN_STRIP_BYTES)
+            strip = MIN_STRIP_BYTES;
+        if (strip >= width)
+            return 0;
+        for (nbands = 0; nbands * strip < width; nbands++) {
+            int x = nbands * strip;
+            t->band[nbands].dst_bytes  = dst_bytes + x;
+            t->band[nbands].src_bytes  = src_bytes + x;
+            t->band[nbands].dst_stride = dst_stride;
+            t->band[nbands].src_stride = src_stride;
+            t->band[nbands].width      = x + strip > width ? width - x : strip;
+            t->band[nbands].height     = height;
+        }
+        run_bands(t, nbands);
+        return 1;
+    }
+
+    if (dy < MIN_BAND_ROWS * 2 && -dy < MIN_BAND_ROWS * 2)
+        return 0;
+
+    if (dy > 0) {
+        /* bottom to top */
+        for (i = height; i > 0; i -= dy) {
+            int row = i > dy ? i - dy : 0;
+            nbands = split_rows(t, maxbands, dst_bytes, dst_stride,
+                                src_bytes, src_stride, width, row, i - row);
+            run_bands(t, nbands);
+        }
+    }
+    else {
+        /* top to bottom */
+        for (i = 0; i < height; i -= dy) {
+            int rows = i - dy < height ? -dy : height - i;
+            nbands = split_rows(t, maxbands, dst_bytes, dst_stride,
+                                src_bytes, src_stride, width, i, rows);
+            run_bands(t, nbands);
+        }
+    }
+    return 1;
+}
+
 static always_inline int
 overlapped_blt(void     *self,
                uint32_t *src_bits,
@@ -179,7 +839,9 @@ overlapped_blt(void     *self,
                int       dst_y,
                int       width,
                int       height,
-               void (*twopass_memmove)(void *, const void *, size_t))
+               void (*memmove_fn)(void *, const void *, size_t, size_t),
+               void (*narrow_fn)(int, int, uint8_t *, uintptr_t,
+                                 uint8_t *, uintptr_t, size_t))
 {
     uint8_t *dst_bytes = (uint8_t *)dst_bits;
     uint8_t *src_bytes = (uint8_t *)src_bits;
@@ -187,24 +849,76 @@ overlapped_blt(void     *self,
     int bpp = src_bpp >> 3;
     int uncached_source = (src_bytes >= ctx->uncached_area_begin) &&
                           (src_bytes < ctx->uncached_area_end);
-    if (!uncached_source)
-        return 0;
 
-    if (src_bpp != dst_bpp || src_bpp & 7 || src_stride < 0 || dst_stride < 0)
+    if (src_bpp != dst_bpp)
+        return convert_blt(ctx, src_bits, dst_bits, src_stride, dst_stride,
+                           src_bpp, dst_bpp, src_x, src_y, dst_x, dst_y,
+                           width, height, uncached_source);
+
+    if (src_bpp & 7 || src_stride < 0 || dst_stride < 0)
         return 0;
 
+    dst_bytes += (uintptr_t) dst_y * dst_stride * 4 + (uintptr_t) dst_x * bpp;
+    src_bytes += (uintptr_t) src_y * src_stride * 4 + (uintptr_t) src_x * bpp;
+
+    if (!uncached_source) {
+        if (src_bits != dst_bits || src_stride != dst_stride)
+            return 0;
+        return cached_overlapped_blt_8bpp(width * bpp,
+                                          height,
+                                          dst_bytes,
+                                          src_bytes,
+                                          (uintptr_t) src_stride * 4,
+                                          (dst_x - src_x) * bpp,
+                                          dst_y - src_y);
+    }
+
+    if ((uintptr_t) width * bpp <= NARROW_ROW_MAX) {
+        narrow_fn(width * bpp,
+                  height,
+                  dst_bytes,
+                  (uintptr_t) dst_stride * 4,
+                  src_bytes,
+                  (uintptr_t) src_stride * 4,
+                  ctx->scratch_size);
+        return 1;
+    }
+
+    if (ctx->threads &&
+        (uintptr_t) width * bpp * height >= ctx->threads_threshold &&
+        threads_acquire(ctx->threads))
+    {
+        int done = threaded_blt_8bpp(ctx->threads,
+                                     width * bpp,
+                                     height,
+                                     dst_bytes,
+                                     (uintptr_t) dst_stride * 4,
+                                     src_bytes,
+                                     (uintptr_t) src_stride * 4,
+                                     (dst_x - src_x) * bpp,
+                                     dst_y - src_y,
+                                     src_bits == dst_bits &&
+                                     src_stride == dst_stride,
+                                     ctx->scratch_size,
+                                     memmove_fn);
+        threads_release(ctx->threads);
+        if (done)
+            return 1;
+    }
+
     twopass_blt_8bpp((uintptr_t) width * bpp,
                      height,
-                     dst_bytes + (uintptr_t) dst_y * dst_stride * 4 +
-                                 (uintptr_t) dst_x * bpp,
+                     dst_bytes,
                      (uintptr_t) dst_stride * 4,
-                     src_bytes + (uintptr_t) src_y * src_stride * 4 +
-                                 (uintptr_t) src_x * bpp,
+                     src_bytes,
                      (uintptr_t) src_stride * 4,
-                     twopass_memmove);
+                     ctx->scratch_size,
+                     memmove_fn);
     return 1;
 }
 
+#if defined(__arm__) || defined(__aarch64__)
+
 static int
 overlapped_blt_neon(void     *self,
                     uint32_t *src_bits,
@@ -223,9 +937,14 @@ overlapped_blt_neon(void     *self,
     return overlapped_blt(self, src_bits, dst_bits, src_stride, dst_stride,
                           src_bpp, dst_bpp, src_x, src_y, dst_x, dst_y,
                           width, height,
-                          twopass_memmove_neon);
+                          twopass_memmove_neon,
+                          twopass_blt_narrow_neon);
 }
 
+#endif
+
+#ifdef __arm__
+
 static int
 overlapped_blt_vfp(void     *self,
                    uint32_t *src_bits,
@@ -244,7 +963,8 @@ overlapped_blt_vfp(void     *self,
     return overlapped_blt(self, src_bits, dst_bits, src_stride, dst_stride,
                           src_bpp, dst_bpp, src_x, src_y, dst_x, dst_y,
                           width, height,
-                          twopass_memmove_vfp);
+                          twopass_memmove_vfp,
+                          twopass_blt_narrow_vfp);
 }
 
 static int
@@ -265,11 +985,312 @@ overlapped_blt_arm(void     *self,
     return overlapped_blt(self, src_bits, dst_bits, src_stride, dst_stride,
                           src_bpp, dst_bpp, src_x, src_y, dst_x, dst_y,
                           width, height,
-                          twopass_memmove_arm);
+                          twopass_memmove_arm,
+                          twopass_blt_narrow_arm);
 }
 
 #endif
 
+#ifdef __x86_64__
+
+static int
+overlapped_blt_sse2(void     *self,
+                    uint32_t *src_bits,
+                    uint32_t *dst_bits,
+                    int       src_stride,
+                    int       dst_stride,
+                    int       src_bpp,
+                    int       dst_bpp,
+                    int       src_x,
+                    int       src_y,
+                    int       dst_x,
+                    int       dst_y,
+                    int       width,
+                    int       height)
+{
+    return overlapped_blt(self, src_bits, dst_bits, src_stride, dst_stride,
+                          src_bpp, dst_bpp, src_x, src_y, dst_x, dst_y,
+                          width, height,
+                          twopass_memmove_sse2,
+                          twopass_blt_narrow_sse2);
+}
+
+static int
+overlapped_blt_sse4_1(void     *self,
+                      uint32_t *src_bits,
+                      uint32_t *dst_bits,
+                      int       src_stride,
+                      int       dst_stride,
+                      int       src_bpp,
+                      int       dst_bpp,
+                      int       src_x,
+                      int       src_y,
+                      int       dst_x,
+                      int       dst_y,
+                      int       width,
+                      int       height)
+{
+    return overlapped_blt(self, src_bits, dst_bits, src_stride, dst_stride,
+                          src_bpp, dst_bpp, src_x, src_y, dst_x, dst_y,
+                          width, height,
+                          twopass_memmove_sse4_1,
+                          twopass_blt_narrow_sse4_1);
+}
+
+static int
+overlapped_blt_avx2(void     *self,
+                    uint32_t *src_bits,
+                    uint32_t *dst_bits,
+                    int       src_stride,
+                    int       dst_stride,
+                    int       src_bpp,
+                    int       dst_bpp,
+                    int       src_x,
+                    int       src_y,
+                    int       dst_x,
+                    int       dst_y,
+                    int       width,
+                    int       height)
+{
+    return overlapped_blt(self, src_bits, dst_bits, src_stride, dst_stride,
+                          src_bpp, dst_bpp, src_x, src_y, dst_x, dst_y,
+                          width, height,
+                          twopass_memmove_avx2,
+                          twopass_blt_narrow_avx2);
+}
+
+#endif
+
+#endif
+
+/*
+ * Rotated copy for the shadow framebuffer update on a rotated display.
+ *
+ * Writing the destination pixel by pixel in the column order is very bad
+ * for the write-combining buffers of the uncached framebuffer memory. So
+ * for 90 and 270 degrees, the source is transposed in small tiles into
+ * a cached scratch buffer first. Each tile is ROTATE_TILE_ROWS destination
+ * rows of ROTATE_TILE_BYTES bytes, and these rows are then written to the
+ * framebuffer with the same SIMD code as used by the two-pass blitter, in
+ * full bursts. The tile source data (ROTATE_TILE_BYTES / bpp rows) and
+ * the scratch buffer both easily fit in L1 cache.
+ */
+
+#define ROTATE_TILE_ROWS  16
+#define ROTATE_TILE_BYTES 256
+
+static void
+writeback_scratch_to_mem_generic(int size, void *dst, const void *src)
+{
+    memcpy(dst, src, size);
+}
+
+/*
+ * Transpose 'tw' source columns and 'th' source rows into 'tw' rows of
+ * 'th' pixels in the scratch buffer (for 90 degrees the source rows are
+ * taken from the bottom to the top, for 270 degrees the resulting rows
+ * are stored in the reverse order).
+ */
+static inline void
+transpose_tile(uint8_t *scratch, const uint8_t *src, uintptr_t src_stride,
+               int tw, int th, int bytespp, int degrees_cw)
+{
+    int i, j;
+    if (bytespp == 4) {
+        uint32_t (*dst)[ROTATE_TILE_BYTES / 4] = (void *)scratch;
+        for (j = 0; j < th; j++) {
+            const uint32_t *s = (const uint32_t *)(src + j * src_stride);
+            if (degrees_cw == 90) {
+                for (i = 0; i < tw; i++)
+                    dst[i][th - 1 - j] = s[i];
+            }
+            else {
+                for (i = 0; i < tw; i++)
+                    dst[tw - 1 - i][j] = s[i];
+            }
+        }
+    }
+    else {
+        uint16_t (*dst)[ROTATE_TILE_BYTES / 2] = (void *)scratch;
+        for (j = 0; j < th; j++) {
+            const uint16_t *s = (const uint16_t *)(src + j * src_stride);
+            if (degrees_cw == 90) {
+                for (i = 0; i < tw; i++)
+                    dst[i][th - 1 - j] = s[i];
+            }
+            else {
+                for (i = 0; i < tw; i++)
+                    dst[tw - 1 - i][j] = s[i];
+            }
+        }
+    }
+}
+
+/* Reverse the order of 'n' pixels */
+static inline void
+reverse_pixels(uint8_t *dst, const uint8_t *src, int n, int bytespp)
+{
+    int i;
+    if (bytespp == 4) {
+        for (i = 0; i < n; i++)
+            ((uint32_t *)dst)[i] = ((const uint32_t *)src)[n - 1 - i];
+    }
+    else {
+        for (i = 0; i < n; i++)
+            ((uint16_t *)dst)[i] = ((const uint16_t *)src)[n - 1 - i];
+    }
+}
+
+int cpu_backend_rotate_blt(cpu_backend_t *ctx,
+                           uint32_t      *src_bits,
+                           uint32_t      *dst_bits,
+                           int            src_stride,
+                           int            dst_stride,
+                           int            bpp,
+                           int            src_w,
+                           int            src_h,
+                           int            x,
+                           int            y,
+                           int            w,
+                           int            h,
+                           int            degrees_cw)
+{
+    uint8_t tmpbuf[ROTATE_TILE_ROWS * ROTATE_TILE_BYTES + 31];
+    uint8_t *scratch = (uint8_t *)((uintptr_t)(&tmpbuf[0] + 31) & ~31);
+    uintptr_t src_stride_bytes = (uintptr_t)src_stride * 4;
+    uintptr_t dst_stride_bytes = (uintptr_t)dst_stride * 4;
+    uint8_t *src_bytes = (uint8_t *)src_bits;
+    uint8_t *dst_bytes = (uint8_t *)dst_bits;
+    int bytespp = bpp / 8;
+    int tile_pixels = ROTATE_TILE_BYTES / bytespp;
+    int tx, ty;
+
+    if ((bpp != 16 && bpp != 32) || src_stride < 0 || dst_stride < 0)
+        return 0;
+    if (degrees_cw != 90 && degrees_cw != 180 && degrees_cw != 270)
+        return 0;
+    if (w <= 0 || h <= 0)
+        return 1;
+
+    if (degrees_cw == 180) {
+        /* each destination row is a reversed source row */
+        for (ty = y; ty < y + h; ty++) {
+            uint8_t *src = src_bytes + ty * src_stride_bytes;
+            uint8_t *dst = dst_bytes + (src_h - 1 - ty) * dst_stride_bytes;
+            int chunk = ROTATE_TILE_ROWS * tile_pixels;
+            for (tx = x; tx < x + w; tx += chunk) {
+                int n = x + w - tx < chunk ? x + w - tx : chunk;
+                reverse_pixels(scratch, src + tx * bytespp, n, bytespp);
+                ctx->writeback(n * bytespp,
+                               dst + (src_w - tx - n) * bytespp, scratch);
+            }
+        }
+        return 1;
+    }
+
+    /*
+     * 90 degrees:  (sx, sy) -> (src_h - 1 - sy, sx)
+     * 270 degrees: (sx, sy) -> (sy, src_w - 1 - sx)
+     */
+    for (tx = x; tx < x + w; tx += ROTATE_TILE_ROWS) {
+        int tw = x + w - tx < ROTATE_TILE_ROWS ? x + w - tx : ROTATE_TILE_ROWS;
+        for (ty = y; ty < y + h; ty += tile_pixels) {
+            int i, th = y + h - ty < tile_pixels ? y + h - ty : tile_pixels;
+            uint8_t *dst;
+            transpose_tile(scratch, src_bytes + ty * src_stride_bytes +
+                           tx * bytespp, src_stride_bytes, tw, th, bytespp,
+                           degrees_cw);
+            if (degrees_cw == 90)
+                dst = dst_bytes + tx * dst_stride_bytes +
+                      (src_h - ty - th) * bytespp;
+            else
+                dst = dst_bytes + (src_w - tx - tw) * dst_stride_bytes +
+                      ty * bytespp;
+            for (i = 0; i < tw; i++)
+                ctx->writeback(th * bytespp, dst + i * dst_stride_bytes,
+                               scratch + i * ROTATE_TILE_BYTES);
+        }
+    }
+    return 1;
+}
+
+int cpu_backend_fetch_rows(cpu_backend_t *ctx,
+                           uint8_t       *dst,
+                           intptr_t       dst_stride,
+                           const uint8_t *src,
+                           intptr_t       src_stride,
+                           int            width,
+                           int            height)
+{
+    uint8_t tmpbuf[SCRATCHSIZE_MAX + 32 + 31];
+    uint8_t *scratchbuf = (uint8_t *)((uintptr_t)(&tmpbuf[0] + 31) & ~31);
+    int x;
+
+    if (!ctx->aligned_fetch)
+        return 0;
+
+    while (--height >= 0) {
+        for (x = 0; x < width; x += ctx->scratch_size) {
+            const uint8_t *s = src + x;
+            uintptr_t alignshift = (uintptr_t)s & 31;
+            int n = width - x < ctx->scratch_size ? width - x :
+                                                    ctx->scratch_size;
+            ctx->aligned_fetch(n + alignshift, scratchbuf, s - alignshift);
+            memcpy(dst + x, scratchbuf + alignshift, n);
+        }
+        src += src_stride;
+        dst += dst_stride;
+    }
+    return 1;
+}
+
+static void
+run_writeback_band(cpu_backend_threads_t *t, blt_band_t *band)
+{
+    int y;
+    for (y = 0; y < band->height; y++)
+        t->writeback(band->width, band->dst_bytes + y * band->dst_stride,
+                     band->src_bytes + y * band->src_stride);
+}
+
+void cpu_backend_writeback_rows(cpu_backend_t *ctx,
+                                uint8_t       *dst,
+                                intptr_t       dst_stride,
+                                const uint8_t *src,
+                                intptr_t       src_stride,
+                                int            width,
+                                int            height)
+{
+    cpu_backend_threads_t *t = ctx->threads;
+
+    /* the rows are independent, so they can be split between threads */
+    if (t && (uintptr_t) width * height >= ctx->threads_threshold &&
+        height >= t->nthreads + 1 && threads_acquire(t)) {
+        int i, nbands = t->nthreads + 1;
+        for (i = 0; i < nbands; i++) {
+            int y1 = height * i / nbands;
+            int y2 = height * (i + 1) / nbands;
+            t->band[i].dst_bytes  = dst + dst_stride * y1;
+            t->band[i].src_bytes  = (uint8_t *)src + src_stride * y1;
+            t->band[i].dst_stride = dst_stride;
+            t->band[i].src_stride = src_stride;
+            t->band[i].width      = width;
+            t->band[i].height     = y2 - y1;
+        }
+        t->writeback = ctx->writeback;
+        t->run_band = run_writeback_band;
+        run_bands(t, nbands);
+        threads_release(t);
+        return;
+    }
+
+    while (--height >= 0) {
+        ctx->writeback(width, dst, src);
+        src += src_stride;
+        dst += dst_stride;
+    }
+}
+
 /* An empty, always failing implementation */
 static int
 overlapped_blt_noop(void     *self,
@@ -289,6 +1310,91 @@ overlapped_blt_noop(void     *self,
     return 0;
 }
 
+static int
+overlapped_blt_boxes(void        *self,
+                     uint32_t    *src_bits,
+                     uint32_t    *dst_bits,
+                     int          src_stride,
+                     int          dst_stride,
+                     int          src_bpp,
+                     int          dst_bpp,
+                     int          src_x,
+                     int          src_y,
+                     int          dst_x,
+                     int          dst_y,
+                     blt2d_box_t *boxes,
+                     int          nboxes)
+{
+    cpu_backend_t *ctx = (cpu_backend_t *)self;
+    return blt2d_overlapped_blt_boxes_by_one(&ctx->blt2d, src_bits, dst_bits,
+                                             src_stride, dst_stride,
+                                             src_bpp, dst_bpp, src_x, src_y,
+                                             dst_x, dst_y, boxes, nboxes);
+}
+
+typedef int (*overlapped_blt_t)(void *, uint32_t *, uint32_t *, int, int,
+                                int, int, int, int, int, int, int, int);
+
+typedef struct {
+    const char       *name;
+    overlapped_blt_t  overlapped_blt;
+    void (*aligned_fetch)(int size, void *dst, const void *src);
+} blt_impl_t;
+
+#define MAX_BLT_IMPLS 4
+
+#define ADD_BLT_IMPL(impl_name, impl)                                       \
+    do {                                                                    \
+        impls[n].name           = impl_name;                                \
+        impls[n].overlapped_blt = overlapped_blt_##impl;                    \
+        impls[n].aligned_fetch  = aligned_fetch_fbmem_to_scratch_##impl;    \
+        n++;                                                                \
+    } while (0)
+
+/* Get the list of all implementations, which can run on this CPU */
+static int get_blt_impls(cpu_backend_t *ctx, blt_impl_t *impls)
+{
+    int n = 0;
+#ifdef __arm__
+    if (ctx->cpuinfo->has_arm_neon)
+        ADD_BLT_IMPL("NEON", neon);
+    if (ctx->cpuinfo->has_arm_vfp && ctx->cpuinfo->has_arm_edsp)
+        ADD_BLT_IMPL("VFP", vfp);
+    ADD_BLT_IMPL("ARM", arm);
+#endif
+#ifdef __aarch64__
+    ADD_BLT_IMPL("NEON", neon);
+#endif
+#ifdef __x86_64__
+    if (ctx->cpuinfo->has_x86_avx2)
+        ADD_BLT_IMPL("AVX2", avx2);
+    if (ctx->cpuinfo->has_x86_sse4_1)
+        ADD_BLT_IMPL("SSE4.1", sse4_1);
+    if (ctx->cpuinfo->has_x86_sse2)
+        ADD_BLT_IMPL("SSE2", sse2);
+#endif
+    return n;
+}
+
+static void use_blt_impl(cpu_backend_t *ctx, blt_impl_t *impl)
+{
+    ctx->blt2d.overlapped_blt = impl->overlapped_blt;
+    ctx->blt2d_impl_name      = impl->name;
+    ctx->aligned_fetch        = impl->aligned_fetch;
+}
+
+static void set_blt_impl(cpu_backend_t *ctx, const char *name)
+{
+    blt_impl_t impls[MAX_BLT_IMPLS];
+    int i, n = get_blt_impls(ctx, impls);
+    for (i = 0; i < n; i++) {
+        if (strcmp(impls[i].name, name) == 0) {
+            use_blt_impl(ctx, &impls[i]);
+            return;
+        }
+    }
+}
+
 cpu_backend_t *cpu_backend_init(uint8_t *uncached_buffer,
                                 size_t   uncached_buffer_size)
 {
@@ -301,32 +1407,224 @@ cpu_backend_t *cpu_backend_init(uint8_t *uncached_buffer,
 
     ctx->blt2d.self = ctx;
     ctx->blt2d.overlapped_blt = overlapped_blt_noop;
+    ctx->blt2d.overlapped_blt_boxes = overlapped_blt_boxes;
+    ctx->blt2d_impl_name = "none";
+    ctx->scratch_size = 2048;
+    ctx->writeback = writeback_scratch_to_mem_generic;
 
     ctx->cpuinfo = cpuinfo_init();
 
+#ifdef __arm__
+    if (ctx->cpuinfo->has_arm_neon) {
+        ctx->convert_8888_to_0565 = convert_8888_to_0565_neon;
+        ctx->convert_0565_to_8888 = convert_0565_to_8888_neon;
+        ctx->writeback = writeback_scratch_to_mem_neon;
+    }
+    else {
+        ctx->writeback = writeback_scratch_to_mem_arm;
+    }
+#endif
+#ifdef __aarch64__
+    ctx->convert_8888_to_0565 = convert_8888_to_0565_neon;
+    ctx->convert_0565_to_8888 = convert_0565_to_8888_neon;
+    ctx->writeback = writeback_scratch_to_mem_neon;
+#endif
+#ifdef __x86_64__
+    if (ctx->cpuinfo->has_x86_sse2) {
+        ctx->convert_8888_to_0565 = convert_8888_to_0565_sse2;
+        ctx->convert_0565_to_8888 = convert_0565_to_8888_sse2;
+    }
+#endif
+
+    /*
+     * The initial guess, which is used until (and unless) the
+     * cpu_backend_calibrate() function is called.
+     */
 #ifdef __arm__
     if (ctx->cpuinfo->has_arm_neon &&
         ctx->cpuinfo->arm_implementer == 0x41 &&
         ctx->cpuinfo->arm_part == 0xC08)
     {
         /* NEON works better on Cortex-A8 */
-        ctx->blt2d.overlapped_blt = overlapped_blt_neon;
+        set_blt_impl(ctx, "NEON");
     }
     else if (ctx->cpuinfo->has_arm_wmmx) {
         /* ARM LDM/STM works better than VFP/WMMX on Marvell PJ4 */
-        ctx->blt2d.overlapped_blt = overlapped_blt_arm;
+        set_blt_impl(ctx, "ARM");
     }
     else if (ctx->cpuinfo->has_arm_vfp && ctx->cpuinfo->has_arm_edsp) {
         /* VFP works better on Cortex-A9, Cortex-A15 and maybe everything else */
-        ctx->blt2d.overlapped_blt = overlapped_blt_vfp;
+        set_blt_impl(ctx, "VFP");
+    }
+#endif
+
+#ifdef __aarch64__
+    /* NEON (Advanced SIMD) is a mandatory part of AArch64 */
+    set_blt_impl(ctx, "NEON");
+#endif
+
+#ifdef __x86_64__
+    if (ctx->cpuinfo->has_x86_avx2) {
+        /* 256-bit streaming loads, fewer instructions per 64 byte line */
+        set_blt_impl(ctx, "AVX2");
+    }
+    else if (ctx->cpuinfo->has_x86_sse4_1) {
+        /* MOVNTDQA is the fastest way to read from write-combining memory */
+        set_blt_impl(ctx, "SSE4.1");
+    }
+    else if (ctx->cpuinfo->has_x86_sse2) {
+        /* still better than mixing uncached reads and writes in memmove */
+        set_blt_impl(ctx, "SSE2");
     }
 #endif
 
     return ctx;
 }
 
+/*
+ * Calibration: the blits are done inside of the uncached area using
+ * CALIBRATION_ROWS rows of CALIBRATION_STRIDE bytes each (so the area
+ * contents gets corrupted).
+ */
+
+#define CALIBRATION_STRIDE  8192
+#define CALIBRATION_ROWS    32
+#define CALIBRATION_REPEATS 3
+
+static const int calibration_scratch_sizes[] = { 512, 1024, 2048, 4096, 8192 };
+static const int ncalibration_scratch_sizes =
+    sizeof(calibration_scratch_sizes) / sizeof(calibration_scratch_sizes[0]);
+
+static double gettime(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.;
+}
+
+/* Returns the best time of a 'scroll up' + 'move left' pair of blits */
+static double benchmark_blt_impl(cpu_backend_t *ctx, overlapped_blt_t blt,
+                                 uint32_t *bits, int rows)
+{
+    int stride = CALIBRATION_STRIDE / 4, width = stride - 8;
+    double t1, t2, best = 0;
+    int i;
+
+    for (i = 0; i < CALIBRATION_REPEATS; i++) {
+        t1 = gettime();
+        blt(ctx, bits, bits, stride, stride, 32, 32, 0, 1, 0, 0, width, rows - 1);
+        blt(ctx, bits, bits, stride, stride, 32, 32, 1, 0, 0, 0, width, rows);
+        t2 = gettime();
+        if (i == 0 || t2 - t1 < best)
+            best = t2 - t1;
+    }
+    return best;
+}
+
+static void get_calibration_key(cpu_backend_t *ctx, char *buf, size_t size)
+{
+    snprintf(buf, size, "%s, MIDR %02X:%X:%X:%03X:%X, %lu bytes\n",
+             ctx->cpuinfo->processor_name, ctx->cpuinfo->arm_implementer,
+             ctx->cpuinfo->arm_variant, ctx->cpuinfo->arm_architecture,
+             ctx->cpuinfo->arm_part, ctx->cpuinfo->arm_revision,
+             (unsigned long)(ctx->uncached_area_end - ctx->uncached_area_begin));
+}
+
+static int load_calibration(cpu_backend_t *ctx, const char *cache_file)
+{
+    char key[256], buf[256], name[32];
+    int scratch_size;
+    FILE *fd = fopen(cache_file, "r");
+    if (!fd)
+        return 0;
+
+    get_calibration_key(ctx, key, sizeof(key));
+    if (!fgets(buf, sizeof(buf), fd) || strcmp(buf, key) != 0 ||
+        !fgets(buf, sizeof(buf), fd) ||
+        sscanf(buf, "%31s %d", name, &scratch_size) != 2 ||
+        scratch_size < 32 || scratch_size > SCRATCHSIZE_MAX ||
+        scratch_size % 32 != 0)
+    {
+        fclose(fd);
+        return 0;
+    }
+    fclose(fd);
+
+    set_blt_impl(ctx, name);
+    if (strcmp(ctx->blt2d_impl_name, name) != 0)
+        return 0;
+    ctx->scratch_size = scratch_size;
+    return 1;
+}
+
+static void save_calibration(cpu_backend_t *ctx, const char *cache_file)
+{
+    char key[256];
+    FILE *fd = fopen(cache_file, "w");
+    if (!fd)
+        return;
+
+    get_calibration_key(ctx, key, sizeof(key));
+    fprintf(fd, "%s%s %d\n", key, ctx->blt2d_impl_name, ctx->scratch_size);
+    fclose(fd);
+}
+
+int cpu_backend_calibrate(cpu_backend_t *ctx, const char *cache_file)
+{
+    blt_impl_t impls[MAX_BLT_IMPLS];
+    uint32_t *bits = (uint32_t *)(((uintptr_t)ctx->uncached_area_begin + 31) & ~31);
+    int rows = ((ctx->uncached_area_end - (uint8_t *)bits) / CALIBRATION_STRIDE);
+    int i, j, n = get_blt_impls(ctx, impls);
+    int best_scratch_size = ctx->scratch_size;
+    double t, best_t = 0;
+
+    if (cache_file && load_calibration(ctx, cache_file))
+        return CPU_BACKEND_CALIBRATION_CACHED;
+
+    if (rows > CALIBRATION_ROWS)
+        rows = CALIBRATION_ROWS;
+    if (n == 0 || rows < 2)
+        return CPU_BACKEND_CALIBRATION_FAILED;
+
+    for (i = 0; i < n; i++) {
+        for (j = 0; j < ncalibration_scratch_sizes; j++) {
+            ctx->scratch_size = calibration_scratch_sizes[j];
+            t = benchmark_blt_impl(ctx, impls[i].overlapped_blt, bits, rows);
+            if (best_t == 0 || t < best_t) {
+                best_t = t;
+                use_blt_impl(ctx, &impls[i]);
+                best_scratch_size = calibration_scratch_sizes[j];
+            }
+        }
+    }
+    ctx->scratch_size = best_scratch_size;
+
+    if (cache_file)
+        save_calibration(ctx, cache_file);
+    return CPU_BACKEND_CALIBRATION_DONE;
+}
+
+int cpu_backend_start_threads(cpu_backend_t *ctx, int nthreads,
+                              size_t threshold)
+{
+    if (ctx->threads) {
+        stop_threads(ctx->threads);
+        ctx->threads = NULL;
+    }
+    ctx->threads_threshold = threshold;
+
+    /* the current thread also does its share of work */
+    if (nthreads > 1)
+        ctx->threads = start_threads(nthreads - 1);
+
+    return ctx->threads ? ctx->threads->nthreads + 1 : 1;
+}
+
 void cpu_backend_close(cpu_backend_t *ctx)
 {
+    if (ctx->threads)
+        stop_threads(ctx->threads);
+
     if (ctx->cpuinfo)
         cpuinfo_close(ctx->cpuinfo);
 
@@ -29,6 +29,8 @@
 #include "cpuinfo.h"
 #include "interfaces.h"
 
+typedef struct cpu_backend_threads cpu_backend_threads_t;
+
 /*
  * A set of CPU specific optimizations for different operations.
  * Supports a single memory area, where reads are uncached and may
@@ -42,9 +44,94 @@ typedef struct {
     uint8_t   *uncached_area_end;
     /* An accelerated implementation of blt2d_i interface */
     blt2d_i    blt2d;
+    /* The name of the selected implementation (usable for logs, etc.) */
+    const char *blt2d_impl_name;
+    /* The size of the scratch buffer used for the uncached reads */
+    int        scratch_size;
+    /* The function used for fetching data from the uncached area */
+    void     (*aligned_fetch)(int size, void *dst, const void *src);
+    /* The function used for writing data to the uncached area in bursts */
+    void     (*writeback)(int size, void *dst, const void *src);
+    /* SIMD pixel format conversion (only processing multiples of 8 pixels) */
+    void     (*convert_8888_to_0565)(int n, uint16_t *dst, const uint32_t *src);
+    void     (*convert_0565_to_8888)(int n, uint32_t *dst, const uint16_t *src);
+    /* The pool of worker threads (NULL if everything is done in one thread) */
+    cpu_backend_threads_t *threads;
+    /* The blits smaller than this (in bytes) are not split between threads */
+    size_t     threads_threshold;
 } cpu_backend_t;
 
+#define CPU_BACKEND_CALIBRATION_FAILED  0
+#define CPU_BACKEND_CALIBRATION_DONE    1
+#define CPU_BACKEND_CALIBRATION_CACHED  2
+
 cpu_backend_t *cpu_backend_init(uint8_t *uncached_buffer, size_t uncached_buffer_size);
+
+/*
+ * Run a short benchmark, which tries all the available implementations
+ * and scratch buffer sizes on the uncached area (destroying its contents)
+ * and selects the fastest one. If 'cache_file' is not NULL, then the
+ * results are saved there and reused on the next run for the same CPU
+ * and uncached area size instead of running the benchmark again.
+ */
+int cpu_backend_calibrate(cpu_backend_t *cpu_backend, const char *cache_file);
+
+/*
+ * Use up to 'nthreads' threads (including the calling one) for the blits,
+ * which are larger than 'threshold' bytes. Returns the number of threads,
+ * which are actually going to be used.
+ */
+int cpu_backend_start_threads(cpu_backend_t *cpu_backend, int nthreads,
+                              size_t threshold);
 void cpu_backend_close(cpu_backend_t *cpu_backend);
 
+/*
+ * Copy the rectangle (x, y, w, h) from the 'src' image ('src_w' x 'src_h'
+ * pixels) to the 'dst' image, rotated clockwise by 'degrees_cw' (90, 180
+ * or 270) degrees. This is the shadow framebuffer update for a rotated
+ * display, which tries to write the uncached 'dst' in full bursts. The
+ * strides are in 32-bit units. Returns 0 if the operation is not supported
+ * (only 16bpp and 32bpp are).
+ */
+int cpu_backend_rotate_blt(cpu_backend_t *cpu_backend,
+                           uint32_t      *src_bits,
+                           uint32_t      *dst_bits,
+                           int            src_stride,
+                           int            dst_stride,
+                           int            bpp,
+                           int            src_w,
+                           int            src_h,
+                           int            x,
+                           int            y,
+                           int            w,
+                           int            h,
+                           int            degrees_cw);
+
+/*
+ * Copy 'height' rows of 'width' bytes from the uncached area to a cached
+ * buffer, using the same fetch method as the blits. This allows to do
+ * read-modify-write operations on a copy in the cache and then put the
+ * result back with cpu_backend_writeback_rows(). Returns 0 if no fast
+ * method for the uncached reads has been selected.
+ */
+int cpu_backend_fetch_rows(cpu_backend_t *cpu_backend,
+                           uint8_t       *dst,
+                           intptr_t       dst_stride,
+                           const uint8_t *src,
+                           intptr_t       src_stride,
+                           int            width,
+                           int            height);
+
+/*
+ * Write 'height' rows of 'width' bytes to the uncached area in bursts.
+ * Large uploads are split between the worker threads (if started).
+ */
+void cpu_backend_writeback_rows(cpu_backend_t *cpu_backend,
+                                uint8_t       *dst,
+                                intptr_t       dst_stride,
+                                const uint8_t *src,
+                                intptr_t       src_stride,
+                                int            width,
+                                int            height);
+
 #endif
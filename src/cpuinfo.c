@@ -27,6 +27,10 @@
 
 #include "cpuinfo.h"
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <cpuid.h>
+#endif
+
 #if defined(__linux__) || defined(ANDROID) || defined(__ANDROID__)
 
 #define MAXBUFSIZE 16384
@@ -96,6 +100,11 @@ static int parse_proc_cpuinfo(cpuinfo_t *cpuinfo)
             cpuinfo->has_arm_vfp  = find_feature(val, "vfp");
             cpuinfo->has_arm_neon = find_feature(val, "neon");
             cpuinfo->has_arm_wmmx = find_feature(val, "iwmmxt");
+            /* AArch64 kernels use different names for VFP and NEON */
+            if (find_feature(val, "fp"))
+                cpuinfo->has_arm_vfp = 1;
+            if (find_feature(val, "asimd"))
+                cpuinfo->has_arm_neon = 1;
         }
         else if ((val = cpuinfo_match_prefix(buffer, "CPU implementer"))) {
             if (sscanf(val, "%i", &cpuinfo->arm_implementer) != 1) {
@@ -132,6 +141,12 @@ static int parse_proc_cpuinfo(cpuinfo_t *cpuinfo)
                 return 0;
             }
         }
+#ifdef __x86_64__
+        else if ((val = cpuinfo_match_prefix(buffer, "model name"))) {
+            if (!cpuinfo->processor_name)
+                cpuinfo->processor_name = strndup(val, strcspn(val, "\n"));
+        }
+#endif
     }
     fclose(fd);
     free(buffer);
@@ -147,18 +162,62 @@ static int parse_proc_cpuinfo(cpuinfo_t *cpuinfo)
 
 #endif
 
+#if defined(__x86_64__) && defined(__GNUC__)
+
+/* Use CPUID directly, the "flags" line in /proc/cpuinfo is not needed */
+static void detect_x86_features(cpuinfo_t *cpuinfo)
+{
+    unsigned int eax, ebx, ecx, edx, xcr0_lo, xcr0_hi;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return;
+
+    cpuinfo->has_x86_sse2   = (edx & bit_SSE2) != 0;
+    cpuinfo->has_x86_sse4_1 = (ecx & bit_SSE4_1) != 0;
+
+    /* AVX2 also needs the OS to preserve YMM registers on context switch */
+    if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+        return;
+    __asm__ ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+    if ((xcr0_lo & 6) != 6 || __get_cpuid_max(0, NULL) < 7)
+        return;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    cpuinfo->has_x86_avx2 = (ebx & bit_AVX2) != 0;
+}
+
+#else
+
+static void detect_x86_features(cpuinfo_t *cpuinfo)
+{
+}
+
+#endif
+
 cpuinfo_t *cpuinfo_init()
 {
     cpuinfo_t *cpuinfo = calloc(sizeof(cpuinfo_t), 1);
     if (!cpuinfo)
         return NULL;
 
+    detect_x86_features(cpuinfo);
+
     if (!parse_proc_cpuinfo(cpuinfo)) {
-        cpuinfo->processor_name = strdup("Unknown");
+        if (!cpuinfo->processor_name)
+            cpuinfo->processor_name = strdup("Unknown");
         return cpuinfo;
     }
 
-    if (cpuinfo->arm_implementer == 0x41 && cpuinfo->arm_part == 0xC0F) {
+    if (cpuinfo->arm_implementer == 0x41 && cpuinfo->arm_part == 0xD08) {
+        cpuinfo->processor_name = strdup("ARM Cortex-A72");
+    } else if (cpuinfo->arm_implementer == 0x41 && cpuinfo->arm_part == 0xD07) {
+        cpuinfo->processor_name = strdup("ARM Cortex-A57");
+    } else if (cpuinfo->arm_implementer == 0x41 && cpuinfo->arm_part == 0xD05) {
+        cpuinfo->processor_name = strdup("ARM Cortex-A55");
+    } else if (cpuinfo->arm_implementer == 0x41 && cpuinfo->arm_part == 0xD04) {
+        cpuinfo->processor_name = strdup("ARM Cortex-A35");
+    } else if (cpuinfo->arm_implementer == 0x41 && cpuinfo->arm_part == 0xD03) {
+        cpuinfo->processor_name = strdup("ARM Cortex-A53");
+    } else if (cpuinfo->arm_implementer == 0x41 && cpuinfo->arm_part == 0xC0F) {
         cpuinfo->processor_name = strdup("ARM Cortex-A15");
     } else if (cpuinfo->arm_implementer == 0x41 && cpuinfo->arm_part == 0xC09) {
         if (cpuinfo->has_arm_neon)
@@ -178,7 +237,7 @@ cpuinfo_t *cpuinfo_init()
         cpuinfo->processor_name = strdup("ARM1176");
     } else if (cpuinfo->arm_implementer == 0x56 && cpuinfo->arm_part == 0x581) {
         cpuinfo->processor_name = strdup("Marvell PJ4");
-    } else {
+    } else if (!cpuinfo->processor_name) {
         cpuinfo->processor_name = strdup("Unknown");
     }
 
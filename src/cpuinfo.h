@@ -37,6 +37,9 @@ typedef struct {
     int has_arm_vfp;
     int has_arm_neon;
     int has_arm_wmmx;
+    int has_x86_sse2;
+    int has_x86_sse4_1;
+    int has_x86_avx2;
     /* The user-friendly CPU description string (usable for logs, etc.) */
     char *processor_name;
 } cpuinfo_t;
@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <linux/fb.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
@@ -44,7 +45,10 @@
  */
 #define FBUNSUPPORTED		_IOW('z', 0x22, struct fb_copyarea)
 
-/* Fallback to CPU when handling less than COPYAREA_BLT_SIZE_THRESHOLD pixels */
+/*
+ * Fallback to CPU when handling less than COPYAREA_BLT_SIZE_THRESHOLD pixels
+ * (the initial guess for the routing table)
+ */
 #define COPYAREA_BLT_SIZE_THRESHOLD 90
 
 fb_copyarea_t *fb_copyarea_init(const char *device, void *xserver_fbmem)
@@ -117,8 +121,10 @@ fb_copyarea_t *fb_copyarea_init(const char *device, void *xserver_fbmem)
     ctx->bits_per_pixel = fb_var.bits_per_pixel;
     ctx->framebuffer_paddr = fb_fix.smem_start;
     ctx->framebuffer_size = fb_fix.smem_len;
-    ctx->framebuffer_height = ctx->framebuffer_size /
-                              (ctx->xres * ctx->bits_per_pixel / 8);
+    ctx->framebuffer_height = ctx->framebuffer_size / fb_fix.line_length;
+    ctx->framebuffer_width = fb_fix.line_length / (ctx->bits_per_pixel / 8);
+    if (fb_var.xres_virtual > 0 && fb_var.xres_virtual < ctx->framebuffer_width)
+        ctx->framebuffer_width = fb_var.xres_virtual;
     ctx->gfx_layer_size = ctx->xres * ctx->yres * fb_var.bits_per_pixel / 8;
     ctx->framebuffer_stride = fb_fix.line_length / 4;
 
@@ -146,12 +152,140 @@ fb_copyarea_t *fb_copyarea_init(const char *device, void *xserver_fbmem)
 
     ctx->blt2d.self = ctx;
     ctx->blt2d.overlapped_blt = fb_copyarea_blt;
+    ctx->blt2d.overlapped_blt_boxes = fb_copyarea_blt_boxes;
+
+    blt2d_route_init(&ctx->route, COPYAREA_BLT_SIZE_THRESHOLD,
+                     COPYAREA_BLT_SIZE_THRESHOLD);
 
     return ctx;
 }
 
+/*
+ * Wait until all the queued operations are complete, so that the
+ * framebuffer can be safely accessed by the CPU.
+ */
+static void fb_copyarea_sync(void *self)
+{
+    fb_copyarea_t *ctx = (fb_copyarea_t *)self;
+    if (!ctx->async)
+        return;
+    pthread_mutex_lock(&ctx->lock);
+    while (ctx->queue_count > 0)
+        pthread_cond_wait(&ctx->done_cond, &ctx->lock);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+static void *fb_copyarea_thread(void *arg)
+{
+    fb_copyarea_t *ctx = (fb_copyarea_t *)arg;
+    struct fb_copyarea copyarea;
+
+    pthread_mutex_lock(&ctx->lock);
+    while (1) {
+        while (ctx->queue_count == 0 && !ctx->quit)
+            pthread_cond_wait(&ctx->work_cond, &ctx->lock);
+        /* the queue is always drained before quitting */
+        if (ctx->queue_count == 0)
+            break;
+        copyarea = ctx->queue[ctx->queue_head];
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (ioctl(ctx->fd, FBIOCOPYAREA, &copyarea) != 0 &&
+            ctx->fallback_blt2d) {
+            /*
+             * There is no way to report the failure anymore, so do the
+             * copy by the fallback implementation. The CPU accesses to the
+             * framebuffer from the main thread are preceded by a sync, and
+             * the CPU backend thread pool is only used by one thread at a
+             * time (the other one does its job single threaded).
+             */
+            ctx->fallback_blt2d->overlapped_blt(ctx->fallback_blt2d->self,
+                                    (uint32_t *)ctx->framebuffer_addr,
+                                    (uint32_t *)ctx->framebuffer_addr,
+                                    ctx->framebuffer_stride,
+                                    ctx->framebuffer_stride,
+                                    ctx->bits_per_pixel, ctx->bits_per_pixel,
+                                    copyarea.sx, copyarea.sy,
+                                    copyarea.dx, copyarea.dy,
+                                    copyarea.width, copyarea.height);
+        }
+
+        pthread_mutex_lock(&ctx->lock);
+        ctx->queue_head = (ctx->queue_head + 1) % COPYAREA_QUEUE_SIZE;
+        ctx->queue_count--;
+        pthread_cond_signal(&ctx->done_cond);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+    return NULL;
+}
+
+/* Add 'n' operations to the queue (with a single lock/unlock) */
+static void fb_copyarea_queue(fb_copyarea_t *ctx, struct fb_copyarea *copyarea,
+                              int n)
+{
+    if (n <= 0)
+        return;
+    pthread_mutex_lock(&ctx->lock);
+    while (n-- > 0) {
+        while (ctx->queue_count == COPYAREA_QUEUE_SIZE) {
+            pthread_cond_signal(&ctx->work_cond);
+            pthread_cond_wait(&ctx->done_cond, &ctx->lock);
+        }
+        ctx->queue[(ctx->queue_head + ctx->queue_count) % COPYAREA_QUEUE_SIZE] =
+                                                                *copyarea++;
+        ctx->queue_count++;
+    }
+    pthread_cond_signal(&ctx->work_cond);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+int fb_copyarea_enable_async(fb_copyarea_t *ctx)
+{
+    sigset_t sigset, old_sigset;
+    int result;
+
+    if (ctx->async)
+        return 1;
+
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->work_cond, NULL);
+    pthread_cond_init(&ctx->done_cond, NULL);
+    ctx->queue_head = 0;
+    ctx->queue_count = 0;
+    ctx->quit = 0;
+
+    /* the signals must be only delivered to the main thread */
+    sigfillset(&sigset);
+    pthread_sigmask(SIG_BLOCK, &sigset, &old_sigset);
+    result = pthread_create(&ctx->thread, NULL, fb_copyarea_thread, ctx);
+    pthread_sigmask(SIG_SETMASK, &old_sigset, NULL);
+
+    if (result != 0) {
+        pthread_cond_destroy(&ctx->done_cond);
+        pthread_cond_destroy(&ctx->work_cond);
+        pthread_mutex_destroy(&ctx->lock);
+        return 0;
+    }
+
+    ctx->async = 1;
+    ctx->blt2d.sync = fb_copyarea_sync;
+    /* the ioctls complete later, so there is nothing to measure */
+    ctx->route.sampling = 0;
+    return 1;
+}
+
 void fb_copyarea_close(fb_copyarea_t *ctx)
 {
+    if (ctx->async) {
+        pthread_mutex_lock(&ctx->lock);
+        ctx->quit = 1;
+        pthread_cond_signal(&ctx->work_cond);
+        pthread_mutex_unlock(&ctx->lock);
+        pthread_join(ctx->thread, NULL);
+        pthread_cond_destroy(&ctx->done_cond);
+        pthread_cond_destroy(&ctx->work_cond);
+        pthread_mutex_destroy(&ctx->lock);
+    }
     close(ctx->fd);
     free(ctx);
 }
@@ -171,6 +305,8 @@ static inline int try_fallback_blt(void               *self,
                                    int                 h)
 {
     fb_copyarea_t *ctx = (fb_copyarea_t *)self;
+    /* the CPU is going to access the framebuffer, or the caller will */
+    fb_copyarea_sync(ctx);
     if (ctx->fallback_blt2d)
         return ctx->fallback_blt2d->overlapped_blt(ctx->fallback_blt2d->self,
                                                    src_bits, dst_bits,
@@ -181,6 +317,37 @@ static inline int try_fallback_blt(void               *self,
     return 0;
 }
 
+/*
+ * Translate the (x, y) position in the image at 'bits' into the coordinates
+ * in the virtual framebuffer (which also includes the offscreen area after
+ * the visible part). The image must have the same stride as the framebuffer.
+ * Returns 0 if the w x h rectangle at this position does not entirely fit
+ * into the virtual framebuffer.
+ */
+static int fb_copyarea_translate(fb_copyarea_t *ctx, uint32_t *bits,
+                                 int x, int y, int w, int h,
+                                 uint32_t *fb_x, uint32_t *fb_y)
+{
+    uintptr_t bytes_per_pixel = ctx->bits_per_pixel / 8;
+    uintptr_t line_length = (uintptr_t)ctx->framebuffer_stride * 4;
+    uintptr_t offs;
+
+    if ((uint8_t *)bits < ctx->framebuffer_addr ||
+        (uint8_t *)bits >= ctx->framebuffer_addr + ctx->framebuffer_size ||
+        x < 0 || y < 0)
+        return 0;
+
+    offs = (uint8_t *)bits - ctx->framebuffer_addr +
+           (uintptr_t)y * line_length + (uintptr_t)x * bytes_per_pixel;
+    if (offs % bytes_per_pixel)
+        return 0;
+
+    *fb_y = offs / line_length;
+    *fb_x = offs % line_length / bytes_per_pixel;
+    return *fb_x + w <= ctx->framebuffer_width &&
+           *fb_y + h <= ctx->framebuffer_height;
+}
+
 #define FALLBACK_BLT() try_fallback_blt(self, src_bits,        \
                                         dst_bits, src_stride,  \
                                         dst_stride, src_bpp,   \
@@ -203,26 +370,139 @@ int fb_copyarea_blt(void               *self,
 {
     fb_copyarea_t *ctx = (fb_copyarea_t *)self;
     struct fb_copyarea copyarea;
-    uint32_t *framebuffer_addr = (uint32_t *)ctx->framebuffer_addr;
+    blt2d_route_cell_t *cell;
+    int64_t t;
+    int result;
 
     /* Zero size blit, nothing to do */
     if (w <= 0 || h <= 0)
         return 1;
 
+    /*
+     * Both source and destination may be anywhere in the virtual
+     * framebuffer (for example, offscreen pixmaps), as long as they
+     * use the same stride as the framebuffer itself.
+     */
     if (src_bpp != dst_bpp || src_bpp != ctx->bits_per_pixel ||
         src_stride != dst_stride || src_stride != ctx->framebuffer_stride ||
-        src_bits != dst_bits || src_bits != framebuffer_addr) {
+        !fb_copyarea_translate(ctx, src_bits, src_x, src_y, w, h,
+                               &copyarea.sx, &copyarea.sy) ||
+        !fb_copyarea_translate(ctx, dst_bits, dst_x, dst_y, w, h,
+                               &copyarea.dx, &copyarea.dy)) {
         return FALLBACK_BLT();
     }
 
-    if (w * h < COPYAREA_BLT_SIZE_THRESHOLD)
-        return FALLBACK_BLT();
+    cell = blt2d_route_get_cell(&ctx->route, src_bits, dst_bits,
+                                src_bpp, dst_bpp, src_x, src_y,
+                                dst_x, dst_y, w, h);
+    if (!blt2d_route_start(&ctx->route, cell, w * h, &t)) {
+        result = FALLBACK_BLT();
+        if (result)
+            blt2d_route_finish(&ctx->route, cell, 0, w * h, t);
+        return result;
+    }
 
-    copyarea.sx = src_x;
-    copyarea.sy = src_y;
-    copyarea.dx = dst_x;
-    copyarea.dy = dst_y;
     copyarea.width = w;
     copyarea.height = h;
-    return ioctl(ctx->fd, FBIOCOPYAREA, &copyarea) == 0;
+
+    if (ctx->async) {
+        fb_copyarea_queue(ctx, &copyarea, 1);
+        return 1;
+    }
+    /* the kernel may still reject areas outside of its virtual resolution */
+    if (ioctl(ctx->fd, FBIOCOPYAREA, &copyarea) == 0) {
+        blt2d_route_finish(&ctx->route, cell, 1, w * h, t);
+        return 1;
+    }
+    return FALLBACK_BLT();
+}
+
+int fb_copyarea_calibrate(fb_copyarea_t *ctx)
+{
+    uintptr_t line_length = (uintptr_t)ctx->framebuffer_stride * 4;
+    int first_row = (ctx->gfx_layer_size + line_length - 1) / line_length;
+
+    if (ctx->async || !ctx->fallback_blt2d ||
+        first_row >= ctx->framebuffer_height)
+        return 0;
+
+    return blt2d_route_calibrate(&ctx->route, &ctx->blt2d,
+                (uint32_t *)(ctx->framebuffer_addr + first_row * line_length),
+                ctx->framebuffer_stride, ctx->framebuffer_height - first_row,
+                ctx->bits_per_pixel);
+}
+
+/*
+ * FBIOCOPYAREA can only copy one rectangle per ioctl. But in the
+ * asynchronous mode, all the boxes can be at least added to the queue
+ * at once, so that the worker thread is not woken up for every box.
+ */
+int fb_copyarea_blt_boxes(void               *self,
+                          uint32_t           *src_bits,
+                          uint32_t           *dst_bits,
+                          int                 src_stride,
+                          int                 dst_stride,
+                          int                 src_bpp,
+                          int                 dst_bpp,
+                          int                 src_x,
+                          int                 src_y,
+                          int                 dst_x,
+                          int                 dst_y,
+                          blt2d_box_t        *boxes,
+                          int                 nboxes)
+{
+    fb_copyarea_t *ctx = (fb_copyarea_t *)self;
+    struct fb_copyarea batch[COPYAREA_QUEUE_SIZE];
+    blt2d_box_t box;
+    int nbatch = 0, i = 0, n, w, h;
+
+    if (!ctx->async ||
+        src_bpp != dst_bpp || src_bpp != ctx->bits_per_pixel ||
+        src_stride != dst_stride || src_stride != ctx->framebuffer_stride) {
+        return blt2d_overlapped_blt_boxes_by_one(&ctx->blt2d,
+                                                 src_bits, dst_bits,
+                                                 src_stride, dst_stride,
+                                                 src_bpp, dst_bpp,
+                                                 src_x, src_y, dst_x, dst_y,
+                                                 boxes, nboxes);
+    }
+
+    while (i < nboxes) {
+        struct fb_copyarea *copyarea = &batch[nbatch];
+        n = blt2d_merge_boxes(boxes + i, nboxes - i, &box);
+        w = box.x2 - box.x1;
+        h = box.y2 - box.y1;
+        if (blt2d_route_prefer_hw(&ctx->route,
+                blt2d_route_get_cell(&ctx->route, src_bits, dst_bits,
+                                     src_bpp, dst_bpp,
+                                     src_x + box.x1, src_y + box.y1,
+                                     dst_x + box.x1, dst_y + box.y1, w, h),
+                w * h) &&
+            fb_copyarea_translate(ctx, src_bits, src_x + box.x1,
+                                  src_y + box.y1, w, h,
+                                  &copyarea->sx, &copyarea->sy) &&
+            fb_copyarea_translate(ctx, dst_bits, dst_x + box.x1,
+                                  dst_y + box.y1, w, h,
+                                  &copyarea->dx, &copyarea->dy)) {
+            copyarea->width = w;
+            copyarea->height = h;
+            if (++nbatch == COPYAREA_QUEUE_SIZE) {
+                fb_copyarea_queue(ctx, batch, nbatch);
+                nbatch = 0;
+            }
+        }
+        else {
+            /* the CPU fallback needs the already queued boxes to be done */
+            fb_copyarea_queue(ctx, batch, nbatch);
+            nbatch = 0;
+            if (!try_fallback_blt(self, src_bits, dst_bits,
+                                  src_stride, dst_stride, src_bpp, dst_bpp,
+                                  src_x + box.x1, src_y + box.y1,
+                                  dst_x + box.x1, dst_y + box.y1, w, h))
+                return i;
+        }
+        i += n;
+    }
+    fb_copyarea_queue(ctx, batch, nbatch);
+    return nboxes;
 }
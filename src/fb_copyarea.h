@@ -24,7 +24,14 @@
 #ifndef FB_COPYAREA_H
 #define FB_COPYAREA_H
 
+#include <pthread.h>
+#include <linux/fb.h>
+
 #include "interfaces.h"
+#include "blt2d_route.h"
+
+/* The maximal number of copy operations queued in the asynchronous mode */
+#define COPYAREA_QUEUE_SIZE 64
 
 typedef struct {
     /* framebuffer descriptor */
@@ -34,6 +41,7 @@ typedef struct {
     uint8_t            *framebuffer_addr;  /* mmapped address */
     uintptr_t           framebuffer_paddr; /* physical address */
     uint32_t            framebuffer_size;  /* total size of the framebuffer */
+    int                 framebuffer_width; /* virtual horizontal resolution */
     int                 framebuffer_height;/* virtual vertical resolution */
     int                 framebuffer_stride;
     uint32_t            gfx_layer_size;    /* the size of the primary layer */
@@ -44,11 +52,43 @@ typedef struct {
     blt2d_i             blt2d;
     /* Optional fallback interface to handle unsupported operations */
     blt2d_i            *fallback_blt2d;
+    /* Chooses between FBIOCOPYAREA and the fallback interface */
+    blt2d_route_t       route;
+
+    /*
+     * Asynchronous mode: the FBIOCOPYAREA ioctls are submitted by a worker
+     * thread, so that X server can do something else while the hardware
+     * is busy. The operations stay in the queue until they are complete.
+     */
+    int                 async;
+    pthread_t           thread;
+    pthread_mutex_t     lock;
+    pthread_cond_t      work_cond;  /* signalled when the queue gets work */
+    pthread_cond_t      done_cond;  /* signalled when an operation is done */
+    struct fb_copyarea  queue[COPYAREA_QUEUE_SIZE];
+    int                 queue_head;
+    int                 queue_count;
+    int                 quit;
 } fb_copyarea_t;
 
 fb_copyarea_t *fb_copyarea_init(const char *fb_device, void *xserver_fbmem);
 void fb_copyarea_close(fb_copyarea_t *fb_copyarea);
 
+/*
+ * Start the worker thread for asynchronous FBIOCOPYAREA submission.
+ * After this, the blt2d.sync method must be used before accessing
+ * the framebuffer by the CPU.
+ */
+int fb_copyarea_enable_async(fb_copyarea_t *fb_copyarea);
+
+/*
+ * Measure the speed of FBIOCOPYAREA and the fallback interface for
+ * different kinds of blits and update the routing table. Uses (and
+ * destroys the contents of) the offscreen part of the framebuffer.
+ * Needs to be done before enabling the asynchronous mode.
+ */
+int fb_copyarea_calibrate(fb_copyarea_t *fb_copyarea);
+
 int fb_copyarea_blt(void               *self,
                     uint32_t           *src_bits,
                     uint32_t           *dst_bits,
@@ -63,4 +103,18 @@ int fb_copyarea_blt(void               *self,
                     int                 w,
                     int                 h);
 
+int fb_copyarea_blt_boxes(void               *self,
+                          uint32_t           *src_bits,
+                          uint32_t           *dst_bits,
+                          int                 src_stride,
+                          int                 dst_stride,
+                          int                 src_bpp,
+                          int                 dst_bpp,
+                          int                 src_x,
+                          int                 src_y,
+                          int                 dst_x,
+                          int                 dst_y,
+                          blt2d_box_t        *boxes,
+                          int                 nboxes);
+
 #endif
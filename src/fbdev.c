@@ -34,6 +34,7 @@
 #endif
 
 #include <string.h>
+#include <unistd.h>
 
 /* all driver need this */
 #include "xf86.h"
@@ -54,6 +55,7 @@
 #include "sunxi_x_g2d.h"
 #include "backing_store_tuner.h"
 #include "sunxi_video.h"
+#include "sunxi_pixmap_heap.h"
 
 #ifdef HAVE_LIBUMP
 #include "sunxi_mali_ump_dri2.h"
@@ -102,6 +104,9 @@ static Bool	FBDevCloseScreen(CLOSE_SCREEN_ARGS_DECL);
 static void *	FBDevWindowLinear(ScreenPtr pScreen, CARD32 row, CARD32 offset, int mode,
 				  CARD32 *size, void *closure);
 static void	FBDevPointerMoved(SCRN_ARG_TYPE arg, int x, int y);
+static void	FBDevLeaveVT(VT_FUNC_ARGS_DECL);
+static void	FBDevShadowUpdateRotate(ScreenPtr pScreen, shadowBufPtr pBuf);
+static void	FBDevShadowUpdateRotateG2D(ScreenPtr pScreen, shadowBufPtr pBuf);
 static Bool	FBDevDGAInit(ScrnInfoPtr pScrn, ScreenPtr pScreen);
 static Bool	FBDevDriverFunc(ScrnInfoPtr pScrn, xorgDriverFuncOp op,
 				pointer ptr);
@@ -122,6 +127,9 @@ static int pix24bpp = 0;
 #define FBDEV_NAME		"FBTURBO"
 #define FBDEV_DRIVER_NAME	"fbturbo"
 
+/* The file for caching the results of CPU blitter calibration */
+#define CPU_BLT_CALIBRATION_FILE "/var/cache/fbturbo_cpu_blit"
+
 #ifdef XSERVER_LIBPCIACCESS
 static const struct pci_id_match fbdev_device_match[] = {
     {
@@ -173,6 +181,15 @@ typedef enum {
 	OPTION_USE_BS,
 	OPTION_FORCE_BS,
 	OPTION_XV_OVERLAY,
+	OPTION_XV_BUFFERS,
+	OPTION_CPU_BLT_CALIBRATION,
+	OPTION_CPU_BLT_THREADS,
+	OPTION_CPU_BLT_THREAD_THRESHOLD,
+	OPTION_COPYAREA_ASYNC,
+	OPTION_PIXMAP_HEAP_SIZE,
+	OPTION_G2D_CPU_SPLIT,
+	OPTION_ACCEL_BLT_CALIBRATION,
+	OPTION_ACCEL_BLT_THRESHOLD,
 } FBDevOpts;
 
 static const OptionInfoRec FBDevOptions[] = {
@@ -189,6 +206,15 @@ static const OptionInfoRec FBDevOptions[] = {
 	{ OPTION_USE_BS,	"UseBackingStore",OPTV_BOOLEAN,	{0},	FALSE },
 	{ OPTION_FORCE_BS,	"ForceBackingStore",OPTV_BOOLEAN,{0},	FALSE },
 	{ OPTION_XV_OVERLAY,	"XVHWOverlay",	OPTV_BOOLEAN,	{0},	FALSE },
+	{ OPTION_XV_BUFFERS,	"XVBuffers",	OPTV_INTEGER,	{0},	FALSE },
+	{ OPTION_CPU_BLT_CALIBRATION,"CPUBlitCalibration",OPTV_BOOLEAN,{0},FALSE },
+	{ OPTION_CPU_BLT_THREADS,"CPUBlitThreads",OPTV_INTEGER,	{0},	FALSE },
+	{ OPTION_CPU_BLT_THREAD_THRESHOLD,"CPUBlitThreadThreshold",OPTV_INTEGER,{0},FALSE },
+	{ OPTION_COPYAREA_ASYNC,"CopyAreaAsync",OPTV_BOOLEAN,	{0},	FALSE },
+	{ OPTION_PIXMAP_HEAP_SIZE,"PixmapHeapSize",OPTV_INTEGER,	{0},	FALSE },
+	{ OPTION_G2D_CPU_SPLIT,	"G2DCPUSplit",	OPTV_BOOLEAN,	{0},	FALSE },
+	{ OPTION_ACCEL_BLT_CALIBRATION,"AccelBlitCalibration",OPTV_BOOLEAN,{0},FALSE },
+	{ OPTION_ACCEL_BLT_THRESHOLD,"AccelBlitThreshold",OPTV_INTEGER,{0},FALSE },
 	{ -1,			NULL,		OPTV_NONE,	{0},	FALSE }
 };
 
@@ -663,6 +689,7 @@ FBDevCreateScreenResources(ScreenPtr pScreen)
     PixmapPtr pPixmap;
     ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
     FBDevPtr fPtr = FBDEVPTR(pScrn);
+    ShadowUpdateProc update;
     Bool ret;
 
     pScreen->CreateScreenResources = fPtr->CreateScreenResources;
@@ -674,8 +701,16 @@ FBDevCreateScreenResources(ScreenPtr pScreen)
 
     pPixmap = pScreen->GetScreenPixmap(pScreen);
 
-    if (!shadowAdd(pScreen, pPixmap, fPtr->rotate ?
-		   shadowUpdateRotatePackedWeak() : shadowUpdatePackedWeak(),
+    if (!fPtr->rotate)
+	update = shadowUpdatePackedWeak();
+    else if (SUNXI_DISP(pScrn) && SUNXI_DISP(pScrn)->rotate_staging_size)
+	update = FBDevShadowUpdateRotateG2D;
+    else if (pScrn->bitsPerPixel == 16 || pScrn->bitsPerPixel == 32)
+	update = FBDevShadowUpdateRotate;
+    else
+	update = shadowUpdateRotatePackedWeak();
+
+    if (!shadowAdd(pScreen, pPixmap, update,
 		   FBDevWindowLinear, fPtr->rotate, NULL)) {
 	return FALSE;
     }
@@ -711,6 +746,8 @@ FBDevScreenInit(SCREEN_INIT_ARGS_DECL)
 	int type;
 	char *accelmethod;
 	cpu_backend_t *cpu_backend;
+	int cpu_threads, cpu_threads_threshold = 256;
+	int accel_blt_threshold = 0;
 	Bool useBackingStore = FALSE, forceBackingStore = FALSE;
 
 	TRACE_ENTER("FBDevScreenInit");
@@ -884,7 +921,7 @@ FBDevScreenInit(SCREEN_INIT_ARGS_DECL)
 	 */
 	useBackingStore = xf86ReturnOptValBool(fPtr->Options, OPTION_USE_BS,
 	                                       !fPtr->shadowFB);
-#ifndef __arm__
+#if !defined(__arm__) && !defined(__aarch64__)
 	/*
 	 * right now we can only make "smart" decisions on ARM hardware,
 	 * everything else (for example x86) would take a performance hit
@@ -905,6 +942,52 @@ FBDevScreenInit(SCREEN_INIT_ARGS_DECL)
 	cpu_backend = cpu_backend_init(fPtr->fbmem, pScrn->videoRam);
 	fPtr->cpu_backend_private = cpu_backend;
 
+	/*
+	 * pick the fastest CPU blitter implementation for this particular
+	 * combination of the processor and memory controller (the framebuffer
+	 * contents is not important yet at this point, so it can be trashed)
+	 */
+	if (xf86ReturnOptValBool(fPtr->Options, OPTION_CPU_BLT_CALIBRATION, TRUE)) {
+		switch (cpu_backend_calibrate(cpu_backend, CPU_BLT_CALIBRATION_FILE)) {
+		case CPU_BACKEND_CALIBRATION_DONE:
+			xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+			           "CPU blitter calibration: %s, %d bytes scratch buffer\n",
+			           cpu_backend->blt2d_impl_name, cpu_backend->scratch_size);
+			break;
+		case CPU_BACKEND_CALIBRATION_CACHED:
+			xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+			           "CPU blitter calibration: %s, %d bytes scratch buffer"
+			           " (cached in %s)\n", cpu_backend->blt2d_impl_name,
+			           cpu_backend->scratch_size, CPU_BLT_CALIBRATION_FILE);
+			break;
+		default:
+			xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+			           "CPU blitter calibration failed, using %s\n",
+			           cpu_backend->blt2d_impl_name);
+			break;
+		}
+	}
+
+	/* split large blits between multiple CPU cores */
+	cpu_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpu_threads > 4)
+		cpu_threads = 4;
+	xf86GetOptValInteger(fPtr->Options, OPTION_CPU_BLT_THREADS, &cpu_threads);
+	xf86GetOptValInteger(fPtr->Options, OPTION_CPU_BLT_THREAD_THRESHOLD,
+	                     &cpu_threads_threshold);
+	if (cpu_threads > 1 && cpu_threads_threshold >= 0) {
+		cpu_threads = cpu_backend_start_threads(cpu_backend, cpu_threads,
+		                                        cpu_threads_threshold * 1024);
+		if (cpu_threads > 1)
+			xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+			           "using %d threads for CPU blits larger than %d KiB\n",
+			           cpu_threads, cpu_threads_threshold);
+	}
+
+	/* a fixed area threshold instead of the calibrated routing table */
+	xf86GetOptValInteger(fPtr->Options, OPTION_ACCEL_BLT_THRESHOLD,
+	                     &accel_blt_threshold);
+
 	/* try to load G2D kernel module before initializing sunxi-disp */
 	if (!xf86LoadKernelModule("g2d_23"))
 		xf86DrvMsg(pScrn->scrnIndex, X_INFO,
@@ -928,6 +1011,26 @@ FBDevScreenInit(SCREEN_INIT_ARGS_DECL)
 		    (fPtr->SunxiG2D_private = SunxiG2D_Init(pScreen, &disp->blt2d))) {
 			disp->fallback_blt2d = &cpu_backend->blt2d;
 			xf86DrvMsg(pScrn->scrnIndex, X_INFO, "enabled G2D acceleration\n");
+			if (accel_blt_threshold > 0) {
+				disp->route.threshold = accel_blt_threshold;
+				xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+				           "using G2D for blits of %d pixels or more\n",
+				           accel_blt_threshold);
+			}
+			else if (xf86ReturnOptValBool(fPtr->Options,
+			                              OPTION_ACCEL_BLT_CALIBRATION, TRUE) &&
+			         sunxi_g2d_calibrate(disp)) {
+				xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+				           "calibrated the choice between G2D and CPU blits\n");
+			}
+			if (xf86ReturnOptValBool(fPtr->Options, OPTION_G2D_CPU_SPLIT, FALSE)) {
+				if (sunxi_g2d_enable_split(disp))
+					xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+					           "splitting large blits between G2D and CPU\n");
+				else
+					xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+					           "failed to start the G2D worker thread\n");
+			}
 		}
 		else {
 			xf86DrvMsg(pScreen->myNum, X_INFO,
@@ -945,8 +1048,28 @@ FBDevScreenInit(SCREEN_INIT_ARGS_DECL)
 		if (!(accelmethod = xf86GetOptValString(fPtr->Options, OPTION_ACCELMETHOD)) ||
 						strcasecmp(accelmethod, "copyarea") == 0) {
 			fb_copyarea_t *fb = fPtr->fb_copyarea_private;
+			fb->fallback_blt2d = &cpu_backend->blt2d;
+			if (accel_blt_threshold > 0) {
+				fb->route.threshold = accel_blt_threshold;
+				xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+				           "using fbdev copyarea for blits of %d pixels or more\n",
+				           accel_blt_threshold);
+			}
+			else if (xf86ReturnOptValBool(fPtr->Options,
+			                              OPTION_ACCEL_BLT_CALIBRATION, TRUE) &&
+			         fb_copyarea_calibrate(fb)) {
+				xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+				           "calibrated the choice between fbdev copyarea and CPU blits\n");
+			}
+			if (xf86ReturnOptValBool(fPtr->Options, OPTION_COPYAREA_ASYNC, FALSE)) {
+				if (fb_copyarea_enable_async(fb))
+					xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+					           "using asynchronous fbdev copyarea submission\n");
+				else
+					xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+					           "failed to start the fbdev copyarea thread\n");
+			}
 			if ((fPtr->SunxiG2D_private = SunxiG2D_Init(pScreen, &fb->blt2d))) {
-				fb->fallback_blt2d = &cpu_backend->blt2d;
 				xf86DrvMsg(pScrn->scrnIndex, X_INFO,
 				           "enabled fbdev copyarea acceleration\n");
 			}
@@ -966,6 +1089,47 @@ FBDevScreenInit(SCREEN_INIT_ARGS_DECL)
 			xf86DrvMsg(pScrn->scrnIndex, X_INFO, "enabled VFP/NEON optimizations\n");
 		}
 	}
+	else if (!fPtr->SunxiG2D_private && cpu_backend->cpuinfo->has_x86_sse2 &&
+	         !fPtr->shadowFB) {
+		/* with ShadowFB (the default on x86) the screen pixmap is cached */
+		if ((fPtr->SunxiG2D_private = SunxiG2D_Init(pScreen, &cpu_backend->blt2d))) {
+			xf86DrvMsg(pScrn->scrnIndex, X_INFO, "enabled %s optimizations\n",
+			           cpu_backend->cpuinfo->has_x86_avx2 ? "AVX2" :
+			           cpu_backend->cpuinfo->has_x86_sse4_1 ? "SSE4.1" : "SSE2");
+		}
+	}
+
+	if (fPtr->SunxiG2D_private && fPtr->sunxi_disp_private &&
+	    ((sunxi_disp_t *)fPtr->sunxi_disp_private)->fallback_blt2d &&
+	    !fPtr->shadowFB) {
+		sunxi_disp_t *disp = fPtr->sunxi_disp_private;
+		int heap_size = 0;
+		xf86GetOptValInteger(fPtr->Options, OPTION_PIXMAP_HEAP_SIZE,
+		                     &heap_size);
+		if (heap_size > 0 &&
+		    (fPtr->SunxiPixmapHeap_private = SunxiPixmapHeap_Init(pScreen,
+		                      disp, &cpu_backend->blt2d, heap_size << 20))) {
+			pScrn->LeaveVT = FBDevLeaveVT;
+			xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+			           "using %d MiB of offscreen framebuffer memory for pixmaps\n",
+			           heap_size);
+		}
+		else if (heap_size > 0) {
+			xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+			           "failed to reserve %d MiB of offscreen framebuffer memory for pixmaps\n",
+			           heap_size);
+		}
+	}
+
+	if (fPtr->rotate && fPtr->SunxiG2D_private && fPtr->sunxi_disp_private &&
+	    ((sunxi_disp_t *)fPtr->sunxi_disp_private)->fallback_blt2d) {
+		if (sunxi_g2d_reserve_rotate_staging(fPtr->sunxi_disp_private))
+			xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+			           "using G2D for the display rotation\n");
+		else
+			xf86DrvMsg(pScrn->scrnIndex, X_INFO,
+			           "not enough offscreen memory for G2D rotation\n");
+	}
 
 	if (fPtr->shadowFB && !FBDevShadowInit(pScreen)) {
 	    xf86DrvMsg(pScrn->scrnIndex, X_ERROR,
@@ -1041,10 +1205,13 @@ FBDevScreenInit(SCREEN_INIT_ARGS_DECL)
 	fPtr->SunxiVideo_private = NULL;
 	if (xf86ReturnOptValBool(fPtr->Options, OPTION_XV_OVERLAY, TRUE) &&
 	fPtr->sunxi_disp_private) {
-	    fPtr->SunxiVideo_private = SunxiVideo_Init(pScreen);
+	    int xv_buffers = 3;
+	    xf86GetOptValInteger(fPtr->Options, OPTION_XV_BUFFERS, &xv_buffers);
+	    fPtr->SunxiVideo_private = SunxiVideo_Init(pScreen, xv_buffers);
 	    if (fPtr->SunxiVideo_private)
 		xf86DrvMsg(pScrn->scrnIndex, X_INFO,
-		           "using sunxi disp layers for X video extension\n");
+		           "using sunxi disp layers for X video extension (%d ports)\n",
+		           SUNXI_VIDEO(pScrn)->nports);
 	}
 	else {
 	    XF86VideoAdaptorPtr *ptr;
@@ -1135,6 +1302,12 @@ FBDevCloseScreen(CLOSE_SCREEN_ARGS_DECL)
 	}
 #endif
 
+	if (fPtr->SunxiPixmapHeap_private) {
+	    SunxiPixmapHeap_Close(pScreen);
+	    free(fPtr->SunxiPixmapHeap_private);
+	    fPtr->SunxiPixmapHeap_private = NULL;
+	}
+
 	fbdevHWRestore(pScrn);
 	fbdevHWUnmapVidmem(pScrn);
 	if (fPtr->shadow) {
@@ -1203,6 +1376,137 @@ FBDevWindowLinear(ScreenPtr pScreen, CARD32 row, CARD32 offset, int mode,
     return ((CARD8 *)fPtr->fbstart + row * fPtr->lineLength + offset);
 }
 
+/*
+ * The rotated shadow update using the CPU backend, which transposes the
+ * damaged boxes in small tiles and writes the framebuffer in full bursts.
+ */
+static void
+FBDevShadowUpdateRotate(ScreenPtr pScreen, shadowBufPtr pBuf)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    FBDevPtr fPtr = FBDEVPTR(pScrn);
+    cpu_backend_t *cpu_backend = fPtr->cpu_backend_private;
+    RegionPtr damage = shadowDamage(pBuf);
+    PixmapPtr pShadow = pBuf->pPixmap;
+    int nbox = RegionNumRects(damage);
+    BoxPtr pbox = RegionRects(damage);
+    FbBits *shaBits;
+    FbStride shaStride;
+    int shaBpp, shaXoff, shaYoff;
+    int lineLength = fbdevHWGetLineLength(pScrn);
+
+    if (!pScrn->vtSema)
+	return;
+
+    if (!cpu_backend || lineLength % 4 != 0) {
+	(*shadowUpdateRotatePackedWeak()) (pScreen, pBuf);
+	return;
+    }
+
+    fbGetDrawable(&pShadow->drawable, shaBits, shaStride, shaBpp,
+                  shaXoff, shaYoff);
+
+    for (; nbox > 0; nbox--, pbox++) {
+	if (!cpu_backend_rotate_blt(cpu_backend, (uint32_t *)shaBits,
+	                            (uint32_t *)fPtr->fbstart,
+	                            shaStride, lineLength / 4, shaBpp,
+	                            pShadow->drawable.width,
+	                            pShadow->drawable.height,
+	                            pbox->x1, pbox->y1,
+	                            pbox->x2 - pbox->x1, pbox->y2 - pbox->y1,
+	                            (360 - fPtr->rotate) % 360)) {
+	    (*shadowUpdateRotatePackedWeak()) (pScreen, pBuf);
+	    return;
+	}
+    }
+}
+
+/*
+ * The rotated shadow update using G2D. The damaged boxes are copied from
+ * the shadow framebuffer (which stays in cached memory) to the staging
+ * buffer in the offscreen part of the framebuffer, in horizontal strips if
+ * the staging buffer is too small, and then G2D rotates them to the screen.
+ * The CPU rotation is only used if something fails.
+ */
+static void
+FBDevShadowUpdateRotateG2D(ScreenPtr pScreen, shadowBufPtr pBuf)
+{
+    ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+    FBDevPtr fPtr = FBDEVPTR(pScrn);
+    sunxi_disp_t *disp = SUNXI_DISP(pScrn);
+    RegionPtr damage = shadowDamage(pBuf);
+    PixmapPtr pShadow = pBuf->pPixmap;
+    int nbox = RegionNumRects(damage);
+    BoxPtr pbox = RegionRects(damage);
+    FbBits *shaBits;
+    FbStride shaStride;
+    int shaBpp, shaXoff, shaYoff;
+    int width = pShadow->drawable.width;
+    int height = pShadow->drawable.height;
+    int degrees_cw = (360 - fPtr->rotate) % 360;
+    uint32_t *staging = (uint32_t *)(disp->framebuffer_addr +
+                                     disp->rotate_staging_offset);
+
+    if (!pScrn->vtSema)
+	return;
+
+    fbGetDrawable(&pShadow->drawable, shaBits, shaStride, shaBpp,
+                  shaXoff, shaYoff);
+
+    for (; nbox > 0; nbox--, pbox++) {
+	int x = pbox->x1, w = pbox->x2 - pbox->x1, y, h;
+	/* G2D and pixman_blt need 32-bit aligned staging stride */
+	int stride = shaBpp == 16 ? (w + 1) & ~1 : w;
+	int strip_h = disp->rotate_staging_size / (stride * shaBpp / 8);
+
+	if (strip_h <= 0)
+	    goto fallback;
+
+	for (y = pbox->y1; y < pbox->y2; y += h) {
+	    int dst_x, dst_y;
+	    h = pbox->y2 - y < strip_h ? pbox->y2 - y : strip_h;
+
+	    switch (degrees_cw) {
+	    case 90:
+		dst_x = height - (y + h);
+		dst_y = x;
+		break;
+	    case 270:
+		dst_x = y;
+		dst_y = width - (x + w);
+		break;
+	    default:
+		dst_x = width - (x + w);
+		dst_y = height - (y + h);
+		break;
+	    }
+
+	    if (!pixman_blt((uint32_t *)shaBits, staging,
+	                    shaStride, stride * shaBpp / 32, shaBpp, shaBpp,
+	                    x + shaXoff, y + shaYoff, 0, 0, w, h) ||
+	        !sunxi_g2d_blit_rotated(disp, w, h, stride, dst_x, dst_y,
+	                                degrees_cw))
+		goto fallback;
+	}
+    }
+    return;
+
+fallback:
+    FBDevShadowUpdateRotate(pScreen, pBuf);
+}
+
+static void
+FBDevLeaveVT(VT_FUNC_ARGS_DECL)
+{
+    SCRN_INFO_PTR(arg);
+
+    /* The framebuffer content is not preserved while we are away */
+    if (SUNXI_PIXMAP_HEAP(pScrn))
+        SunxiPixmapHeap_EvictAll(xf86ScrnToScreen(pScrn));
+
+    fbdevHWLeaveVT(VT_FUNC_ARGS(flags));
+}
+
 static void
 FBDevPointerMoved(SCRN_ARG_TYPE arg, int x, int y)
 {
@@ -62,6 +62,7 @@ typedef struct {
 	void				*SunxiMaliDRI2_private;
 	void				*SunxiG2D_private;
 	void				*SunxiVideo_private;
+	void				*SunxiPixmapHeap_private;
 } FBDevRec, *FBDevPtr;
 
 #define FBDEVPTR(p) ((FBDevPtr)((p)->driverPrivate))
@@ -83,3 +84,6 @@ typedef struct {
 
 #define SUNXI_VIDEO(p) ((SunxiVideo *) \
                         (FBDEVPTR(p)->SunxiVideo_private))
+
+#define SUNXI_PIXMAP_HEAP(p) ((SunxiPixmapHeap *) \
+                              (FBDEVPTR(p)->SunxiPixmapHeap_private))
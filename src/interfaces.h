@@ -24,6 +24,11 @@
 #ifndef INTERFACES_H
 #define INTERFACES_H
 
+/* A rectangle with the same layout as BoxRec from X server (x2/y2 excluded) */
+typedef struct {
+    int16_t x1, y1, x2, y2;
+} blt2d_box_t;
+
 /* A simple interface for 2D graphics operations */
 typedef struct {
     void *self; /* The pointer which needs to be passed to functions */
@@ -45,6 +50,165 @@ typedef struct {
                           int       dst_y,
                           int       w,
                           int       h);
+    /*
+     * Optional (may be NULL). Wait until all the previously submitted
+     * operations are complete. Needs to be called before accessing the
+     * destination memory in any other way if the operations are done
+     * asynchronously.
+     */
+    void (*sync)(void *self);
+    /*
+     * Optional (may be NULL). Copy a list of boxes with a single call. The
+     * box (x1, y1) corner is copied from (src_x + x1, src_y + y1) to
+     * (dst_x + x1, dst_y + y1). The boxes are processed in the given order
+     * (which must be already safe for overlapped copies, like the order
+     * produced by miCopyRegion) and the adjacent boxes may be merged.
+     * Returns the number of leading boxes, which have been copied. The
+     * caller needs to handle the next box in some other way and then may
+     * try the rest of boxes again.
+     */
+    int (*overlapped_blt_boxes)(void        *self,
+                                uint32_t    *src_bits,
+                                uint32_t    *dst_bits,
+                                int          src_stride,
+                                int          dst_stride,
+                                int          src_bpp,
+                                int          dst_bpp,
+                                int          src_x,
+                                int          src_y,
+                                int          dst_x,
+                                int          dst_y,
+                                blt2d_box_t *boxes,
+                                int          nboxes);
+    /*
+     * Optional (may be NULL). Composite a premultiplied a8r8g8b8 source
+     * over the destination (Render PictOpOver without a mask). The alpha
+     * channel of the destination is not maintained, so the destination
+     * format must be x8r8g8b8 or r5g6b5. The source and the destination
+     * must not be the same buffer. Returns 0 (without modifying anything)
+     * if the operation is not supported.
+     */
+    int (*blend_over)(void     *self,
+                      uint32_t *src_bits,
+                      uint32_t *dst_bits,
+                      int       src_stride,
+                      int       dst_stride,
+                      int       src_bpp,
+                      int       dst_bpp,
+                      int       src_x,
+                      int       src_y,
+                      int       dst_x,
+                      int       dst_y,
+                      int       w,
+                      int       h);
+    /*
+     * Optional (may be NULL). Scale the source rectangle to the destination
+     * rectangle, using the filtering provided by the backend (something
+     * close to bilinear). The source and the destination must not be the
+     * same buffer. Returns 0 (without modifying anything) if the operation
+     * is not supported.
+     */
+    int (*stretch_blt)(void     *self,
+                       uint32_t *src_bits,
+                       uint32_t *dst_bits,
+                       int       src_stride,
+                       int       dst_stride,
+                       int       src_bpp,
+                       int       dst_bpp,
+                       int       src_x,
+                       int       src_y,
+                       int       src_w,
+                       int       src_h,
+                       int       dst_x,
+                       int       dst_y,
+                       int       dst_w,
+                       int       dst_h);
+    /*
+     * Optional (may be NULL). Fill the rectangle with the solid color (the
+     * pixel value in the format of the destination). Returns 0 (without
+     * modifying anything) if the operation is not supported or if it is
+     * better to be done by the CPU (for example, if the area is too small).
+     */
+    int (*fill)(void     *self,
+                uint32_t *bits,
+                int       stride,
+                int       bpp,
+                int       x,
+                int       y,
+                int       w,
+                int       h,
+                uint32_t  color);
 } blt2d_i;
 
+/*
+ * Find how many boxes starting from 'boxes' can be merged into a single
+ * rectangle (stored to 'merged'). The boxes are merged as long as each
+ * next box extends the rectangle horizontally or vertically without gaps.
+ * Doing a single overlapped copy of the merged rectangle is equivalent to
+ * copying the boxes one by one in the original order.
+ */
+static inline int blt2d_merge_boxes(const blt2d_box_t *boxes,
+                                    int                nboxes,
+                                    blt2d_box_t       *merged)
+{
+    int n = 1;
+    *merged = boxes[0];
+    while (n < nboxes) {
+        const blt2d_box_t *b = &boxes[n];
+        if (b->y1 == merged->y1 && b->y2 == merged->y2 &&
+            (b->x1 == merged->x2 || b->x2 == merged->x1)) {
+            if (b->x1 == merged->x2)
+                merged->x2 = b->x2;
+            else
+                merged->x1 = b->x1;
+        }
+        else if (b->x1 == merged->x1 && b->x2 == merged->x2 &&
+                 (b->y1 == merged->y2 || b->y2 == merged->y1)) {
+            if (b->y1 == merged->y2)
+                merged->y2 = b->y2;
+            else
+                merged->y1 = b->y1;
+        }
+        else {
+            break;
+        }
+        n++;
+    }
+    return n;
+}
+
+/*
+ * The overlapped_blt_boxes implementation for the backends, which can only
+ * submit one rectangle at a time: merge the boxes and call overlapped_blt.
+ */
+static inline int blt2d_overlapped_blt_boxes_by_one(
+                                blt2d_i     *blt2d,
+                                uint32_t    *src_bits,
+                                uint32_t    *dst_bits,
+                                int          src_stride,
+                                int          dst_stride,
+                                int          src_bpp,
+                                int          dst_bpp,
+                                int          src_x,
+                                int          src_y,
+                                int          dst_x,
+                                int          dst_y,
+                                blt2d_box_t *boxes,
+                                int          nboxes)
+{
+    blt2d_box_t box;
+    int i = 0, n;
+    while (i < nboxes) {
+        n = blt2d_merge_boxes(boxes + i, nboxes - i, &box);
+        if (!blt2d->overlapped_blt(blt2d->self, src_bits, dst_bits,
+                                   src_stride, dst_stride, src_bpp, dst_bpp,
+                                   src_x + box.x1, src_y + box.y1,
+                                   dst_x + box.x1, dst_y + box.y1,
+                                   box.x2 - box.x1, box.y2 - box.y1))
+            return i;
+        i += n;
+    }
+    return nboxes;
+}
+
 #endif
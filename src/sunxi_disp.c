@@ -27,6 +27,8 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 
@@ -106,6 +108,7 @@ sunxi_disp_t *sunxi_disp_init(const char *device, void *xserver_fbmem)
     ctx->framebuffer_height = ctx->framebuffer_size /
                               (ctx->xres * ctx->bits_per_pixel / 8);
     ctx->gfx_layer_size = ctx->xres * ctx->yres * fb_var.bits_per_pixel / 8;
+    ctx->pixmap_heap_offset = ctx->framebuffer_size;
 
     if (ctx->framebuffer_size < ctx->gfx_layer_size) {
         close(ctx->fd_fb);
@@ -162,8 +165,29 @@ sunxi_disp_t *sunxi_disp_init(const char *device, void *xserver_fbmem)
 
     ctx->fd_g2d = open("/dev/g2d", O_RDWR);
 
+    /*
+     * Reserve the staging buffer for G2D blending at the end of the
+     * framebuffer, but only if this still leaves enough offscreen memory
+     * for tear-free DRI2 double buffering of a fullscreen window.
+     */
+    if (ctx->fd_g2d >= 0 &&
+        ctx->pixmap_heap_offset - ctx->gfx_layer_size >=
+                    ctx->xres * ctx->yres * 4 * 2 + G2D_BLEND_STAGING_SIZE) {
+        ctx->pixmap_heap_offset -= G2D_BLEND_STAGING_SIZE;
+        ctx->blend_staging_offset = ctx->pixmap_heap_offset;
+        ctx->blend_staging_size = G2D_BLEND_STAGING_SIZE;
+    }
+
     ctx->blt2d.self = ctx;
     ctx->blt2d.overlapped_blt = sunxi_g2d_blt;
+    ctx->blt2d.overlapped_blt_boxes = sunxi_g2d_blt_boxes;
+    if (ctx->blend_staging_size)
+        ctx->blt2d.blend_over = sunxi_g2d_blend_over;
+    ctx->blt2d.stretch_blt = sunxi_g2d_stretch_blt;
+    ctx->blt2d.fill = sunxi_g2d_fill;
+
+    blt2d_route_init(&ctx->route, G2D_BLT_SIZE_THRESHOLD,
+                     G2D_BLT_SIZE_THRESHOLD_16BPP);
 
     return ctx;
 }
@@ -171,6 +195,17 @@ sunxi_disp_t *sunxi_disp_init(const char *device, void *xserver_fbmem)
 int sunxi_disp_close(sunxi_disp_t *ctx)
 {
     if (ctx->fd_disp >= 0) {
+        if (ctx->split) {
+            pthread_mutex_lock(&ctx->split_lock);
+            ctx->split_quit = 1;
+            pthread_cond_signal(&ctx->split_work_cond);
+            pthread_mutex_unlock(&ctx->split_lock);
+            pthread_join(ctx->split_thread, NULL);
+            pthread_cond_destroy(&ctx->split_done_cond);
+            pthread_cond_destroy(&ctx->split_work_cond);
+            pthread_mutex_destroy(&ctx->split_lock);
+        }
+        sunxi_vsync_counter_stop(ctx);
         if (ctx->fd_g2d >= 0) {
             close(ctx->fd_g2d);
         }
@@ -272,16 +307,21 @@ int sunxi_hw_cursor_hide(sunxi_disp_t *ctx)
  * Support for scaled layers                                                 *
  *****************************************************************************/
 
-static int sunxi_layer_change_work_mode(sunxi_disp_t *ctx, int new_mode)
+#define LAYER_FORMAT_IS_YUV(format) ((format) == DISP_FORMAT_YUV420 || \
+                                     (format) == DISP_FORMAT_YUV422)
+
+static int sunxi_layer_change_work_mode(sunxi_disp_t  *ctx,
+                                        sunxi_layer_t *l,
+                                        int            new_mode)
 {
     __disp_layer_info_t layer_info;
     uint32_t tmp[4];
 
-    if (ctx->layer_id < 0)
+    if (l->id < 0)
         return -1;
 
     tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
+    tmp[1] = l->id;
     tmp[2] = (uintptr_t)&layer_info;
     if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_GET_PARA, tmp) < 0)
         return -1;
@@ -289,12 +329,32 @@ static int sunxi_layer_change_work_mode(sunxi_disp_t *ctx, int new_mode)
     layer_info.mode = new_mode;
 
     tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
+    tmp[1] = l->id;
     tmp[2] = (uintptr_t)&layer_info;
     return ioctl(ctx->fd_disp, DISP_CMD_LAYER_SET_PARA, tmp);
 }
 
-int sunxi_layer_reserve(sunxi_disp_t *ctx)
+/* Get a reserved layer from the pool by its index */
+static sunxi_layer_t *sunxi_get_layer(sunxi_disp_t *ctx, int layer)
+{
+    if (layer < 0 || layer >= ctx->nlayers || ctx->layers[layer].id < 0)
+        return NULL;
+    return &ctx->layers[layer];
+}
+
+static void sunxi_layer_release_one(sunxi_disp_t *ctx, sunxi_layer_t *l)
+{
+    uint32_t tmp[4];
+
+    tmp[0] = ctx->fb_id;
+    tmp[1] = l->id;
+    ioctl(ctx->fd_disp, DISP_CMD_LAYER_RELEASE, &tmp);
+
+    l->id = -1;
+    l->has_scaler = 0;
+}
+
+static int sunxi_layer_reserve_one(sunxi_disp_t *ctx, sunxi_layer_t *l)
 {
     __disp_layer_info_t layer_info;
     uint32_t tmp[4];
@@ -303,17 +363,19 @@ int sunxi_layer_reserve(sunxi_disp_t *ctx)
 
     tmp[0] = ctx->fb_id;
     tmp[1] = DISP_LAYER_WORK_MODE_NORMAL;
-    ctx->layer_id = ioctl(ctx->fd_disp, DISP_CMD_LAYER_REQUEST, &tmp);
-    if (ctx->layer_id < 0)
+    l->id = ioctl(ctx->fd_disp, DISP_CMD_LAYER_REQUEST, &tmp);
+    if (l->id < 0)
         return -1;
 
     /* Initially set the layer configuration to something reasonable */
 
     tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
+    tmp[1] = l->id;
     tmp[2] = (uintptr_t)&layer_info;
-    if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_GET_PARA, tmp) < 0)
+    if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_GET_PARA, tmp) < 0) {
+        sunxi_layer_release_one(ctx, l);
         return -1;
+    }
 
     /* the screen and overlay layers need to be in different pipes */
     layer_info.pipe      = 1;
@@ -328,59 +390,98 @@ int sunxi_layer_reserve(sunxi_disp_t *ctx)
     layer_info.fb.mode = DISP_MOD_INTERLEAVED;
 
     tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
+    tmp[1] = l->id;
     tmp[2] = (uintptr_t)&layer_info;
-    if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_SET_PARA, tmp) < 0)
+    if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_SET_PARA, tmp) < 0) {
+        sunxi_layer_release_one(ctx, l);
         return -1;
+    }
+
+    l->has_scaler = 0;
+    l->scaler_is_enabled = 0;
+    l->colorkey_is_enabled = 0;
+    l->format = DISP_FORMAT_ARGB8888;
+    return l->id;
+}
+
+int sunxi_layer_reserve(sunxi_disp_t *ctx)
+{
+    int i, n;
 
-    /* Now probe the scaler mode to see if there is a free scaler available */
-    if (sunxi_layer_change_work_mode(ctx, DISP_LAYER_WORK_MODE_SCALER) == 0)
-        ctx->layer_has_scaler = 1;
+    for (i = 0; i < SUNXI_DISP_MAX_LAYERS; i++)
+        ctx->layers[i].id = -1;
+
+    ctx->nlayers = 0;
+    while (ctx->nlayers < SUNXI_DISP_MAX_LAYERS &&
+           sunxi_layer_reserve_one(ctx, &ctx->layers[ctx->nlayers]) >= 0)
+        ctx->nlayers++;
+    if (ctx->nlayers == 0)
+        return -1;
+
+    /*
+     * Now probe the scaler mode to see if there are free scalers available.
+     * The layers keep their scalers until all of them are probed, so that
+     * the same free scaler is not counted twice.
+     */
+    for (i = 0; i < ctx->nlayers; i++) {
+        sunxi_layer_t *l = &ctx->layers[i];
+        if (sunxi_layer_change_work_mode(ctx, l, DISP_LAYER_WORK_MODE_SCALER) == 0)
+            l->has_scaler = 1;
+    }
 
     /* Revert back to normal mode */
-    sunxi_layer_change_work_mode(ctx, DISP_LAYER_WORK_MODE_NORMAL);
-    ctx->layer_scaler_is_enabled = 0;
-    ctx->layer_format = DISP_FORMAT_ARGB8888;
+    for (i = 0; i < ctx->nlayers; i++) {
+        sunxi_layer_t *l = &ctx->layers[i];
+        if (l->has_scaler)
+            sunxi_layer_change_work_mode(ctx, l, DISP_LAYER_WORK_MODE_NORMAL);
+    }
 
-    return ctx->layer_id;
-}
+    /* The first layer is always kept, the rest only if they have scalers */
+    for (i = n = 1; i < ctx->nlayers; i++) {
+        if (ctx->layers[i].has_scaler)
+            ctx->layers[n++] = ctx->layers[i];
+        else
+            sunxi_layer_release_one(ctx, &ctx->layers[i]);
+    }
+    for (i = n; i < ctx->nlayers; i++)
+        ctx->layers[i].id = -1;
+    ctx->nlayers = n;
 
+    return ctx->nlayers;
+}
 
 int sunxi_layer_release(sunxi_disp_t *ctx)
 {
-    int result;
-    uint32_t tmp[4];
+    int i;
 
-    if (ctx->layer_id < 0)
-        return -1;
-
-    tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
-    ioctl(ctx->fd_disp, DISP_CMD_LAYER_RELEASE, &tmp);
-
-    ctx->layer_id = -1;
-    ctx->layer_has_scaler = 0;
+    for (i = 0; i < ctx->nlayers; i++) {
+        if (ctx->layers[i].id >= 0)
+            sunxi_layer_release_one(ctx, &ctx->layers[i]);
+    }
+    ctx->nlayers = 0;
     return 0;
 }
 
 int sunxi_layer_set_rgb_input_buffer(sunxi_disp_t *ctx,
+                                     int           layer,
                                      int           bpp,
                                      uint32_t      offset_in_framebuffer,
                                      int           width,
                                      int           height,
                                      int           stride)
 {
+    sunxi_layer_t *l = sunxi_get_layer(ctx, layer);
     __disp_fb_t fb;
     __disp_rect_t rect = { 0, 0, width, height };
     uint32_t tmp[4];
     memset(&fb, 0, sizeof(fb));
 
-    if (ctx->layer_id < 0)
+    if (!l)
         return -1;
 
-    if (ctx->layer_scaler_is_enabled) {
-        if (sunxi_layer_change_work_mode(ctx, DISP_LAYER_WORK_MODE_NORMAL) == 0)
-            ctx->layer_scaler_is_enabled = 0;
+    if (l->scaler_is_enabled) {
+        if (sunxi_layer_change_work_mode(ctx, l, DISP_LAYER_WORK_MODE_NORMAL) == 0)
+            l->scaler_is_enabled = 0;
         else
             return -1;
     }
@@ -402,24 +503,66 @@ int sunxi_layer_set_rgb_input_buffer(sunxi_disp_t *ctx,
     }
 
     tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
+    tmp[1] = l->id;
     tmp[2] = (uintptr_t)&fb;
     if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_SET_FB, &tmp) < 0)
         return -1;
 
-    ctx->layer_buf_x = rect.x;
-    ctx->layer_buf_y = rect.y;
-    ctx->layer_buf_w = rect.width;
-    ctx->layer_buf_h = rect.height;
-    ctx->layer_format = fb.format;
+    l->buf_x = rect.x;
+    l->buf_y = rect.y;
+    l->buf_w = rect.width;
+    l->buf_h = rect.height;
+    l->format = fb.format;
 
     tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
+    tmp[1] = l->id;
+    tmp[2] = (uintptr_t)&rect;
+    return ioctl(ctx->fd_disp, DISP_CMD_LAYER_SET_SRC_WINDOW, &tmp);
+}
+
+/* Set up the layer for YUV formats, which all need to use the scaler */
+static int sunxi_layer_set_yuv_fb(sunxi_disp_t *ctx,
+                                  int           layer,
+                                  __disp_fb_t  *fb,
+                                  int           width,
+                                  int           height,
+                                  int           x_pixel_offset,
+                                  int           y_pixel_offset)
+{
+    sunxi_layer_t *l = sunxi_get_layer(ctx, layer);
+    __disp_rect_t rect = { x_pixel_offset, y_pixel_offset, width, height };
+    uint32_t tmp[4];
+
+    if (!l)
+        return -1;
+
+    if (!l->scaler_is_enabled) {
+        if (sunxi_layer_change_work_mode(ctx, l, DISP_LAYER_WORK_MODE_SCALER) == 0)
+            l->scaler_is_enabled = 1;
+        else
+            return -1;
+    }
+
+    tmp[0] = ctx->fb_id;
+    tmp[1] = l->id;
+    tmp[2] = (uintptr_t)fb;
+    if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_SET_FB, &tmp) < 0)
+        return -1;
+
+    l->buf_x = rect.x;
+    l->buf_y = rect.y;
+    l->buf_w = rect.width;
+    l->buf_h = rect.height;
+    l->format = fb->format;
+
+    tmp[0] = ctx->fb_id;
+    tmp[1] = l->id;
     tmp[2] = (uintptr_t)&rect;
     return ioctl(ctx->fd_disp, DISP_CMD_LAYER_SET_SRC_WINDOW, &tmp);
 }
 
 int sunxi_layer_set_yuv420_input_buffer(sunxi_disp_t *ctx,
+                                        int           layer,
                                         uint32_t      y_offset_in_framebuffer,
                                         uint32_t      u_offset_in_framebuffer,
                                         uint32_t      v_offset_in_framebuffer,
@@ -430,20 +573,8 @@ int sunxi_layer_set_yuv420_input_buffer(sunxi_disp_t *ctx,
                                         int           y_pixel_offset)
 {
     __disp_fb_t fb;
-    __disp_rect_t rect = { x_pixel_offset, y_pixel_offset, width, height };
-    uint32_t tmp[4];
     memset(&fb, 0, sizeof(fb));
 
-    if (ctx->layer_id < 0)
-        return -1;
-
-    if (!ctx->layer_scaler_is_enabled) {
-        if (sunxi_layer_change_work_mode(ctx, DISP_LAYER_WORK_MODE_SCALER) == 0)
-            ctx->layer_scaler_is_enabled = 1;
-        else
-            return -1;
-    }
-
     fb.addr[0] = ctx->framebuffer_paddr + y_offset_in_framebuffer;
     fb.addr[1] = ctx->framebuffer_paddr + u_offset_in_framebuffer;
     fb.addr[2] = ctx->framebuffer_paddr + v_offset_in_framebuffer;
@@ -453,37 +584,79 @@ int sunxi_layer_set_yuv420_input_buffer(sunxi_disp_t *ctx,
     fb.seq = DISP_SEQ_P3210;
     fb.mode = DISP_MOD_NON_MB_PLANAR;
 
-    tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
-    tmp[2] = (uintptr_t)&fb;
-    if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_SET_FB, &tmp) < 0)
-        return -1;
+    return sunxi_layer_set_yuv_fb(ctx, layer, &fb, width, height,
+                                  x_pixel_offset, y_pixel_offset);
+}
+
+int sunxi_layer_set_yuv420_uv_combined_input_buffer(
+                                        sunxi_disp_t *ctx,
+                                        int           layer,
+                                        uint32_t      y_offset_in_framebuffer,
+                                        uint32_t      uv_offset_in_framebuffer,
+                                        int           width,
+                                        int           height,
+                                        int           stride,
+                                        int           x_pixel_offset,
+                                        int           y_pixel_offset,
+                                        int           vu_order)
+{
+    __disp_fb_t fb;
+    memset(&fb, 0, sizeof(fb));
 
-    ctx->layer_buf_x = rect.x;
-    ctx->layer_buf_y = rect.y;
-    ctx->layer_buf_w = rect.width;
-    ctx->layer_buf_h = rect.height;
-    ctx->layer_format = fb.format;
+    fb.addr[0] = ctx->framebuffer_paddr + y_offset_in_framebuffer;
+    fb.addr[1] = ctx->framebuffer_paddr + uv_offset_in_framebuffer;
+    fb.size.width = stride;
+    fb.size.height = height;
+    fb.format = DISP_FORMAT_YUV420;
+    fb.seq = vu_order ? DISP_SEQ_VUVU : DISP_SEQ_UVUV;
+    fb.mode = DISP_MOD_NON_MB_UV_COMBINED;
 
-    tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
-    tmp[2] = (uintptr_t)&rect;
-    return ioctl(ctx->fd_disp, DISP_CMD_LAYER_SET_SRC_WINDOW, &tmp);
+    return sunxi_layer_set_yuv_fb(ctx, layer, &fb, width, height,
+                                  x_pixel_offset, y_pixel_offset);
+}
+
+int sunxi_layer_set_yuv422_interleaved_input_buffer(
+                                        sunxi_disp_t *ctx,
+                                        int           layer,
+                                        uint32_t      offset_in_framebuffer,
+                                        int           width,
+                                        int           height,
+                                        int           stride,
+                                        int           x_pixel_offset,
+                                        int           y_pixel_offset,
+                                        int           uyvy_order)
+{
+    __disp_fb_t fb;
+    memset(&fb, 0, sizeof(fb));
+
+    fb.addr[0] = ctx->framebuffer_paddr + offset_in_framebuffer;
+    fb.size.width = stride;
+    fb.size.height = height;
+    fb.format = DISP_FORMAT_YUV422;
+    fb.seq = uyvy_order ? DISP_SEQ_UYVY : DISP_SEQ_YUYV;
+    fb.mode = DISP_MOD_INTERLEAVED;
+
+    return sunxi_layer_set_yuv_fb(ctx, layer, &fb, width, height,
+                                  x_pixel_offset, y_pixel_offset);
 }
 
-int sunxi_layer_set_output_window(sunxi_disp_t *ctx, int x, int y, int w, int h)
+int sunxi_layer_set_output_window(sunxi_disp_t *ctx, int layer,
+                                  int x, int y, int w, int h)
 {
-    __disp_rect_t buf_rect = {
-        ctx->layer_buf_x, ctx->layer_buf_y,
-        ctx->layer_buf_w, ctx->layer_buf_h
-    };
+    sunxi_layer_t *l = sunxi_get_layer(ctx, layer);
+    __disp_rect_t buf_rect;
     __disp_rect_t win_rect = { x, y, w, h };
     uint32_t tmp[4];
     int err;
 
-    if (ctx->layer_id < 0 || w <= 0 || h <= 0)
+    if (!l || w <= 0 || h <= 0)
         return -1;
 
+    buf_rect.x      = l->buf_x;
+    buf_rect.y      = l->buf_y;
+    buf_rect.width  = l->buf_w;
+    buf_rect.height = l->buf_h;
+
     /*
      * Handle negative window Y coordinates (workaround a bug).
      * The Allwinner A10/A13 display controller hardware is expected to
@@ -496,8 +669,8 @@ int sunxi_layer_set_output_window(sunxi_disp_t *ctx, int x, int y, int w, int h)
      * We fix this by just recalculating which part of the buffer in memory
      * corresponds to Y=0 on screen and adjust the input buffer settings.
      */
-    if (ctx->layer_format == DISP_FORMAT_YUV420 &&
-                                  (y < 0 || ctx->layer_win_y < 0)) {
+    if (LAYER_FORMAT_IS_YUV(l->format) &&
+                                  (y < 0 || l->win_y < 0)) {
         if (win_rect.y < 0) {
             int y_shift = -(double)y * buf_rect.height / win_rect.height;
             buf_rect.y      += y_shift;
@@ -516,70 +689,101 @@ int sunxi_layer_set_output_window(sunxi_disp_t *ctx, int x, int y, int w, int h)
             win_rect.width = 1;
             win_rect.height = 1;
             tmp[0] = ctx->fb_id;
-            tmp[1] = ctx->layer_id;
+            tmp[1] = l->id;
             tmp[2] = (uintptr_t)&win_rect;
             return ioctl(ctx->fd_disp, DISP_CMD_LAYER_SET_SCN_WINDOW, &tmp);
         }
 
         tmp[0] = ctx->fb_id;
-        tmp[1] = ctx->layer_id;
+        tmp[1] = l->id;
         tmp[2] = (uintptr_t)&buf_rect;
         if ((err = ioctl(ctx->fd_disp, DISP_CMD_LAYER_SET_SRC_WINDOW, &tmp)))
             return err;
     }
     /* Save the new non-adjusted window position */
-    ctx->layer_win_x = x;
-    ctx->layer_win_y = y;
+    l->win_x = x;
+    l->win_y = y;
 
     tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
+    tmp[1] = l->id;
     tmp[2] = (uintptr_t)&win_rect;
     return ioctl(ctx->fd_disp, DISP_CMD_LAYER_SET_SCN_WINDOW, &tmp);
 }
 
-int sunxi_layer_show(sunxi_disp_t *ctx)
+int sunxi_layer_show(sunxi_disp_t *ctx, int layer)
 {
+    sunxi_layer_t *l = sunxi_get_layer(ctx, layer);
     uint32_t tmp[4];
 
-    if (ctx->layer_id < 0)
+    if (!l)
         return -1;
 
     /* YUV formats need to use a scaler */
-    if (ctx->layer_format == DISP_FORMAT_YUV420 && !ctx->layer_scaler_is_enabled) {
-        if (sunxi_layer_change_work_mode(ctx, DISP_LAYER_WORK_MODE_SCALER) == 0)
-            ctx->layer_scaler_is_enabled = 1;
+    if (LAYER_FORMAT_IS_YUV(l->format) && !l->scaler_is_enabled) {
+        if (sunxi_layer_change_work_mode(ctx, l, DISP_LAYER_WORK_MODE_SCALER) == 0)
+            l->scaler_is_enabled = 1;
     }
 
     tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
+    tmp[1] = l->id;
     return ioctl(ctx->fd_disp, DISP_CMD_LAYER_OPEN, &tmp);
 }
 
-int sunxi_layer_hide(sunxi_disp_t *ctx)
+int sunxi_layer_hide(sunxi_disp_t *ctx, int layer)
 {
+    sunxi_layer_t *l = sunxi_get_layer(ctx, layer);
     int result;
     uint32_t tmp[4];
 
-    if (ctx->layer_id < 0)
+    if (!l)
         return -1;
 
     /* If the layer is hidden, there is no need to keep the scaler occupied */
-    if (ctx->layer_scaler_is_enabled) {
-        if (sunxi_layer_change_work_mode(ctx, DISP_LAYER_WORK_MODE_NORMAL) == 0)
-            ctx->layer_scaler_is_enabled = 0;
+    if (l->scaler_is_enabled) {
+        if (sunxi_layer_change_work_mode(ctx, l, DISP_LAYER_WORK_MODE_NORMAL) == 0)
+            l->scaler_is_enabled = 0;
     }
 
     tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
+    tmp[1] = l->id;
     return ioctl(ctx->fd_disp, DISP_CMD_LAYER_CLOSE, &tmp);
 }
 
-int sunxi_layer_set_colorkey(sunxi_disp_t *ctx, uint32_t color)
+/*
+ * Put the screen layer to the bottom and then all the color keyed layers
+ * below it, so that they are only visible through the color key.
+ */
+static int sunxi_layer_restack(sunxi_disp_t *ctx)
+{
+    uint32_t tmp[4];
+    int i;
+
+    tmp[0] = ctx->fb_id;
+    tmp[1] = ctx->gfx_layer_id;
+    if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_BOTTOM, &tmp) < 0)
+        return -1;
+
+    for (i = 0; i < ctx->nlayers; i++) {
+        if (ctx->layers[i].id < 0 || !ctx->layers[i].colorkey_is_enabled)
+            continue;
+        tmp[0] = ctx->fb_id;
+        tmp[1] = ctx->layers[i].id;
+        if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_BOTTOM, &tmp) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+int sunxi_layer_set_colorkey(sunxi_disp_t *ctx, int layer, uint32_t color)
 {
+    sunxi_layer_t *l = sunxi_get_layer(ctx, layer);
     uint32_t tmp[4];
     __disp_colorkey_t colorkey;
     __disp_color_t disp_color;
 
+    if (!l)
+        return -1;
+
     disp_color.alpha = (color >> 24) & 0xFF;
     disp_color.red   = (color >> 16) & 0xFF;
     disp_color.green = (color >> 8)  & 0xFF;
@@ -597,19 +801,13 @@ int sunxi_layer_set_colorkey(sunxi_disp_t *ctx, uint32_t color)
         return -1;
 
     /* Set the overlay layer below the screen layer */
-    tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->gfx_layer_id;
-    if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_BOTTOM, &tmp) < 0)
-        return -1;
-
-    tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
-    if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_BOTTOM, &tmp) < 0)
+    l->colorkey_is_enabled = 1;
+    if (sunxi_layer_restack(ctx) < 0)
         return -1;
 
     /* Enable color key for the overlay layer */
     tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
+    tmp[1] = l->id;
     if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_CK_ON, &tmp) < 0)
         return -1;
 
@@ -627,28 +825,28 @@ int sunxi_layer_set_colorkey(sunxi_disp_t *ctx, uint32_t color)
     return 0;
 }
 
-int sunxi_layer_disable_colorkey(sunxi_disp_t *ctx)
+int sunxi_layer_disable_colorkey(sunxi_disp_t *ctx, int layer)
 {
+    sunxi_layer_t *l = sunxi_get_layer(ctx, layer);
     uint32_t tmp[4];
 
-    /* Disable color key for the overlay layer */
-    tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
-    if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_CK_OFF, &tmp) < 0)
+    if (!l)
         return -1;
 
-    /* Set the overlay layer above the screen layer */
+    /* Disable color key for the overlay layer */
     tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->layer_id;
-    if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_BOTTOM, &tmp) < 0)
+    tmp[1] = l->id;
+    if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_CK_OFF, &tmp) < 0)
         return -1;
+    l->colorkey_is_enabled = 0;
 
+    /* Set the overlay layer above the screen layer (and the keyed ones) */
     tmp[0] = ctx->fb_id;
-    tmp[1] = ctx->gfx_layer_id;
+    tmp[1] = l->id;
     if (ioctl(ctx->fd_disp, DISP_CMD_LAYER_BOTTOM, &tmp) < 0)
         return -1;
 
-    return 0;
+    return sunxi_layer_restack(ctx);
 }
 
 /*****************************************************************************/
@@ -658,6 +856,130 @@ int sunxi_wait_for_vsync(sunxi_disp_t *ctx)
     return ioctl(ctx->fd_fb, FBIO_WAITFORVSYNC, 0);
 }
 
+struct sunxi_vsync_counter {
+    int             fd;     /* a duplicate of fd_fb, owned by the thread */
+    pthread_mutex_t lock;
+    uint32_t        count;
+    int             ok;     /* the last wait for vsync has succeeded */
+    int             quit;
+};
+
+/* The delays (in microseconds) before retrying after the errors */
+#define VSYNC_RETRY_MIN_DELAY 10000
+#define VSYNC_RETRY_MAX_DELAY 1000000
+
+/*
+ * The thread is detached and owns the counter, freeing it after noticing
+ * the quit request. So stopping it never has to wait for the next vsync.
+ */
+static void *sunxi_vsync_counter_thread(void *arg)
+{
+    sunxi_vsync_counter_t *vc = (sunxi_vsync_counter_t *)arg;
+    int delay = 0;
+
+    while (1) {
+        int err = ioctl(vc->fd, FBIO_WAITFORVSYNC, 0);
+        pthread_mutex_lock(&vc->lock);
+        if (vc->quit) {
+            pthread_mutex_unlock(&vc->lock);
+            break;
+        }
+        vc->ok = (err >= 0);
+        if (vc->ok)
+            vc->count++;
+        pthread_mutex_unlock(&vc->lock);
+
+        /*
+         * The errors may be transient (for example while the display is
+         * blanked), so keep retrying with an increasing delay.
+         */
+        if (err < 0) {
+            delay = delay ? delay * 2 : VSYNC_RETRY_MIN_DELAY;
+            if (delay > VSYNC_RETRY_MAX_DELAY)
+                delay = VSYNC_RETRY_MAX_DELAY;
+            usleep(delay);
+        }
+        else {
+            delay = 0;
+        }
+    }
+
+    close(vc->fd);
+    pthread_mutex_destroy(&vc->lock);
+    free(vc);
+    return NULL;
+}
+
+int sunxi_vsync_counter_start(sunxi_disp_t *ctx)
+{
+    sunxi_vsync_counter_t *vc;
+    sigset_t sigset, old_sigset;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int err;
+
+    if (ctx->vsync_counter)
+        return 1;
+
+    if (!(vc = calloc(1, sizeof(sunxi_vsync_counter_t))))
+        return 0;
+    if ((vc->fd = dup(ctx->fd_fb)) < 0) {
+        free(vc);
+        return 0;
+    }
+    pthread_mutex_init(&vc->lock, NULL);
+    vc->ok = 1;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    /* the signals must be only delivered to the main thread */
+    sigfillset(&sigset);
+    pthread_sigmask(SIG_BLOCK, &sigset, &old_sigset);
+    err = pthread_create(&thread, &attr, sunxi_vsync_counter_thread, vc);
+    pthread_sigmask(SIG_SETMASK, &old_sigset, NULL);
+    pthread_attr_destroy(&attr);
+
+    if (err) {
+        pthread_mutex_destroy(&vc->lock);
+        close(vc->fd);
+        free(vc);
+        return 0;
+    }
+
+    ctx->vsync_counter = vc;
+    return 1;
+}
+
+void sunxi_vsync_counter_stop(sunxi_disp_t *ctx)
+{
+    sunxi_vsync_counter_t *vc = ctx->vsync_counter;
+
+    if (!vc)
+        return;
+
+    /* the thread frees the counter after its current wait for vsync */
+    pthread_mutex_lock(&vc->lock);
+    vc->quit = 1;
+    pthread_mutex_unlock(&vc->lock);
+    ctx->vsync_counter = NULL;
+}
+
+int sunxi_get_vsync_count(sunxi_disp_t *ctx, uint32_t *count)
+{
+    sunxi_vsync_counter_t *vc = ctx->vsync_counter;
+    int ok;
+
+    if (!vc)
+        return 0;
+
+    pthread_mutex_lock(&vc->lock);
+    ok = vc->ok;
+    *count = vc->count;
+    pthread_mutex_unlock(&vc->lock);
+    return ok;
+}
+
 /*****************************************************************************/
 
 int sunxi_g2d_fill_a8r8g8b8(sunxi_disp_t *disp,
@@ -818,6 +1140,13 @@ int sunxi_g2d_blit_r5g6b5_in_three(sunxi_disp_t *disp, uint8_t *src_bits,
     return 1;
 }
 
+static inline int sunxi_g2d_bits_in_framebuffer(sunxi_disp_t *disp,
+                                                uint32_t     *bits)
+{
+    return (uint8_t *)bits >= disp->framebuffer_addr &&
+           (uint8_t *)bits < disp->framebuffer_addr + disp->framebuffer_size;
+}
+
 static inline int sunxi_g2d_try_fallback_blt(void               *self,
                                              uint32_t           *src_bits,
                                              uint32_t           *dst_bits,
@@ -858,22 +1187,21 @@ static inline int sunxi_g2d_try_fallback_blt(void               *self,
  * Can do G2D accelerated blits only if both source and destination
  * buffers are inside framebuffer. Returns FALSE (0) otherwise.
  */
-int sunxi_g2d_blt(void               *self,
-                  uint32_t           *src_bits,
-                  uint32_t           *dst_bits,
-                  int                 src_stride,
-                  int                 dst_stride,
-                  int                 src_bpp,
-                  int                 dst_bpp,
-                  int                 src_x,
-                  int                 src_y,
-                  int                 dst_x,
-                  int                 dst_y,
-                  int                 w,
-                  int                 h)
+static int sunxi_g2d_blt_single(void               *self,
+                                uint32_t           *src_bits,
+                                uint32_t           *dst_bits,
+                                int                 src_stride,
+                                int                 dst_stride,
+                                int                 src_bpp,
+                                int                 dst_bpp,
+                                int                 src_x,
+                                int                 src_y,
+                                int                 dst_x,
+                                int                 dst_y,
+                                int                 w,
+                                int                 h)
 {
     sunxi_disp_t *disp = (sunxi_disp_t *)self;
-    int blt_size_threshold;
     g2d_blt tmp;
 
     /* Zero size blit, nothing to do */
@@ -895,30 +1223,46 @@ int sunxi_g2d_blt(void               *self,
         return FALLBACK_BLT();
     }
 
-    /*
-     * If the area is smaller than G2D_BLT_SIZE_THRESHOLD, prefer to avoid the
-     * overhead of G2D and do a CPU blit instead. There is a special threshold
-     * for 16bpp to 16bpp copy.
-     */
-    if (src_bpp == 16 && dst_bpp == 16)
-        blt_size_threshold = G2D_BLT_SIZE_THRESHOLD_16BPP;
-    else
-        blt_size_threshold = G2D_BLT_SIZE_THRESHOLD;
-    if (w * h < blt_size_threshold)
-        return FALLBACK_BLT();
-
-    /* Unsupported overlapping type */
-    if (src_bits == dst_bits && src_y == dst_y && src_x + 1 < dst_x)
-        return FALLBACK_BLT();
-
     if (disp->fd_g2d < 0)
         return FALLBACK_BLT();
 
+    /*
+     * Unsupported overlapping type (moving to the right on the same rows).
+     * Split the blit into vertical strips, which are not wider than the
+     * distance of the move and thus don't overlap with their own source,
+     * and copy them starting from the rightmost one. Too narrow strips
+     * are not worth the ioctl overhead, so let the CPU handle them.
+     */
+    if (src_bits == dst_bits && src_y == dst_y && src_x + 1 < dst_x &&
+                                                  src_x + w > dst_x) {
+        int nstrips = (w + dst_x - src_x - 1) / (dst_x - src_x);
+        int strip_w = (w + nstrips - 1) / nstrips;
+        if (!blt2d_route_prefer_hw(&disp->route,
+                blt2d_route_get_cell(&disp->route, src_bits, dst_bits,
+                                     src_bpp, dst_bpp, src_x, src_y,
+                                     src_x + strip_w, dst_y, strip_w, h),
+                strip_w * h))
+            return FALLBACK_BLT();
+        while (w > 0) {
+            int x = w > strip_w ? w - strip_w : 0;
+            if (!sunxi_g2d_blt_single(self, src_bits, dst_bits, src_stride,
+                                      dst_stride, src_bpp, dst_bpp,
+                                      src_x + x, src_y, dst_x + x, dst_y,
+                                      w - x, h)) {
+                /* The source of the remaining part is still intact */
+                return FALLBACK_BLT();
+            }
+            w = x;
+        }
+        return 1;
+    }
+
     /* Do a 16-bit using 32-bit mode if possible. */
     if (src_bpp == 16 && dst_bpp == 16 && (src_x & 1) == (dst_x & 1))
         /* Check whether the overlapping type is supported, the condition */
         /* is slightly different compared to the regular blit. */
-        if (!(src_bits == dst_bits && src_y == dst_y && src_x < dst_x))
+        if (!(src_bits == dst_bits && src_y == dst_y && src_x < dst_x &&
+                                                        src_x + w > dst_x))
             return sunxi_g2d_blit_r5g6b5_in_three(disp, (uint8_t *)src_bits,
                 (uint8_t *)dst_bits, src_stride, dst_stride, src_x, src_y,
                 dst_x, dst_y, w, h);
@@ -965,3 +1309,670 @@ int sunxi_g2d_blt(void               *self,
 
     return ioctl(disp->fd_g2d, G2D_CMD_BITBLT, &tmp) == 0;
 }
+
+/*****************************************************************************/
+
+static int64_t sunxi_gettime_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Update the moving average of the measured speed (pixels per microsecond) */
+static void sunxi_g2d_update_speed(double *speed, int pixels, int64_t us)
+{
+    if (us > 0)
+        *speed += ((double)pixels / us - *speed) / 4;
+}
+
+#define SPLIT_BLT_ARGS(a) (a)->src_bits, (a)->dst_bits, (a)->src_stride, \
+                          (a)->dst_stride, (a)->src_bpp, (a)->dst_bpp,   \
+                          (a)->src_x, (a)->src_y, (a)->dst_x, (a)->dst_y, \
+                          (a)->w, (a)->h
+
+/*
+ * The jobs are already validated by sunxi_g2d_blt (big enough, supported
+ * formats, no overlapping in the same rows), so sunxi_g2d_blt_single does
+ * not need to use the fallback interface here. That would be a problem,
+ * because the main thread is using it at the same time.
+ */
+static void *sunxi_g2d_split_thread(void *arg)
+{
+    sunxi_disp_t *disp = (sunxi_disp_t *)arg;
+    sunxi_g2d_blt_args_t *job = &disp->split_job;
+    int64_t t;
+    int result;
+
+    pthread_mutex_lock(&disp->split_lock);
+    while (1) {
+        while (!disp->split_pending && !disp->split_quit)
+            pthread_cond_wait(&disp->split_work_cond, &disp->split_lock);
+        if (disp->split_quit)
+            break;
+        pthread_mutex_unlock(&disp->split_lock);
+
+        t = sunxi_gettime_us();
+        result = sunxi_g2d_blt_single(disp, SPLIT_BLT_ARGS(job));
+        t = sunxi_gettime_us() - t;
+
+        pthread_mutex_lock(&disp->split_lock);
+        if (result)
+            sunxi_g2d_update_speed(&disp->split_g2d_speed, job->w * job->h, t);
+        disp->split_result = result;
+        disp->split_pending = 0;
+        pthread_cond_signal(&disp->split_done_cond);
+    }
+    pthread_mutex_unlock(&disp->split_lock);
+    return NULL;
+}
+
+int sunxi_g2d_enable_split(sunxi_disp_t *disp)
+{
+    sigset_t sigset, old_sigset;
+    int err;
+
+    if (disp->split)
+        return 1;
+    if (disp->fd_g2d < 0 || !disp->fallback_blt2d)
+        return 0;
+
+    pthread_mutex_init(&disp->split_lock, NULL);
+    pthread_cond_init(&disp->split_work_cond, NULL);
+    pthread_cond_init(&disp->split_done_cond, NULL);
+    disp->split_pending = 0;
+    disp->split_quit = 0;
+    /* Start with an equal split, the measurements will fix it quickly */
+    disp->split_g2d_speed = 1.0;
+    disp->split_cpu_speed = 1.0;
+
+    /* the signals must be only delivered to the main thread */
+    sigfillset(&sigset);
+    pthread_sigmask(SIG_BLOCK, &sigset, &old_sigset);
+    err = pthread_create(&disp->split_thread, NULL, sunxi_g2d_split_thread,
+                         disp);
+    pthread_sigmask(SIG_SETMASK, &old_sigset, NULL);
+
+    if (err) {
+        pthread_cond_destroy(&disp->split_done_cond);
+        pthread_cond_destroy(&disp->split_work_cond);
+        pthread_mutex_destroy(&disp->split_lock);
+        return 0;
+    }
+
+    disp->split = 1;
+    return 1;
+}
+
+/*
+ * Give a part of the blit to G2D and let the fallback interface do the
+ * rest at the same time. The overlapping blits are split into columns
+ * (only the vertical scrolling is supported), so that both parts don't
+ * depend on each other. The other blits are split into bands of rows.
+ */
+static int sunxi_g2d_split_blt(sunxi_disp_t         *disp,
+                               sunxi_g2d_blt_args_t *args,
+                               int                   by_columns)
+{
+    blt2d_i *fallback = disp->fallback_blt2d;
+    sunxi_g2d_blt_args_t g2d = *args, cpu = *args;
+    double share = disp->split_g2d_speed /
+                   (disp->split_g2d_speed + disp->split_cpu_speed);
+    int total = by_columns ? args->w : args->h;
+    int n = (int)(total * share);
+    int g2d_result, cpu_result;
+    int64_t t;
+
+    /* Always leave something for both */
+    if (n < total / 8)
+        n = total / 8;
+    if (n > total - total / 8)
+        n = total - total / 8;
+
+    if (by_columns) {
+        g2d.w = n;
+        cpu.src_x += n;
+        cpu.dst_x += n;
+        cpu.w -= n;
+    }
+    else {
+        g2d.h = n;
+        cpu.src_y += n;
+        cpu.dst_y += n;
+        cpu.h -= n;
+    }
+
+    pthread_mutex_lock(&disp->split_lock);
+    disp->split_job = g2d;
+    disp->split_pending = 1;
+    pthread_cond_signal(&disp->split_work_cond);
+    pthread_mutex_unlock(&disp->split_lock);
+
+    t = sunxi_gettime_us();
+    cpu_result = fallback->overlapped_blt(fallback->self, SPLIT_BLT_ARGS(&cpu));
+    t = sunxi_gettime_us() - t;
+
+    pthread_mutex_lock(&disp->split_lock);
+    while (disp->split_pending)
+        pthread_cond_wait(&disp->split_done_cond, &disp->split_lock);
+    g2d_result = disp->split_result;
+    if (cpu_result)
+        sunxi_g2d_update_speed(&disp->split_cpu_speed, cpu.w * cpu.h, t);
+    pthread_mutex_unlock(&disp->split_lock);
+
+    /* If one of the parts has failed, try to do it by the other side */
+    if (!g2d_result)
+        g2d_result = fallback->overlapped_blt(fallback->self,
+                                              SPLIT_BLT_ARGS(&g2d));
+    if (!cpu_result)
+        cpu_result = sunxi_g2d_blt_single(disp, SPLIT_BLT_ARGS(&cpu));
+
+    return g2d_result && cpu_result;
+}
+
+/*
+ * The blt2d_i.overlapped_blt implementation. Very large blits may be split
+ * between G2D and the fallback interface, everything else is handled by
+ * sunxi_g2d_blt_single.
+ */
+int sunxi_g2d_blt(void               *self,
+                  uint32_t           *src_bits,
+                  uint32_t           *dst_bits,
+                  int                 src_stride,
+                  int                 dst_stride,
+                  int                 src_bpp,
+                  int                 dst_bpp,
+                  int                 src_x,
+                  int                 src_y,
+                  int                 dst_x,
+                  int                 dst_y,
+                  int                 w,
+                  int                 h)
+{
+    sunxi_disp_t *disp = (sunxi_disp_t *)self;
+    blt2d_route_cell_t *cell;
+    int64_t t;
+    int hw, result;
+
+    /* Zero size blit, nothing to do */
+    if (w <= 0 || h <= 0)
+        return 1;
+
+    if (disp->fd_g2d < 0 ||
+        !sunxi_g2d_bits_in_framebuffer(disp, src_bits) ||
+        !sunxi_g2d_bits_in_framebuffer(disp, dst_bits) ||
+        (src_bpp != 16 && src_bpp != 32) || (dst_bpp != 16 && dst_bpp != 32))
+        return FALLBACK_BLT();
+
+    /* Check whether G2D or the CPU is expected to be faster */
+    cell = blt2d_route_get_cell(&disp->route, src_bits, dst_bits,
+                                src_bpp, dst_bpp, src_x, src_y,
+                                dst_x, dst_y, w, h);
+    hw = blt2d_route_start(&disp->route, cell, w * h, &t);
+    if (!hw) {
+        result = FALLBACK_BLT();
+        if (result)
+            blt2d_route_finish(&disp->route, cell, 0, w * h, t);
+        return result;
+    }
+
+    if (disp->split && w * h >= G2D_SPLIT_SIZE_THRESHOLD &&
+        src_bpp == dst_bpp) {
+        sunxi_g2d_blt_args_t args = { src_bits, dst_bits, src_stride,
+                                      dst_stride, src_bpp, dst_bpp,
+                                      src_x, src_y, dst_x, dst_y, w, h };
+        int overlapped = src_bits == dst_bits &&
+                         src_x < dst_x + w && dst_x < src_x + w &&
+                         src_y < dst_y + h && dst_y < src_y + h;
+        if (!overlapped || src_x == dst_x) {
+            result = sunxi_g2d_split_blt(disp, &args, overlapped);
+            if (result)
+                blt2d_route_finish(&disp->route, cell, 1, w * h, t);
+            return result;
+        }
+    }
+
+    result = sunxi_g2d_blt_single(self, src_bits, dst_bits, src_stride,
+                                  dst_stride, src_bpp, dst_bpp,
+                                  src_x, src_y, dst_x, dst_y, w, h);
+    if (result)
+        blt2d_route_finish(&disp->route, cell, 1, w * h, t);
+    return result;
+}
+
+/* The stride (in 32-bit units) of the area used for the calibration */
+#define G2D_CALIBRATION_STRIDE 1024
+
+int sunxi_g2d_calibrate(sunxi_disp_t *disp)
+{
+    uint32_t begin = (disp->gfx_layer_size + 4095) & ~4095;
+    uint32_t *bits = (uint32_t *)(disp->framebuffer_addr + begin);
+    int rows;
+
+    if (disp->fd_g2d < 0 || !disp->fallback_blt2d ||
+        disp->pixmap_heap_offset <= begin)
+        return 0;
+
+    rows = (disp->pixmap_heap_offset - begin) / (G2D_CALIBRATION_STRIDE * 4);
+    return blt2d_route_calibrate(&disp->route, &disp->blt2d, bits,
+                                 G2D_CALIBRATION_STRIDE, rows, 16) &&
+           blt2d_route_calibrate(&disp->route, &disp->blt2d, bits,
+                                 G2D_CALIBRATION_STRIDE, rows, 32);
+}
+
+/*
+ * G2D_CMD_BITBLT can only copy one rectangle per ioctl, so the boxes are
+ * just merged (when possible) and submitted one by one.
+ */
+int sunxi_g2d_blt_boxes(void               *self,
+                        uint32_t           *src_bits,
+                        uint32_t           *dst_bits,
+                        int                 src_stride,
+                        int                 dst_stride,
+                        int                 src_bpp,
+                        int                 dst_bpp,
+                        int                 src_x,
+                        int                 src_y,
+                        int                 dst_x,
+                        int                 dst_y,
+                        blt2d_box_t        *boxes,
+                        int                 nboxes)
+{
+    sunxi_disp_t *disp = (sunxi_disp_t *)self;
+    return blt2d_overlapped_blt_boxes_by_one(&disp->blt2d, src_bits, dst_bits,
+                                             src_stride, dst_stride,
+                                             src_bpp, dst_bpp, src_x, src_y,
+                                             dst_x, dst_y, boxes, nboxes);
+}
+
+/*
+ * G2D pixel alpha blending computes "src * alpha + dst * (1 - alpha)", which
+ * expects non-premultiplied source pixels, while Render always operates on
+ * premultiplied data ("src + dst * (1 - alpha)"). So the source is converted
+ * by the CPU into the staging buffer in the framebuffer first (this also
+ * allows the source to be in system memory), and then G2D does the blending
+ * with the destination. The uncached destination never needs to be read by
+ * the CPU, which is the slowest part of doing this operation in software.
+ */
+
+static uint32_t unpremultiply_recip[256];
+
+static void unpremultiply_row(uint32_t *dst, const uint32_t *src, int w)
+{
+    int i;
+    if (!unpremultiply_recip[1]) {
+        for (i = 1; i < 256; i++)
+            unpremultiply_recip[i] = (255 * 65536 + i / 2) / i;
+    }
+    for (i = 0; i < w; i++) {
+        uint32_t s = src[i], a = s >> 24, r, g, b;
+        if (a == 0 || a == 255) {
+            dst[i] = s;
+            continue;
+        }
+        r = (((s >> 16) & 0xFF) * unpremultiply_recip[a] + 0x8000) >> 16;
+        g = (((s >> 8) & 0xFF) * unpremultiply_recip[a] + 0x8000) >> 16;
+        b = ((s & 0xFF) * unpremultiply_recip[a] + 0x8000) >> 16;
+        /* the invalid premultiplied pixels may have color > alpha */
+        r = r > 255 ? 255 : r;
+        g = g > 255 ? 255 : g;
+        b = b > 255 ? 255 : b;
+        dst[i] = (a << 24) | (r << 16) | (g << 8) | b;
+    }
+}
+
+static inline uint32_t over_channel(uint32_t s, uint32_t d, uint32_t ia)
+{
+    uint32_t t = d * ia + 0x80;
+    t = s + ((t + (t >> 8)) >> 8);
+    return t > 255 ? 255 : t;
+}
+
+/* Premultiplied OVER by the CPU, only used if G2D fails in the middle */
+static void blend_over_rect_cpu(uint8_t *src, uint8_t *dst,
+                                int src_stride_bytes, int dst_stride_bytes,
+                                int dst_bpp, int w, int h)
+{
+    int x, y;
+    for (y = 0; y < h; y++) {
+        uint32_t *s32 = (uint32_t *)(src + y * src_stride_bytes);
+        for (x = 0; x < w; x++) {
+            uint32_t s = s32[x], ia = 255 - (s >> 24), d, r, g, b;
+            if (dst_bpp == 32)
+                d = ((uint32_t *)(dst + y * dst_stride_bytes))[x];
+            else {
+                uint16_t d16 = ((uint16_t *)(dst + y * dst_stride_bytes))[x];
+                d = ((d16 & 0xF800) << 8) | ((d16 & 0xE000) << 3) |
+                    ((d16 & 0x07E0) << 5) | ((d16 & 0x0600) >> 1) |
+                    ((d16 & 0x001F) << 3) | ((d16 & 0x001C) >> 2);
+            }
+            r = over_channel((s >> 16) & 0xFF, (d >> 16) & 0xFF, ia);
+            g = over_channel((s >> 8) & 0xFF, (d >> 8) & 0xFF, ia);
+            b = over_channel(s & 0xFF, d & 0xFF, ia);
+            if (dst_bpp == 32)
+                ((uint32_t *)(dst + y * dst_stride_bytes))[x] =
+                                        0xFF000000 | (r << 16) | (g << 8) | b;
+            else
+                ((uint16_t *)(dst + y * dst_stride_bytes))[x] =
+                                        ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+        }
+    }
+}
+
+int sunxi_g2d_blend_over(void               *self,
+                         uint32_t           *src_bits,
+                         uint32_t           *dst_bits,
+                         int                 src_stride,
+                         int                 dst_stride,
+                         int                 src_bpp,
+                         int                 dst_bpp,
+                         int                 src_x,
+                         int                 src_y,
+                         int                 dst_x,
+                         int                 dst_y,
+                         int                 w,
+                         int                 h)
+{
+    sunxi_disp_t *disp = (sunxi_disp_t *)self;
+    uint32_t *staging;
+    int tile_w, tile_h, x, y, g2d_failed = 0;
+    g2d_blt tmp;
+
+    if (w <= 0 || h <= 0)
+        return 1;
+
+    if (disp->fd_g2d < 0 || !disp->blend_staging_size)
+        return 0;
+
+    if (src_bpp != 32 || (dst_bpp != 16 && dst_bpp != 32) ||
+        src_bits == dst_bits || w * h < G2D_BLT_SIZE_THRESHOLD)
+        return 0;
+
+    if ((uint8_t *)dst_bits < disp->framebuffer_addr ||
+        (uint8_t *)dst_bits >= disp->framebuffer_addr + disp->framebuffer_size)
+        return 0;
+
+    staging = (uint32_t *)(disp->framebuffer_addr + disp->blend_staging_offset);
+    tile_w = w < 1024 ? w : 1024;
+    tile_h = disp->blend_staging_size / (tile_w * 4);
+
+    tmp.flag                    = G2D_BLT_PIXEL_ALPHA;
+    tmp.src_image.addr[0]       = disp->framebuffer_paddr +
+                                  disp->blend_staging_offset;
+    tmp.src_image.w             = tile_w;
+    tmp.src_image.format        = G2D_FMT_ARGB_AYUV8888;
+    tmp.src_image.pixel_seq     = G2D_SEQ_NORMAL;
+    tmp.src_rect.x              = 0;
+    tmp.src_rect.y              = 0;
+    tmp.dst_image.addr[0]       = disp->framebuffer_paddr +
+                                  ((uint8_t *)dst_bits - disp->framebuffer_addr);
+    if (dst_bpp == 32) {
+        tmp.dst_image.w         = dst_stride;
+        tmp.dst_image.format    = G2D_FMT_ARGB_AYUV8888;
+        tmp.dst_image.pixel_seq = G2D_SEQ_NORMAL;
+    }
+    else {
+        tmp.dst_image.w         = dst_stride * 2;
+        tmp.dst_image.format    = G2D_FMT_RGB565;
+        tmp.dst_image.pixel_seq = G2D_SEQ_P10;
+    }
+    tmp.color                   = 0;
+    tmp.alpha                   = 0;
+
+    for (y = 0; y < h; y += tile_h) {
+        int th = h - y < tile_h ? h - y : tile_h;
+        for (x = 0; x < w; x += tile_w) {
+            int i, tw = w - x < tile_w ? w - x : tile_w;
+            uint32_t *src = src_bits + (src_y + y) * src_stride + src_x + x;
+            if (g2d_failed) {
+                blend_over_rect_cpu((uint8_t *)src,
+                                    (uint8_t *)dst_bits +
+                                    (dst_y + y) * dst_stride * 4 +
+                                    (dst_x + x) * dst_bpp / 8,
+                                    src_stride * 4, dst_stride * 4,
+                                    dst_bpp, tw, th);
+                continue;
+            }
+            for (i = 0; i < th; i++)
+                unpremultiply_row(staging + i * tile_w, src + i * src_stride, tw);
+            tmp.src_image.h = th;
+            tmp.src_rect.w  = tw;
+            tmp.src_rect.h  = th;
+            tmp.dst_image.h = dst_y + y + th;
+            tmp.dst_x       = dst_x + x;
+            tmp.dst_y       = dst_y + y;
+            if (ioctl(disp->fd_g2d, G2D_CMD_BITBLT, &tmp)) {
+                /* nothing has been modified yet, let the caller handle it */
+                if (x == 0 && y == 0)
+                    return 0;
+                g2d_failed = 1;
+                x -= tile_w;
+            }
+        }
+    }
+    return 1;
+}
+
+/*****************************************************************************/
+
+static inline void sunxi_g2d_set_image(sunxi_disp_t *disp,
+                                       g2d_image    *image,
+                                       uint32_t     *bits,
+                                       int           stride,
+                                       int           bpp,
+                                       int           h)
+{
+    image->addr[0] = disp->framebuffer_paddr +
+                     ((uint8_t *)bits - disp->framebuffer_addr);
+    image->h = h;
+    if (bpp == 32) {
+        image->w         = stride;
+        image->format    = G2D_FMT_ARGB_AYUV8888;
+        image->pixel_seq = G2D_SEQ_NORMAL;
+    }
+    else {
+        image->w         = stride * 2;
+        image->format    = G2D_FMT_RGB565;
+        image->pixel_seq = G2D_SEQ_P10;
+    }
+}
+
+int sunxi_g2d_stretch_blt(void               *self,
+                          uint32_t           *src_bits,
+                          uint32_t           *dst_bits,
+                          int                 src_stride,
+                          int                 dst_stride,
+                          int                 src_bpp,
+                          int                 dst_bpp,
+                          int                 src_x,
+                          int                 src_y,
+                          int                 src_w,
+                          int                 src_h,
+                          int                 dst_x,
+                          int                 dst_y,
+                          int                 dst_w,
+                          int                 dst_h)
+{
+    sunxi_disp_t *disp = (sunxi_disp_t *)self;
+    g2d_stretchblt tmp;
+
+    if (src_w <= 0 || src_h <= 0 || dst_w <= 0 || dst_h <= 0)
+        return 1;
+
+    if (disp->fd_g2d < 0)
+        return 0;
+
+    /* G2D can only access the framebuffer memory */
+    if (!sunxi_g2d_bits_in_framebuffer(disp, src_bits) ||
+        !sunxi_g2d_bits_in_framebuffer(disp, dst_bits) || src_bits == dst_bits)
+        return 0;
+
+    if ((src_bpp != 16 && src_bpp != 32) || (dst_bpp != 16 && dst_bpp != 32))
+        return 0;
+
+    if (dst_w * dst_h < G2D_STRETCH_SIZE_THRESHOLD)
+        return 0;
+
+    tmp.flag       = G2D_BLT_NONE;
+    sunxi_g2d_set_image(disp, &tmp.src_image, src_bits, src_stride, src_bpp,
+                        src_y + src_h);
+    tmp.src_rect.x = src_x;
+    tmp.src_rect.y = src_y;
+    tmp.src_rect.w = src_w;
+    tmp.src_rect.h = src_h;
+    sunxi_g2d_set_image(disp, &tmp.dst_image, dst_bits, dst_stride, dst_bpp,
+                        dst_y + dst_h);
+    tmp.dst_rect.x = dst_x;
+    tmp.dst_rect.y = dst_y;
+    tmp.dst_rect.w = dst_w;
+    tmp.dst_rect.h = dst_h;
+    tmp.color      = 0;
+    tmp.alpha      = 0;
+
+    return ioctl(disp->fd_g2d, G2D_CMD_STRETCHBLT, &tmp) == 0;
+}
+
+/*
+ * 16bpp fills are done in 32bpp mode with the color duplicated in both
+ * halves of each 32-bit word (similar to sunxi_g2d_blit_r5g6b5_in_three).
+ * The unaligned left and right edge columns are just written by the CPU.
+ */
+int sunxi_g2d_fill(void               *self,
+                   uint32_t           *bits,
+                   int                 stride,
+                   int                 bpp,
+                   int                 x,
+                   int                 y,
+                   int                 w,
+                   int                 h,
+                   uint32_t            color)
+{
+    sunxi_disp_t *disp = (sunxi_disp_t *)self;
+    g2d_fillrect tmp;
+    int i;
+
+    if (w <= 0 || h <= 0)
+        return 1;
+
+    if (disp->fd_g2d < 0 || !sunxi_g2d_bits_in_framebuffer(disp, bits))
+        return 0;
+
+    if ((bpp != 16 && bpp != 32) || w * h < G2D_FILL_SIZE_THRESHOLD)
+        return 0;
+
+    if (bpp == 16) {
+        uint16_t *p = (uint16_t *)(bits + y * stride);
+        color &= 0xFFFF;
+        if (x & 1) {
+            for (i = 0; i < h; i++)
+                p[i * stride * 2 + x] = color;
+            x++;
+            w--;
+        }
+        if (w & 1) {
+            for (i = 0; i < h; i++)
+                p[i * stride * 2 + x + w - 1] = color;
+            w--;
+        }
+        if (w == 0)
+            return 1;
+        x /= 2;
+        w /= 2;
+        color |= color << 16;
+    }
+
+    tmp.flag       = G2D_FIL_NONE;
+    sunxi_g2d_set_image(disp, &tmp.dst_image, bits, stride, 32, y + h);
+    tmp.dst_rect.x = x;
+    tmp.dst_rect.y = y;
+    tmp.dst_rect.w = w;
+    tmp.dst_rect.h = h;
+    tmp.color      = color;
+    tmp.alpha      = 0;
+
+    return ioctl(disp->fd_g2d, G2D_CMD_FILLRECT, &tmp) == 0;
+}
+
+/*****************************************************************************/
+
+/* The smallest staging buffer, which is still useful for the rotation */
+#define G2D_ROTATE_STAGING_MIN_SIZE (64 * 1024)
+
+int sunxi_g2d_reserve_rotate_staging(sunxi_disp_t *disp)
+{
+    uint32_t size = disp->pixmap_heap_offset - disp->gfx_layer_size;
+
+    if (disp->fd_g2d < 0)
+        return 0;
+
+    if (size > disp->gfx_layer_size)
+        size = disp->gfx_layer_size;
+    size &= ~4095;
+    if (size < G2D_ROTATE_STAGING_MIN_SIZE)
+        return 0;
+
+    disp->pixmap_heap_offset -= size;
+    disp->rotate_staging_offset = disp->pixmap_heap_offset;
+    disp->rotate_staging_size = size;
+    return 1;
+}
+
+int sunxi_g2d_blit_rotated(sunxi_disp_t *disp,
+                           int           w,
+                           int           h,
+                           int           stride,
+                           int           dst_x,
+                           int           dst_y,
+                           int           degrees_cw)
+{
+    g2d_blt tmp;
+
+    if (disp->fd_g2d < 0 || !disp->rotate_staging_size ||
+        (disp->bits_per_pixel != 16 && disp->bits_per_pixel != 32))
+        return 0;
+
+    if (w <= 0 || h <= 0)
+        return 1;
+
+    switch (degrees_cw) {
+    case 90:
+        tmp.flag = G2D_BLT_ROTATE90;
+        break;
+    case 180:
+        tmp.flag = G2D_BLT_ROTATE180;
+        break;
+    case 270:
+        tmp.flag = G2D_BLT_ROTATE270;
+        break;
+    default:
+        return 0;
+    }
+
+    if (disp->bits_per_pixel == 32) {
+        tmp.src_image.format    = G2D_FMT_ARGB_AYUV8888;
+        tmp.src_image.pixel_seq = G2D_SEQ_NORMAL;
+    }
+    else {
+        tmp.src_image.format    = G2D_FMT_RGB565;
+        tmp.src_image.pixel_seq = G2D_SEQ_P10;
+    }
+    tmp.src_image.addr[0]   = disp->framebuffer_paddr +
+                              disp->rotate_staging_offset;
+    tmp.src_image.w         = stride;
+    tmp.src_image.h         = h;
+    tmp.src_rect.x          = 0;
+    tmp.src_rect.y          = 0;
+    tmp.src_rect.w          = w;
+    tmp.src_rect.h          = h;
+    tmp.dst_image.addr[0]   = disp->framebuffer_paddr;
+    tmp.dst_image.w         = disp->xres;
+    tmp.dst_image.h         = disp->yres;
+    tmp.dst_image.format    = tmp.src_image.format;
+    tmp.dst_image.pixel_seq = tmp.src_image.pixel_seq;
+    tmp.dst_x               = dst_x;
+    tmp.dst_y               = dst_y;
+    tmp.color               = 0;
+    tmp.alpha               = 0;
+
+    return ioctl(disp->fd_g2d, G2D_CMD_BITBLT, &tmp) == 0;
+}
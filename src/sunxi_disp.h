@@ -25,8 +25,43 @@
 #define SUNXI_DISP_H
 
 #include <inttypes.h>
+#include <pthread.h>
 
 #include "interfaces.h"
+#include "blt2d_route.h"
+
+/* The arguments of a blit, which is passed to the G2D worker thread */
+typedef struct {
+    uint32_t *src_bits;
+    uint32_t *dst_bits;
+    int       src_stride;
+    int       dst_stride;
+    int       src_bpp;
+    int       dst_bpp;
+    int       src_x;
+    int       src_y;
+    int       dst_x;
+    int       dst_y;
+    int       w;
+    int       h;
+} sunxi_g2d_blt_args_t;
+
+/* The maximal number of layers in the pool (the display has two scalers) */
+#define SUNXI_DISP_MAX_LAYERS 2
+
+/* The state of one layer reserved for overlays */
+typedef struct {
+    int                 id;
+    int                 has_scaler;
+
+    int                 buf_x, buf_y, buf_w, buf_h;
+    int                 win_x, win_y;
+    int                 scaler_is_enabled;
+    int                 colorkey_is_enabled;
+    int                 format;
+} sunxi_layer_t;
+
+typedef struct sunxi_vsync_counter sunxi_vsync_counter_t;
 
 /*
  * Support for Allwinner A10 display controller features such as layers
@@ -44,6 +79,15 @@ typedef struct {
     uint32_t            framebuffer_size;  /* total size of the framebuffer */
     int                 framebuffer_height;/* virtual vertical resolution */
     uint32_t            gfx_layer_size;    /* the size of the primary layer */
+    uint32_t            pixmap_heap_offset;/* offscreen memory ends here */
+
+    /* A part of the offscreen memory used by sunxi_g2d_blend_over */
+    uint32_t            blend_staging_offset;
+    uint32_t            blend_staging_size;
+
+    /* A part of the offscreen memory used by sunxi_g2d_blit_rotated */
+    uint32_t            rotate_staging_offset;
+    uint32_t            rotate_staging_size;
 
     uint8_t            *xserver_fbmem; /* framebuffer mapping done by xserver */
 
@@ -53,18 +97,40 @@ typedef struct {
 
     /* Layers support */
     int                 gfx_layer_id;
-    int                 layer_id;
-    int                 layer_has_scaler;
-
-    int                 layer_buf_x, layer_buf_y, layer_buf_w, layer_buf_h;
-    int                 layer_win_x, layer_win_y;
-    int                 layer_scaler_is_enabled;
-    int                 layer_format;
+    sunxi_layer_t       layers[SUNXI_DISP_MAX_LAYERS];
+    int                 nlayers;
 
     /* G2D accelerated implementation of blt2d_i interface */
     blt2d_i             blt2d;
     /* Optional fallback interface to handle unsupported operations */
     blt2d_i            *fallback_blt2d;
+    /* Chooses between G2D and the fallback interface for each blit */
+    blt2d_route_t       route;
+
+    /*
+     * Split mode: a part of each very large blit is submitted to G2D from
+     * a worker thread, while the fallback interface does the rest of it
+     * at the same time. The share of G2D is based on the measured speed
+     * (pixels per microsecond) of both.
+     */
+    int                 split;
+    pthread_t           split_thread;
+    pthread_mutex_t     split_lock;
+    pthread_cond_t      split_work_cond; /* signalled when there is a job */
+    pthread_cond_t      split_done_cond; /* signalled when the job is done */
+    sunxi_g2d_blt_args_t split_job;
+    int                 split_pending;
+    int                 split_result;
+    int                 split_quit;
+    double              split_g2d_speed;
+    double              split_cpu_speed;
+
+    /*
+     * Vsync counter, which is incremented by a thread waiting for each
+     * vsync. Allows to find out whether the display controller may still
+     * be reading from a buffer, which has been replaced on the layer.
+     */
+    sunxi_vsync_counter_t *vsync_counter;  /* NULL if not running */
 } sunxi_disp_t;
 
 sunxi_disp_t *sunxi_disp_init(const char *fb_device, void *xserver_fbmem);
@@ -82,16 +148,19 @@ int sunxi_hw_cursor_show(sunxi_disp_t *ctx);
 int sunxi_hw_cursor_hide(sunxi_disp_t *ctx);
 
 /*
- * Support for one sunxi disp layer (even though there are more than
- * one available) in the offscreen part of framebuffer, which may be
- * useful for DRI2 vsync aware frame flipping and implementing XV
- * extension (video overlay).
+ * Support for a pool of sunxi disp layers in the offscreen part of
+ * framebuffer, which may be useful for DRI2 vsync aware frame flipping
+ * and implementing XV extension (video overlay). The first layer is
+ * always reserved (if possible), and up to SUNXI_DISP_MAX_LAYERS - 1
+ * more only if they can get their own scaler. The layers are referred
+ * to by their index in the pool.
  */
 
 int sunxi_layer_reserve(sunxi_disp_t *ctx);
 int sunxi_layer_release(sunxi_disp_t *ctx);
 
 int sunxi_layer_set_rgb_input_buffer(sunxi_disp_t  *ctx,
+                                     int            layer,
                                      int            bpp,
                                      uint32_t       offset_in_framebuffer,
                                      int            width,
@@ -99,6 +168,7 @@ int sunxi_layer_set_rgb_input_buffer(sunxi_disp_t  *ctx,
                                      int            stride);
 
 int sunxi_layer_set_yuv420_input_buffer(sunxi_disp_t *ctx,
+                                        int           layer,
                                         uint32_t      y_offset_in_framebuffer,
                                         uint32_t      u_offset_in_framebuffer,
                                         uint32_t      v_offset_in_framebuffer,
@@ -108,19 +178,64 @@ int sunxi_layer_set_yuv420_input_buffer(sunxi_disp_t *ctx,
                                         int           x_pixel_offset,
                                         int           y_pixel_offset);
 
-int sunxi_layer_set_output_window(sunxi_disp_t *ctx, int x, int y, int w, int h);
+/* NV12 (or NV21 if 'vu_order' is set): a Y plane and a plane of UV pairs */
+int sunxi_layer_set_yuv420_uv_combined_input_buffer(
+                                        sunxi_disp_t *ctx,
+                                        int           layer,
+                                        uint32_t      y_offset_in_framebuffer,
+                                        uint32_t      uv_offset_in_framebuffer,
+                                        int           width,
+                                        int           height,
+                                        int           stride,
+                                        int           x_pixel_offset,
+                                        int           y_pixel_offset,
+                                        int           vu_order);
+
+/* YUY2 (or UYVY if 'uyvy_order' is set), the stride is in pixels */
+int sunxi_layer_set_yuv422_interleaved_input_buffer(
+                                        sunxi_disp_t *ctx,
+                                        int           layer,
+                                        uint32_t      offset_in_framebuffer,
+                                        int           width,
+                                        int           height,
+                                        int           stride,
+                                        int           x_pixel_offset,
+                                        int           y_pixel_offset,
+                                        int           uyvy_order);
 
-int sunxi_layer_set_colorkey(sunxi_disp_t *ctx, uint32_t color);
-int sunxi_layer_disable_colorkey(sunxi_disp_t *ctx);
+int sunxi_layer_set_output_window(sunxi_disp_t *ctx, int layer,
+                                  int x, int y, int w, int h);
 
-int sunxi_layer_show(sunxi_disp_t *ctx);
-int sunxi_layer_hide(sunxi_disp_t *ctx);
+/*
+ * The color key is shared by all the layers (the display controller has
+ * only one), but it is enabled separately for each of them.
+ */
+int sunxi_layer_set_colorkey(sunxi_disp_t *ctx, int layer, uint32_t color);
+int sunxi_layer_disable_colorkey(sunxi_disp_t *ctx, int layer);
+
+int sunxi_layer_show(sunxi_disp_t *ctx, int layer);
+int sunxi_layer_hide(sunxi_disp_t *ctx, int layer);
 
 /*
  * Wait for vsync
  */
 int sunxi_wait_for_vsync(sunxi_disp_t *ctx);
 
+/*
+ * Start counting vsyncs in a background thread (from zero). The thread
+ * wakes up on every vsync, so it should only run while it is needed.
+ * Stopping does not wait for the thread, which exits after its current
+ * wait for vsync.
+ */
+int sunxi_vsync_counter_start(sunxi_disp_t *ctx);
+void sunxi_vsync_counter_stop(sunxi_disp_t *ctx);
+
+/*
+ * Get the number of vsyncs counted so far. Returns 0 if the counter is not
+ * running or if waiting for vsync is failing at the moment.
+ */
+int sunxi_get_vsync_count(sunxi_disp_t *ctx, uint32_t *count);
+
 /*
  * Simple G2D fill and blit operations
  */
@@ -142,13 +257,23 @@ int sunxi_g2d_blit_a8r8g8b8(sunxi_disp_t *disp,
 
 /*
  * The following constants are used sunxi_disp.c and represent
- * the area threshold below which the sunxi_g2d_blit function will
- * return 0, indicating that a software blit is preferred. The
- * 16BPP constant applies to 16bpp to 16bpp blit.
+ * the area threshold below which a software blit is preferred by
+ * the sunxi_g2d_blt function. The 16BPP constant applies to 16bpp
+ * to 16bpp blit. These are only the initial guess for the routing
+ * table, which may be changed by the calibration and the timing
+ * of the blits later.
  */
 #define G2D_BLT_SIZE_THRESHOLD 1000
 #define G2D_BLT_SIZE_THRESHOLD_16BPP 2500
 
+/*
+ * Measure the speed of G2D and the fallback interface for different
+ * kinds of blits and update the routing table. Uses (and destroys the
+ * contents of) the offscreen part of the framebuffer, so it must be
+ * done before anything else starts using it.
+ */
+int sunxi_g2d_calibrate(sunxi_disp_t *disp);
+
 /* G2D counterpart for pixman_blt with the support for 16bpp and 32bpp */
 int sunxi_g2d_blt(void               *disp,
                   uint32_t           *src_bits,
@@ -164,4 +289,115 @@ int sunxi_g2d_blt(void               *disp,
                   int                 w,
                   int                 h);
 
+/*
+ * The area threshold, starting from which the blits are split between
+ * G2D and the fallback interface (if the split mode is enabled).
+ */
+#define G2D_SPLIT_SIZE_THRESHOLD (256 * 1024)
+
+/*
+ * Start the worker thread for the split mode. Needs the fallback_blt2d
+ * interface to be already set.
+ */
+int sunxi_g2d_enable_split(sunxi_disp_t *disp);
+
+/*
+ * The destination area threshold for the sunxi_g2d_stretch_blt function.
+ * Scaling with bilinear filtering is a lot more expensive for the CPU
+ * than a plain copy, so G2D becomes faster already at a smaller size.
+ */
+#define G2D_STRETCH_SIZE_THRESHOLD 500
+
+/* G2D implementation of blt2d_i.stretch_blt */
+int sunxi_g2d_stretch_blt(void               *disp,
+                          uint32_t           *src_bits,
+                          uint32_t           *dst_bits,
+                          int                 src_stride,
+                          int                 dst_stride,
+                          int                 src_bpp,
+                          int                 dst_bpp,
+                          int                 src_x,
+                          int                 src_y,
+                          int                 src_w,
+                          int                 src_h,
+                          int                 dst_x,
+                          int                 dst_y,
+                          int                 dst_w,
+                          int                 dst_h);
+
+/*
+ * The area threshold for the sunxi_g2d_fill function. Unlike blits, solid
+ * fills do not need to read the uncached framebuffer memory, so the CPU
+ * stays competitive for somewhat larger areas.
+ */
+#define G2D_FILL_SIZE_THRESHOLD 4000
+
+/* G2D implementation of blt2d_i.fill (16bpp and 32bpp) */
+int sunxi_g2d_fill(void               *disp,
+                   uint32_t           *bits,
+                   int                 stride,
+                   int                 bpp,
+                   int                 x,
+                   int                 y,
+                   int                 w,
+                   int                 h,
+                   uint32_t            color);
+
+/*
+ * The size of the framebuffer area, which is reserved for converting the
+ * source of G2D blending operations to non-premultiplied alpha format.
+ */
+#define G2D_BLEND_STAGING_SIZE (256 * 1024)
+
+/* G2D implementation of blt2d_i.blend_over */
+int sunxi_g2d_blend_over(void               *disp,
+                         uint32_t           *src_bits,
+                         uint32_t           *dst_bits,
+                         int                 src_stride,
+                         int                 dst_stride,
+                         int                 src_bpp,
+                         int                 dst_bpp,
+                         int                 src_x,
+                         int                 src_y,
+                         int                 dst_x,
+                         int                 dst_y,
+                         int                 w,
+                         int                 h);
+
+/*
+ * Support for the rotated display. The CPU copies the updated parts of
+ * the (cached) shadow framebuffer to the staging buffer in the offscreen
+ * part of the framebuffer, and then G2D rotates them to the visible part.
+ *
+ * sunxi_g2d_reserve_rotate_staging tries to reserve up to the size of the
+ * visible part for the staging buffer and returns 0 if there is not enough
+ * offscreen memory. sunxi_g2d_blit_rotated copies a w x h image (with
+ * the stride in pixels) from the beginning of the staging buffer to the
+ * visible part of the framebuffer at (dst_x, dst_y), rotating it clockwise
+ * by 90, 180 or 270 degrees.
+ */
+int sunxi_g2d_reserve_rotate_staging(sunxi_disp_t *disp);
+int sunxi_g2d_blit_rotated(sunxi_disp_t *disp,
+                           int           w,
+                           int           h,
+                           int           stride,
+                           int           dst_x,
+                           int           dst_y,
+                           int           degrees_cw);
+
+/* The same as sunxi_g2d_blt, but for a list of boxes */
+int sunxi_g2d_blt_boxes(void               *disp,
+                        uint32_t           *src_bits,
+                        uint32_t           *dst_bits,
+                        int                 src_stride,
+                        int                 dst_stride,
+                        int                 src_bpp,
+                        int                 dst_bpp,
+                        int                 src_x,
+                        int                 src_y,
+                        int                 dst_x,
+                        int                 dst_y,
+                        blt2d_box_t        *boxes,
+                        int                 nboxes);
+
 #endif
@@ -430,7 +430,7 @@ static DRI2Buffer2Ptr MaliDRI2CreateBuffer(DrawablePtr  pDraw,
     if (pDraw->bitsPerPixel != 32 && pDraw->bitsPerPixel != 16)
         can_use_overlay = FALSE;
 
-    if (disp && disp->framebuffer_size - disp->gfx_layer_size < privates->size * 2) {
+    if (disp && disp->pixmap_heap_offset - disp->gfx_layer_size < privates->size * 2) {
         DebugMsg("Not enough space in the offscreen framebuffer (wanted %d for DRI2)\n",
                  privates->size);
         can_use_overlay = FALSE;
@@ -446,7 +446,7 @@ static DRI2Buffer2Ptr MaliDRI2CreateBuffer(DrawablePtr  pDraw,
         if (disp && can_use_overlay) {
             /* erase the offscreen part of the framebuffer */
             memset(disp->framebuffer_addr + disp->gfx_layer_size, 0,
-                   disp->framebuffer_size - disp->gfx_layer_size);
+                   disp->pixmap_heap_offset - disp->gfx_layer_size);
         }
     }
     window_state->buf_request_cnt++;
@@ -827,10 +827,10 @@ static void MaliDRI2CopyRegion(DrawablePtr   pDraw,
     mali->pOverlayDirtyUMP = umpbuf;
 
     /* Activate the overlay */
-    sunxi_layer_set_output_window(disp, pDraw->x, pDraw->y, pDraw->width, pDraw->height);
-    sunxi_layer_set_rgb_input_buffer(disp, umpbuf->cpp * 8, umpbuf->offs,
+    sunxi_layer_set_output_window(disp, 0, pDraw->x, pDraw->y, pDraw->width, pDraw->height);
+    sunxi_layer_set_rgb_input_buffer(disp, 0, umpbuf->cpp * 8, umpbuf->offs,
                                      umpbuf->width, umpbuf->height, umpbuf->pitch / 4);
-    sunxi_layer_show(disp);
+    sunxi_layer_show(disp, 0);
 
     if (mali->bSwapbuffersWait) {
         /* FIXME: blocking here for up to 1/60 second is not nice */
@@ -853,7 +853,7 @@ static void UpdateOverlay(ScreenPtr pScreen)
     if (!mali->bHardwareCursorIsInUse) {
         if (mali->bOverlayWinEnabled) {
             DebugMsg("Disabling overlay (no hardware cursor)\n");
-            sunxi_layer_hide(disp);
+            sunxi_layer_hide(disp, 0);
             mali->bOverlayWinEnabled = FALSE;
         }
         return;
@@ -864,7 +864,7 @@ static void UpdateOverlay(ScreenPtr pScreen)
     {
         if (mali->bOverlayWinEnabled) {
             DebugMsg("Disabling overlay (window is not mapped)\n");
-            sunxi_layer_hide(disp);
+            sunxi_layer_hide(disp, 0);
             mali->bOverlayWinEnabled = FALSE;
         }
         return;
@@ -885,7 +885,7 @@ static void UpdateOverlay(ScreenPtr pScreen)
         DebugMsg("Disabling overlay (window is obscured)\n");
         FlushOverlay(pScreen);
         mali->bOverlayWinEnabled = FALSE;
-        sunxi_layer_hide(disp);
+        sunxi_layer_hide(disp, 0);
         return;
     }
 
@@ -897,7 +897,7 @@ static void UpdateOverlay(ScreenPtr pScreen)
         mali->overlay_x = mali->pOverlayWin->drawable.x;
         mali->overlay_y = mali->pOverlayWin->drawable.y;
 
-        sunxi_layer_set_output_window(disp, mali->pOverlayWin->drawable.x,
+        sunxi_layer_set_output_window(disp, 0, mali->pOverlayWin->drawable.x,
                                       mali->pOverlayWin->drawable.y,
                                       mali->pOverlayWin->drawable.width,
                                       mali->pOverlayWin->drawable.height);
@@ -908,7 +908,7 @@ static void UpdateOverlay(ScreenPtr pScreen)
     if (!mali->bOverlayWinOverlapped && !mali->bOverlayWinEnabled) {
         DebugMsg("Enabling overlay (window is fully unobscured)\n");
         mali->bOverlayWinEnabled = TRUE;
-        sunxi_layer_show(disp);
+        sunxi_layer_show(disp, 0);
     }
 }
 
@@ -936,7 +936,7 @@ DestroyWindow(WindowPtr pWin)
 
     if (pWin == mali->pOverlayWin) {
         sunxi_disp_t *disp = SUNXI_DISP(pScrn);
-        sunxi_layer_hide(disp);
+        sunxi_layer_hide(disp, 0);
         mali->pOverlayWin = NULL;
         DebugMsg("DestroyWindow %p\n", pWin);
     }
@@ -1148,7 +1148,7 @@ SunxiMaliDRI2 *SunxiMaliDRI2_Init(ScreenPtr pScreen,
             mali->ump_fb_secure_id = UMP_INVALID_SECURE_ID;
             mali->ump_alternative_fb_secure_id = UMP_INVALID_SECURE_ID;
         }
-        if (disp->framebuffer_size - disp->gfx_layer_size <
+        if (disp->pixmap_heap_offset - disp->gfx_layer_size <
                                                  disp->xres * disp->yres * 4 * 2) {
             int needed_fb_num = (disp->xres * disp->yres * 4 * 2 +
                                  disp->gfx_layer_size - 1) / disp->gfx_layer_size + 1;
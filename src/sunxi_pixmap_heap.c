@@ -0,0 +1,326 @@
+/*
+ * Copyright © 2013 Siarhei Siamashka <siarhei.siamashka@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "xorgVersion.h"
+#include "xf86.h"
+#include "fb.h"
+
+#include "fbdev_priv.h"
+#include "sunxi_pixmap_heap.h"
+
+/*
+ * G2D can only access physically contiguous memory, which in practice
+ * means the framebuffer. So the pixmaps, which are likely to be copied
+ * to and from the screen (backing store, composite window pixmaps, off
+ * screen double buffers), are placed into the unused part of the
+ * framebuffer if possible. This makes CopyArea/CopyWindow between them
+ * and the screen G2D accelerated.
+ *
+ * The allocator is very simple: the resident pixmaps are kept in a list
+ * sorted by offset, and the first gap which is large enough is used.
+ * When there is no such gap, the least recently used pixmaps are moved
+ * back to system memory until the allocation succeeds.
+ */
+
+/* The smallest pixmap worth placing into the heap (in pixels) */
+#define HEAP_MIN_PIXELS  (64 * 64)
+/* The alignment of pixmaps in the heap */
+#define HEAP_ALIGN       64
+
+static uint32_t
+heap_find_gap(SunxiPixmapHeap *self, uint32_t size, HeapPixmap **prev)
+{
+    uint32_t offset = self->heap_begin;
+    HeapPixmap *p = self->resident;
+    *prev = NULL;
+    while (p) {
+        if (p->offset - offset >= size)
+            return offset;
+        offset = p->offset + p->size;
+        *prev = p;
+        p = p->next;
+    }
+    if (self->heap_end - offset >= size)
+        return offset;
+    return 0;
+}
+
+static void
+heap_unlink(SunxiPixmapHeap *self, HeapPixmap *p)
+{
+    if (p->prev)
+        p->prev->next = p->next;
+    else
+        self->resident = p->next;
+    if (p->next)
+        p->next->prev = p->prev;
+    p->prev = p->next = NULL;
+    p->resident = FALSE;
+}
+
+/* Copy the pixmap data to system memory and release its heap space */
+static Bool
+heap_evict(SunxiPixmapHeap *self, HeapPixmap *p)
+{
+    PixmapPtr pPixmap = p->pPixmap;
+    uint8_t *fbaddr = self->disp->framebuffer_addr + p->offset;
+    void *sysmem;
+
+    if (pPixmap->devPrivate.ptr != fbaddr) {
+        /* somebody else has already replaced the storage (UMP migration) */
+        heap_unlink(self, p);
+        return TRUE;
+    }
+
+    sysmem = malloc(p->size);
+    if (!sysmem)
+        return FALSE;
+
+    if (!self->blt2d->overlapped_blt(self->blt2d->self,
+                                     (uint32_t *)fbaddr, (uint32_t *)sysmem,
+                                     pPixmap->devKind / 4, pPixmap->devKind / 4,
+                                     pPixmap->drawable.bitsPerPixel,
+                                     pPixmap->drawable.bitsPerPixel,
+                                     0, 0, 0, 0,
+                                     pPixmap->drawable.width,
+                                     pPixmap->drawable.height))
+        memcpy(sysmem, fbaddr, p->size);
+
+    pPixmap->drawable.pScreen->ModifyPixmapHeader(pPixmap, 0, 0, 0, 0, 0,
+                                                  sysmem);
+    p->sysmem = sysmem;
+    heap_unlink(self, p);
+    DebugMsg("SunxiPixmapHeap: evicted pixmap %p (%d bytes)\n",
+             pPixmap, p->size);
+    return TRUE;
+}
+
+static uint32_t
+heap_alloc(SunxiPixmapHeap *self, uint32_t size, HeapPixmap **prev)
+{
+    uint32_t offset;
+
+    if (size > self->heap_end - self->heap_begin)
+        return 0;
+
+    while (!(offset = heap_find_gap(self, size, prev))) {
+        HeapPixmap *p, *lru = NULL;
+        for (p = self->resident; p; p = p->next) {
+            if (!lru || (int)(p->last_use - lru->last_use) < 0)
+                lru = p;
+        }
+        if (!lru || !heap_evict(self, lru))
+            return 0;
+    }
+    return offset;
+}
+
+static PixmapPtr
+xCreatePixmap(ScreenPtr pScreen, int width, int height, int depth,
+              unsigned usage_hint)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiPixmapHeap *self = SUNXI_PIXMAP_HEAP(pScrn);
+    int bpp = BitsPerPixel(depth);
+    int devKind = PixmapBytePad(width, depth);
+    uint32_t size = ((uint32_t)devKind * height + HEAP_ALIGN - 1) &
+                    ~(HEAP_ALIGN - 1);
+    uint32_t offset = 0;
+    HeapPixmap *p, *prev = NULL;
+    PixmapPtr pPixmap;
+
+    /* the framebuffer is not preserved while switched away from the VT */
+    if (pScrn->vtSema &&
+        (usage_hint == 0 || usage_hint == CREATE_PIXMAP_USAGE_BACKING_PIXMAP) &&
+        bpp == pScrn->bitsPerPixel && (bpp == 16 || bpp == 32) &&
+        width * height >= HEAP_MIN_PIXELS)
+        offset = heap_alloc(self, size, &prev);
+
+    /* only allocate the pixmap header if we provide the storage */
+    pScreen->CreatePixmap = self->CreatePixmap;
+    pPixmap = (*pScreen->CreatePixmap) (pScreen, offset ? 0 : width,
+                                        offset ? 0 : height, depth,
+                                        usage_hint);
+    self->CreatePixmap = pScreen->CreatePixmap;
+    pScreen->CreatePixmap = xCreatePixmap;
+
+    if (!offset || !pPixmap)
+        return pPixmap;
+
+    p = calloc(1, sizeof(HeapPixmap));
+    if (!p) {
+        pScreen->DestroyPixmap(pPixmap);
+        return NULL;
+    }
+    pScreen->ModifyPixmapHeader(pPixmap, width, height, depth, bpp, devKind,
+                                self->disp->framebuffer_addr + offset);
+
+    p->pPixmap  = pPixmap;
+    p->offset   = offset;
+    p->size     = size;
+    p->last_use = ++self->use_counter;
+    p->resident = TRUE;
+    p->prev     = prev;
+    p->next     = prev ? prev->next : self->resident;
+    if (p->next)
+        p->next->prev = p;
+    if (prev)
+        prev->next = p;
+    else
+        self->resident = p;
+    HASH_ADD_PTR(self->HashPixmap, pPixmap, p);
+
+    return pPixmap;
+}
+
+static Bool
+xDestroyPixmap(PixmapPtr pPixmap)
+{
+    ScreenPtr pScreen = pPixmap->drawable.pScreen;
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiPixmapHeap *self = SUNXI_PIXMAP_HEAP(pScrn);
+    HeapPixmap *p = NULL;
+    Bool result;
+
+    if (pPixmap->refcnt == 1) {
+        HASH_FIND_PTR(self->HashPixmap, &pPixmap, p);
+        if (p) {
+            HASH_DEL(self->HashPixmap, p);
+            if (p->resident)
+                heap_unlink(self, p);
+        }
+    }
+
+    pScreen->DestroyPixmap = self->DestroyPixmap;
+    result = (*pScreen->DestroyPixmap) (pPixmap);
+    self->DestroyPixmap = pScreen->DestroyPixmap;
+    pScreen->DestroyPixmap = xDestroyPixmap;
+
+    if (p) {
+        free(p->sysmem);
+        free(p);
+    }
+    return result;
+}
+
+void SunxiPixmapHeap_Touch(ScreenPtr pScreen, DrawablePtr pDrawable)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiPixmapHeap *self = SUNXI_PIXMAP_HEAP(pScrn);
+    PixmapPtr pPixmap;
+    HeapPixmap *p;
+
+    if (!self || !self->resident)
+        return;
+    if (pDrawable->type == DRAWABLE_WINDOW)
+        pPixmap = pScreen->GetWindowPixmap((WindowPtr)pDrawable);
+    else
+        pPixmap = (PixmapPtr)pDrawable;
+    HASH_FIND_PTR(self->HashPixmap, &pPixmap, p);
+    if (p)
+        p->last_use = ++self->use_counter;
+}
+
+void SunxiPixmapHeap_EvictAll(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiPixmapHeap *self = SUNXI_PIXMAP_HEAP(pScrn);
+
+    while (self->resident) {
+        if (!heap_evict(self, self->resident)) {
+            xf86DrvMsg(pScreen->myNum, X_WARNING,
+                       "SunxiPixmapHeap: failed to evict a pixmap\n");
+            break;
+        }
+    }
+}
+
+/*****************************************************************************/
+
+SunxiPixmapHeap *SunxiPixmapHeap_Init(ScreenPtr pScreen, sunxi_disp_t *disp,
+                                      blt2d_i *blt2d, uint32_t size)
+{
+    SunxiPixmapHeap *self;
+    uint32_t heap_begin;
+
+    size &= ~(uint32_t)(HEAP_ALIGN - 1);
+    if (size == 0 || disp->pixmap_heap_offset < size)
+        return NULL;
+    heap_begin = disp->pixmap_heap_offset - size;
+    if (heap_begin < disp->gfx_layer_size) {
+        xf86DrvMsg(pScreen->myNum, X_INFO,
+            "SunxiPixmapHeap_Init: not enough offscreen framebuffer memory\n");
+        return NULL;
+    }
+
+    self = calloc(1, sizeof(SunxiPixmapHeap));
+    if (!self) {
+        xf86DrvMsg(pScreen->myNum, X_INFO,
+            "SunxiPixmapHeap_Init: calloc failed\n");
+        return NULL;
+    }
+
+    self->disp       = disp;
+    self->blt2d      = blt2d;
+    /* offset 0 is used as an allocation failure indicator */
+    self->heap_begin = heap_begin ? heap_begin : HEAP_ALIGN;
+    self->heap_end   = disp->pixmap_heap_offset;
+
+    /* Xv and DRI2 must not use this memory anymore */
+    disp->pixmap_heap_offset = heap_begin;
+
+    /* Wrap the current CreatePixmap function */
+    self->CreatePixmap = pScreen->CreatePixmap;
+    pScreen->CreatePixmap = xCreatePixmap;
+
+    /* Wrap the current DestroyPixmap function */
+    self->DestroyPixmap = pScreen->DestroyPixmap;
+    pScreen->DestroyPixmap = xDestroyPixmap;
+
+    return self;
+}
+
+void SunxiPixmapHeap_Close(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiPixmapHeap *self = SUNXI_PIXMAP_HEAP(pScrn);
+    HeapPixmap *p, *tmp;
+
+    pScreen->CreatePixmap  = self->CreatePixmap;
+    pScreen->DestroyPixmap = self->DestroyPixmap;
+
+    /* the pixmaps still alive at this point are just forgotten */
+    HASH_ITER(hh, self->HashPixmap, p, tmp) {
+        HASH_DEL(self->HashPixmap, p);
+        free(p);
+    }
+    self->resident = NULL;
+    self->disp->pixmap_heap_offset = self->heap_end;
+}
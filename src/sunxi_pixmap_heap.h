@@ -0,0 +1,74 @@
+/*
+ * Copyright © 2013 Siarhei Siamashka <siarhei.siamashka@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef SUNXI_PIXMAP_HEAP_H
+#define SUNXI_PIXMAP_HEAP_H
+
+#include "interfaces.h"
+#include "uthash.h"
+#include "sunxi_disp.h"
+
+/* A pixmap, which has been placed into the offscreen framebuffer memory */
+typedef struct HeapPixmap {
+    PixmapPtr           pPixmap;
+    uint32_t            offset;    /* offset in the framebuffer */
+    uint32_t            size;
+    unsigned int        last_use;  /* for the LRU eviction */
+    void               *sysmem;    /* system memory after eviction, or NULL */
+    Bool                resident;  /* still occupies the heap space */
+    struct HeapPixmap  *prev;      /* the list of resident pixmaps, */
+    struct HeapPixmap  *next;      /* sorted by offset */
+    UT_hash_handle      hh;
+} HeapPixmap;
+
+typedef struct {
+    sunxi_disp_t           *disp;
+    /* Used for copying the pixmap data back to system memory */
+    blt2d_i                *blt2d;
+
+    uint32_t                heap_begin;   /* offsets in the framebuffer */
+    uint32_t                heap_end;
+
+    HeapPixmap             *HashPixmap;   /* all the pixmaps, by PixmapPtr */
+    HeapPixmap             *resident;     /* the first resident pixmap */
+    unsigned int            use_counter;
+
+    CreatePixmapProcPtr     CreatePixmap;
+    DestroyPixmapProcPtr    DestroyPixmap;
+} SunxiPixmapHeap;
+
+/*
+ * Reserve 'size' bytes at the end of the framebuffer for pixmaps (the
+ * rest of the offscreen area remains available for Xv and DRI2).
+ */
+SunxiPixmapHeap *SunxiPixmapHeap_Init(ScreenPtr pScreen, sunxi_disp_t *disp,
+                                      blt2d_i *blt2d, uint32_t size);
+void SunxiPixmapHeap_Close(ScreenPtr pScreen);
+
+/* Mark the drawable's pixmap as recently used (if it is in the heap) */
+void SunxiPixmapHeap_Touch(ScreenPtr pScreen, DrawablePtr pDrawable);
+
+/* Move all the pixmaps back to system memory (for example on VT switch) */
+void SunxiPixmapHeap_EvictAll(ScreenPtr pScreen);
+
+#endif
@@ -33,6 +33,7 @@
 #include <X11/extensions/Xv.h>
 
 #include "fbdev_priv.h"
+#include "cpu_backend.h"
 #include "sunxi_video.h"
 #include "sunxi_disp.h"
 
@@ -42,6 +43,27 @@
 #define ARRAY_SIZE(a)  (sizeof((a)) / sizeof((a)[0]))
 #endif
 
+/* Older versions of fourcc.h don't have the semi-planar formats */
+#ifndef FOURCC_NV12
+#define FOURCC_NV12 0x3231564e
+#define XVIMAGE_NV12 \
+   { FOURCC_NV12, XvYUV, LSBFirst, \
+     {'N','V','1','2',0x00,0x00,0x00,0x10,0x80,0x00,0x00,0xAA,0x00,0x38,0x9B,0x71}, \
+     12, XvPlanar, 2, 0, 0, 0, 0, 8, 8, 8, 1, 2, 2, 1, 2, 2, \
+     {'Y','U','V',0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0}, \
+     XvTopToBottom }
+#endif
+
+#ifndef FOURCC_NV21
+#define FOURCC_NV21 0x3132564e
+#define XVIMAGE_NV21 \
+   { FOURCC_NV21, XvYUV, LSBFirst, \
+     {'N','V','2','1',0x00,0x00,0x00,0x10,0x80,0x00,0x00,0xAA,0x00,0x38,0x9B,0x71}, \
+     12, XvPlanar, 2, 0, 0, 0, 0, 8, 8, 8, 1, 2, 2, 1, 2, 2, \
+     {'Y','V','U',0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0}, \
+     XvTopToBottom }
+#endif
+
 #define SIMD_ALIGN(s) (((s) + 15) & ~15)
 #define MAKE_ATOM(a) MakeAtom(a, sizeof(a) - 1, TRUE)
 
@@ -57,21 +79,66 @@ static uint32_t convert_color(ScrnInfoPtr pScrn, uint32_t color)
            (blue << pScrn->offset.blue);
 }
 
+/*
+ * The number of extra source pixels around the visible window, which are
+ * copied too (the scaler filter may need them for the edge pixels).
+ */
+#define CLIP_MARGIN 2
+
+/*
+ * Copy the (x1, y1) - (x2, y2) rectangle of a plane to the framebuffer,
+ * using burst writes (split between the CPU backend threads if enabled).
+ */
+static void
+copy_plane_window(cpu_backend_t *cpu_backend, uint8_t *dst, const uint8_t *src,
+                  int stride, int width, int x1, int y1, int x2, int y2)
+{
+    dst += y1 * stride + x1;
+    src += y1 * stride + x1;
+
+    if (!cpu_backend) {
+        while (y1++ < y2) {
+            memcpy(dst, src, x2 - x1);
+            dst += stride;
+            src += stride;
+        }
+        return;
+    }
+    /* full rows can be copied together with the padding at their ends */
+    if (x1 == 0 && x2 == width)
+        x2 = stride;
+    cpu_backend_writeback_rows(cpu_backend, dst, stride, src, stride,
+                               x2 - x1, y2 - y1);
+}
+
 /*****************************************************************************/
 
 static void
 xStopVideo(ScrnInfoPtr pScrn, pointer data, Bool cleanup)
 {
     SunxiVideo *self = SUNXI_VIDEO(pScrn);
+    SunxiVideoPort *port = data;
     sunxi_disp_t *disp = SUNXI_DISP(pScrn);
+    int i;
 
     if (disp && cleanup) {
-        sunxi_layer_hide(disp);
-        sunxi_layer_disable_colorkey(disp);
-        self->colorKeyEnabled = FALSE;
+        sunxi_layer_hide(disp, port->layer);
+        sunxi_layer_disable_colorkey(disp, port->layer);
+        port->colorKeyEnabled = FALSE;
+        /* the hidden layer does not read any buffer */
+        port->ring_size = 0;
+        port->cur_buffer = -1;
+
+        /* no need to count vsyncs if no other port is playing video */
+        for (i = 0; i < self->nports; i++) {
+            if (self->ports[i].ring_size)
+                break;
+        }
+        if (i == self->nports)
+            sunxi_vsync_counter_stop(disp);
     }
 
-    REGION_EMPTY(pScrn->pScreen, &self->clip);
+    REGION_EMPTY(pScrn->pScreen, &port->clip);
 }
 
 static int
@@ -82,12 +149,23 @@ xSetPortAttributeOverlay(ScrnInfoPtr pScrn,
 {
     sunxi_disp_t *disp = SUNXI_DISP(pScrn);
     SunxiVideo *self = SUNXI_VIDEO(pScrn);
+    SunxiVideoPort *port = data;
+    int i;
 
     if (attribute == xvColorKey && disp) {
-        self->colorKey = value;
-        sunxi_layer_set_colorkey(disp, self->colorKey);
-        self->colorKeyEnabled = TRUE;
-        REGION_EMPTY(pScrn->pScreen, &self->clip);
+        /*
+         * The display controller has only one color key for all layers,
+         * so it is changed for every port and their windows get repainted.
+         */
+        for (i = 0; i < self->nports; i++) {
+            SunxiVideoPort *p = &self->ports[i];
+            p->colorKey = value;
+            if (p == port || p->colorKeyEnabled) {
+                sunxi_layer_set_colorkey(disp, p->layer, p->colorKey);
+                p->colorKeyEnabled = TRUE;
+            }
+            REGION_EMPTY(pScrn->pScreen, &p->clip);
+        }
         return Success;
     }
 
@@ -101,10 +179,10 @@ xGetPortAttributeOverlay(ScrnInfoPtr pScrn,
                          INT32      *value,
                          pointer     data)
 {
-    SunxiVideo *self = SUNXI_VIDEO(pScrn);
+    SunxiVideoPort *port = data;
 
     if (attribute == xvColorKey) {
-        *value = self->colorKey;
+        *value = port->colorKey;
         return Success;
     }
 
@@ -120,6 +198,121 @@ xQueryBestSize(ScrnInfoPtr pScrn, Bool motion, short vid_w, short vid_h,
     *p_h = drw_h;
 }
 
+/* The memory layout of the supported image formats */
+typedef struct {
+    int nplanes;
+    int size;
+    int offsets[3];
+    int pitches[3];
+    int row_bytes[3]; /* the number of used bytes in each row */
+    int rows[3];
+} SunxiImageLayout;
+
+static Bool
+xGetImageLayout(int image, int width, int height, SunxiImageLayout *l)
+{
+    int uv_stride = SIMD_ALIGN(width >> 1);
+    int y_stride  = uv_stride * 2;
+    int i;
+
+    switch (image) {
+    case FOURCC_I420:
+    case FOURCC_YV12:
+        l->nplanes = 3;
+        l->pitches[0] = y_stride;
+        l->pitches[1] = l->pitches[2] = uv_stride;
+        l->row_bytes[0] = width;
+        l->row_bytes[1] = l->row_bytes[2] = width >> 1;
+        l->rows[0] = height;
+        l->rows[1] = l->rows[2] = height >> 1;
+        break;
+    case FOURCC_NV12:
+    case FOURCC_NV21:
+        l->nplanes = 2;
+        l->pitches[0] = l->pitches[1] = y_stride;
+        l->row_bytes[0] = l->row_bytes[1] = width;
+        l->rows[0] = height;
+        l->rows[1] = height >> 1;
+        break;
+    case FOURCC_YUY2:
+    case FOURCC_UYVY:
+        l->nplanes = 1;
+        l->pitches[0] = SIMD_ALIGN(width * 2);
+        l->row_bytes[0] = width * 2;
+        l->rows[0] = height;
+        break;
+    default:
+        return FALSE;
+    }
+
+    /* the planes follow each other */
+    l->size = 0;
+    for (i = 0; i < l->nplanes; i++) {
+        l->offsets[i] = l->size;
+        l->size += l->pitches[i] * l->rows[i];
+    }
+    return TRUE;
+}
+
+/*
+ * The overlay buffers form a ring in the part of the offscreen memory
+ * reserved for the port. A buffer can be reused only after the display
+ * controller has switched to a newer one, which is tracked with the vsync
+ * counter. Returns the number of buffers in the ring (0 if even one buffer
+ * does not fit).
+ */
+static int
+xOverlayRingSetup(SunxiVideo *self, SunxiVideoPort *port, sunxi_disp_t *disp,
+                  int yuv_size)
+{
+    uint32_t count = 0;
+    int i, n = port->mem_size / yuv_size;
+
+    if (n > self->nbuffers)
+        n = self->nbuffers;
+    if (n < 1)
+        return 0;
+
+    if (n != port->ring_size || yuv_size != port->ring_yuv_size) {
+        /* the displayed old buffer may overlap any of the new ones */
+        sunxi_get_vsync_count(disp, &count);
+        for (i = 0; i < n; i++)
+            port->free_after[i] = port->cur_buffer < 0 ? count : count + 2;
+        port->ring_size = n;
+        port->ring_yuv_size = yuv_size;
+        port->cur_buffer = -1;
+    }
+    return n;
+}
+
+static Bool
+xOverlayBufferIsFree(SunxiVideoPort *port, sunxi_disp_t *disp, int i)
+{
+    uint32_t count;
+
+    /* a single buffer is always reused, just like without vsync support */
+    if (port->ring_size == 1 || !sunxi_get_vsync_count(disp, &count))
+        return TRUE;
+    return (int32_t)(count - port->free_after[i]) >= 0;
+}
+
+/* Mark the buffer 'i' as shown on the layer instead of the current one */
+static void
+xOverlayRingFlip(SunxiVideoPort *port, sunxi_disp_t *disp, int i)
+{
+    uint32_t count = 0;
+
+    /*
+     * The new buffer address is latched at the next vsync, but the counter
+     * may be lagging behind by one if that vsync is happening just now.
+     */
+    if (port->cur_buffer >= 0) {
+        sunxi_get_vsync_count(disp, &count);
+        port->free_after[port->cur_buffer] = count + 2;
+    }
+    port->cur_buffer = i;
+}
+
 static int
 xPutImage(ScrnInfoPtr pScrn, short src_x, short src_y, short drw_x, short drw_y,
           short src_w, short src_h, short drw_w, short drw_h, int image,
@@ -128,9 +321,11 @@ xPutImage(ScrnInfoPtr pScrn, short src_x, short src_y, short drw_x, short drw_y,
 {
     sunxi_disp_t *disp = SUNXI_DISP(pScrn);
     SunxiVideo *self = SUNXI_VIDEO(pScrn);
+    SunxiVideoPort *port = data;
+    cpu_backend_t *cpu_backend = FBDEVPTR(pScrn)->cpu_backend_private;
     INT32 x1, x2, y1, y2;
-    int y_offset, u_offset, v_offset;
-    int y_stride, uv_stride, yuv_size;
+    int cx1, cx2, cy1, cy2;
+    SunxiImageLayout l;
     BoxRec dstBox;
 
     /* Clip */
@@ -152,57 +347,110 @@ xPutImage(ScrnInfoPtr pScrn, short src_x, short src_y, short drw_x, short drw_y,
     dstBox.y1 -= pScrn->frameY0;
     dstBox.y2 -= pScrn->frameY0;
 
-    uv_stride = SIMD_ALIGN(width >> 1);
-    y_stride  = uv_stride * 2;
-    yuv_size  = y_stride * height + uv_stride * height;
-
-    y_offset = 0;
-    if (image == FOURCC_I420) {
-        u_offset = y_stride * height;
-        v_offset = (uv_stride * (height >> 1)) + u_offset;
-    }
-    else if (image == FOURCC_YV12) {
-        v_offset = y_stride * height;
-        u_offset = (uv_stride * (height >> 1)) + v_offset;
-    }
-    else {
+    if (!xGetImageLayout(image, width, height, &l))
         return BadImplementation;
-    }
 
     if (disp) {
-        /* Try to fixup overlay offset */
-        if (self->overlay_data_offs < disp->gfx_layer_size ||
-            self->overlay_data_offs + yuv_size > disp->framebuffer_size) {
-            self->overlay_data_offs = disp->gfx_layer_size;
-        }
-        /* If it is still wrong (not enough offscreen memory), then fail */
-        if (self->overlay_data_offs + yuv_size > disp->framebuffer_size)
+        uint8_t *fb;
+        int i, next, offs;
+
+        /* If there is not enough offscreen memory, then fail */
+        if (!xOverlayRingSetup(self, port, disp, l.size))
             return BadImplementation;
 
-        y_offset += self->overlay_data_offs;
-        u_offset += self->overlay_data_offs;
-        v_offset += self->overlay_data_offs;
+        if (self->vsync_supported)
+            sunxi_vsync_counter_start(disp);
+
+        /*
+         * Drop the frame if the display controller may still be reading
+         * all the other buffers (the frames come faster than vsyncs).
+         */
+        next = (port->cur_buffer + 1) % port->ring_size;
+        if (!xOverlayBufferIsFree(port, disp, next)) {
+            sunxi_layer_set_output_window(disp, port->layer,
+                                          drw_x, drw_y, drw_w, drw_h);
+            goto update_colorkey;
+        }
 
-        memcpy(disp->framebuffer_addr + self->overlay_data_offs, buf, yuv_size);
+        offs = port->mem_offset + next * l.size;
+        fb = disp->framebuffer_addr + offs;
+
+        /*
+         * Only the visible part of the source (with a small margin) needs
+         * to be uploaded, the layer never shows the rest of it. The window
+         * is expanded to even coordinates to cover the chroma samples.
+         */
+        cx1 = ((x1 >> 16) - CLIP_MARGIN) & ~1;
+        cy1 = ((y1 >> 16) - CLIP_MARGIN) & ~1;
+        cx2 = (((x2 + 0xFFFF) >> 16) + CLIP_MARGIN + 1) & ~1;
+        cy2 = (((y2 + 0xFFFF) >> 16) + CLIP_MARGIN + 1) & ~1;
+        if (cx1 < 0)
+            cx1 = 0;
+        if (cy1 < 0)
+            cy1 = 0;
+        if (cx2 > width)
+            cx2 = width;
+        if (cy2 > height)
+            cy2 = height;
+
+        /* the window is even, so it maps to whole bytes and rows */
+        for (i = 0; i < l.nplanes; i++) {
+            copy_plane_window(cpu_backend, fb + l.offsets[i],
+                              buf + l.offsets[i], l.pitches[i], l.row_bytes[i],
+                              cx1 * l.row_bytes[i] / width,
+                              cy1 * l.rows[i] / height,
+                              cx2 * l.row_bytes[i] / width,
+                              cy2 * l.rows[i] / height);
+        }
+        port->image_w = width;
+        port->image_h = height;
+        port->upload_x1 = cx1;
+        port->upload_y1 = cy1;
+        port->upload_x2 = cx2;
+        port->upload_y2 = cy2;
 
         /* Enable colorkey if it has not been already enabled */
-        if (!self->colorKeyEnabled) {
-            sunxi_layer_set_colorkey(disp, self->colorKey);
-            self->colorKeyEnabled = TRUE;
+        if (!port->colorKeyEnabled) {
+            sunxi_layer_set_colorkey(disp, port->layer, port->colorKey);
+            port->colorKeyEnabled = TRUE;
+        }
+        switch (image) {
+        case FOURCC_I420:
+            sunxi_layer_set_yuv420_input_buffer(disp, port->layer,
+                        offs + l.offsets[0], offs + l.offsets[1], offs + l.offsets[2],
+                        src_w, src_h, l.pitches[0], src_x, src_y);
+            break;
+        case FOURCC_YV12:
+            sunxi_layer_set_yuv420_input_buffer(disp, port->layer,
+                        offs + l.offsets[0], offs + l.offsets[2], offs + l.offsets[1],
+                        src_w, src_h, l.pitches[0], src_x, src_y);
+            break;
+        case FOURCC_NV12:
+        case FOURCC_NV21:
+            sunxi_layer_set_yuv420_uv_combined_input_buffer(disp, port->layer,
+                        offs + l.offsets[0], offs + l.offsets[1],
+                        src_w, src_h, l.pitches[0], src_x, src_y,
+                        image == FOURCC_NV21);
+            break;
+        case FOURCC_YUY2:
+        case FOURCC_UYVY:
+            sunxi_layer_set_yuv422_interleaved_input_buffer(disp, port->layer,
+                        offs + l.offsets[0], src_w, src_h, l.pitches[0] / 2,
+                        src_x, src_y, image == FOURCC_UYVY);
+            break;
         }
-        sunxi_layer_set_yuv420_input_buffer(disp, y_offset, u_offset, v_offset,
-                                            src_w, src_h, y_stride, src_x, src_y);
-        sunxi_layer_set_output_window(disp, drw_x, drw_y, drw_w, drw_h);
-        sunxi_layer_show(disp);
+        sunxi_layer_set_output_window(disp, port->layer,
+                                      drw_x, drw_y, drw_w, drw_h);
+        sunxi_layer_show(disp, port->layer);
 
-        /* Cycle through different overlay offsets (to prevent tearing) */
-        self->overlay_data_offs += yuv_size;
+        xOverlayRingFlip(port, disp, next);
     }
 
+update_colorkey:
     /* Update the areas filled with the color key */
-    if (!REGION_EQUAL(pScrn->pScreen, &self->clip, clipBoxes)) {
-        REGION_COPY(pScrn->pScreen, &self->clip, clipBoxes);
-        xf86XVFillKeyHelperDrawable(pDraw, convert_color(pScrn, self->colorKey), clipBoxes);
+    if (!REGION_EQUAL(pScrn->pScreen, &port->clip, clipBoxes)) {
+        REGION_COPY(pScrn->pScreen, &port->clip, clipBoxes);
+        xf86XVFillKeyHelperDrawable(pDraw, convert_color(pScrn, port->colorKey), clipBoxes);
     }
 
     return Success;
@@ -214,7 +462,36 @@ xReputImage(ScrnInfoPtr pScrn, short src_x, short src_y, short drw_x, short drw_
           RegionPtr clipBoxes, pointer data, DrawablePtr pDraw)
 {
     sunxi_disp_t *disp = SUNXI_DISP(pScrn);
-    sunxi_layer_set_output_window(disp, drw_x, drw_y, drw_w, drw_h);
+    SunxiVideoPort *port = data;
+    INT32 x1, x2, y1, y2;
+    BoxRec dstBox;
+
+    x1 = src_x;
+    x2 = src_x + src_w;
+    y1 = src_y;
+    y2 = src_y + src_h;
+
+    dstBox.x1 = drw_x;
+    dstBox.x2 = drw_x + drw_w;
+    dstBox.y1 = drw_y;
+    dstBox.y2 = drw_y + drw_h;
+
+    /*
+     * Only the visible part of the last image has been uploaded. If more
+     * of it becomes visible, then the layer would show stale data there,
+     * so it is hidden until the next PutImage.
+     */
+    if (port->cur_buffer >= 0 &&
+        xf86XVClipVideoHelper(&dstBox, &x1, &x2, &y1, &y2, clipBoxes,
+                              port->image_w, port->image_h) &&
+        ((x1 >> 16) < port->upload_x1 || (y1 >> 16) < port->upload_y1 ||
+         ((x2 + 0xFFFF) >> 16) > port->upload_x2 ||
+         ((y2 + 0xFFFF) >> 16) > port->upload_y2)) {
+        sunxi_layer_hide(disp, port->layer);
+        return BadImplementation;
+    }
+
+    sunxi_layer_set_output_window(disp, port->layer, drw_x, drw_y, drw_w, drw_h);
     return Success;
 }
 
@@ -223,29 +500,23 @@ xQueryImageAttributes(ScrnInfoPtr pScrn, int image,
                       unsigned short *w, unsigned short *h,
                       int *pitches, int *offsets)
 {
-    int height, width;
-    int y_stride, uv_stride, yuv_size;
-
-    width = *w = (*w + 1) & ~1;
-    height = *h = (*h + 1) & ~1;
+    SunxiImageLayout l;
+    int i;
 
-    uv_stride = SIMD_ALIGN(width >> 1);
-    y_stride  = uv_stride * 2;
-    yuv_size  = y_stride * height + uv_stride * height;
+    *w = (*w + 1) & ~1;
+    *h = (*h + 1) & ~1;
 
-    if (pitches) {
-        pitches[0] = y_stride;
-        pitches[1] = uv_stride;
-        pitches[2] = uv_stride;
-    }
+    if (!xGetImageLayout(image, *w, *h, &l))
+        return 0;
 
-    if (offsets) {
-        offsets[0] = 0;
-        offsets[1] = y_stride * height;
-        offsets[2] = (uv_stride * (height >> 1)) + offsets[1];
+    for (i = 0; i < l.nplanes; i++) {
+        if (pitches)
+            pitches[i] = l.pitches[i];
+        if (offsets)
+            offsets[i] = l.offsets[i];
     }
 
-    return yuv_size;
+    return l.size;
 }
 
 /*****************************************************************************/
@@ -262,7 +533,11 @@ static XF86VideoFormatRec Formats[] = {
 static XF86ImageRec Images[] =
 {
     XVIMAGE_YV12,
-    XVIMAGE_I420
+    XVIMAGE_I420,
+    XVIMAGE_NV12,
+    XVIMAGE_NV21,
+    XVIMAGE_YUY2,
+    XVIMAGE_UYVY
 };
 
 static XF86AttributeRec Attributes[] =
@@ -270,14 +545,21 @@ static XF86AttributeRec Attributes[] =
    {XvSettable | XvGettable, 0, (1 << 24) - 1, "XV_COLORKEY"},
 };
 
-SunxiVideo *SunxiVideo_Init(ScreenPtr pScreen)
+SunxiVideo *SunxiVideo_Init(ScreenPtr pScreen, int nbuffers)
 {
     ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
     sunxi_disp_t *disp = SUNXI_DISP(pScrn);
     SunxiVideo *self;
     XF86VideoAdaptorPtr adapt;
+    uint32_t mem_size;
+    int i, nports = 0;
+
+    for (i = 0; disp && i < disp->nlayers; i++) {
+        if (disp->layers[i].has_scaler)
+            nports++;
+    }
 
-    if (!disp || !disp->layer_has_scaler) {
+    if (nports == 0) {
         xf86DrvMsg(pScreen->myNum, X_INFO,
                    "SunxiVideo_Init: no scalable layer available for XV\n");
         return NULL;
@@ -302,7 +584,7 @@ SunxiVideo *SunxiVideo_Init(ScreenPtr pScreen)
     adapt->pEncodings = &DummyEncoding[0];
     adapt->nFormats = ARRAY_SIZE(Formats);
     adapt->pFormats = Formats;
-    adapt->nPorts = 1;
+    adapt->nPorts = nports;
     adapt->pPortPrivates = (DevUnion *) &self->port_privates[0];
     adapt->pAttributes = Attributes;
     adapt->nImages = ARRAY_SIZE(Images);
@@ -321,11 +603,42 @@ SunxiVideo *SunxiVideo_Init(ScreenPtr pScreen)
     adapt->ReputImage = xReputImage;
     adapt->QueryImageAttributes = xQueryImageAttributes;
 
+    /*
+     * One port per scaled layer. The layers are taken starting from the
+     * last one, because the first layer is also used by DRI2. The offscreen
+     * memory is split equally between the ports.
+     */
+    mem_size = (disp->pixmap_heap_offset - disp->gfx_layer_size) / nports;
+    mem_size &= ~4095;
+    for (i = disp->nlayers - 1; i >= 0; i--) {
+        SunxiVideoPort *port;
+        if (!disp->layers[i].has_scaler)
+            continue;
+        port = &self->ports[self->nports];
+        port->layer = i;
+        port->mem_offset = disp->gfx_layer_size + self->nports * mem_size;
+        port->mem_size = mem_size;
+        port->cur_buffer = -1;
+        port->colorKey = 0x081018;
+        REGION_NULL(pScreen, &port->clip);
+        self->port_privates[self->nports++] = port;
+    }
+
     xf86XVScreenInit(pScreen, &self->adapt[0], 1);
 
+    self->nbuffers = nbuffers;
+    if (self->nbuffers < 1)
+        self->nbuffers = 1;
+    if (self->nbuffers > SUNXI_VIDEO_MAX_BUFFERS)
+        self->nbuffers = SUNXI_VIDEO_MAX_BUFFERS;
+    /* the vsync counter is only started when some video is playing */
+    self->vsync_supported = self->nbuffers > 1 &&
+                            sunxi_wait_for_vsync(disp) >= 0;
+    if (self->nbuffers > 1 && !self->vsync_supported)
+        xf86DrvMsg(pScreen->myNum, X_INFO,
+                   "SunxiVideo_Init: no vsync support, XV may have tearing\n");
+
     xvColorKey = MAKE_ATOM("XV_COLORKEY");
-    self->colorKey = 0x081018;
-    REGION_NULL(pScreen, &self->clip);
 
     return self;
 }
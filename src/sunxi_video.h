@@ -25,20 +25,45 @@
 #define SUNXI_VIDEO_H
 
 #include "xf86xv.h"
+#include "sunxi_disp.h"
 
 #define XV_IMAGE_MAX_WIDTH  2048
 #define XV_IMAGE_MAX_HEIGHT 2048
 
+#define SUNXI_VIDEO_MAX_BUFFERS 8
+#define SUNXI_VIDEO_MAX_PORTS   SUNXI_DISP_MAX_LAYERS
+
+/* The state of one XV port, which shows the video on its own disp layer */
 typedef struct {
     RegionRec           clip;
     uint32_t            colorKey;
     Bool                colorKeyEnabled;
-    int                 overlay_data_offs;
+    /* The index of the layer in the sunxi_disp_t pool */
+    int                 layer;
+    /* The part of the offscreen memory used for the ring of buffers */
+    uint32_t            mem_offset;
+    uint32_t            mem_size;
+    /* The ring of overlay buffers (the number is set by XVBuffers option) */
+    int                 ring_size;
+    int                 ring_yuv_size;
+    int                 cur_buffer;
+    /* The vsync count, starting from which the buffer is not displayed */
+    uint32_t            free_after[SUNXI_VIDEO_MAX_BUFFERS];
+    /* The size of the shown image and its uploaded (visible) part */
+    int                 image_w, image_h;
+    int                 upload_x1, upload_y1, upload_x2, upload_y2;
+} SunxiVideoPort;
+
+typedef struct {
+    int                 nbuffers;
+    Bool                vsync_supported;
+    int                 nports;
+    SunxiVideoPort      ports[SUNXI_VIDEO_MAX_PORTS];
     XF86VideoAdaptorPtr adapt[1];
-    void               *port_privates[1];
+    void               *port_privates[SUNXI_VIDEO_MAX_PORTS];
 } SunxiVideo;
 
-SunxiVideo *SunxiVideo_Init(ScreenPtr pScreen);
+SunxiVideo *SunxiVideo_Init(ScreenPtr pScreen, int nbuffers);
 void SunxiVideo_Close(ScreenPtr pScreen);
 
 #endif
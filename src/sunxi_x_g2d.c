@@ -34,9 +34,48 @@
 #include "damage.h"
 #include "fb.h"
 #include "gcstruct.h"
+#ifdef RENDER
+#include "mipict.h"
+#endif
 
 #include "fbdev_priv.h"
+#include "cpu_backend.h"
 #include "sunxi_x_g2d.h"
+#include "sunxi_pixmap_heap.h"
+
+/*
+ * Wait for the completion of the asynchronously submitted blits (if any)
+ * before the framebuffer can be accessed by the CPU.
+ */
+static void
+xSync(ScreenPtr pScreen)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiG2D *private = SUNXI_G2D(pScrn);
+
+    if (private->blt2d_sync)
+        private->blt2d_sync(private->blt2d_self);
+}
+
+/*
+ * Copy as many leading boxes as possible with a single call, if the backend
+ * supports it. Returns the number of boxes which have been copied. BoxRec
+ * has the same layout as blt2d_box_t.
+ */
+static int
+xCopyBoxes(SunxiG2D *private, FbBits *src, FbBits *dst,
+           FbStride srcStride, FbStride dstStride, int srcBpp, int dstBpp,
+           int srcX, int srcY, int dstX, int dstY, BoxPtr pbox, int nbox)
+{
+    if (!private->blt2d_overlapped_blt_boxes)
+        return 0;
+    return private->blt2d_overlapped_blt_boxes(private->blt2d_self,
+                                               (uint32_t *)src, (uint32_t *)dst,
+                                               srcStride, dstStride,
+                                               srcBpp, dstBpp,
+                                               srcX, srcY, dstX, dstY,
+                                               (blt2d_box_t *)pbox, nbox);
+}
 
 /*
  * The code below is borrowed from "xserver/fb/fbwindow.c"
@@ -67,7 +106,15 @@ xCopyWindowProc(DrawablePtr pSrcDrawable,
     fbGetDrawable(pSrcDrawable, src, srcStride, srcBpp, srcXoff, srcYoff);
     fbGetDrawable(pDstDrawable, dst, dstStride, dstBpp, dstXoff, dstYoff);
 
-    while (nbox--) {
+    while (nbox > 0) {
+        int done = xCopyBoxes(private, src, dst, srcStride, dstStride,
+                              srcBpp, dstBpp, dx + srcXoff, dy + srcYoff,
+                              dstXoff, dstYoff, pbox, nbox);
+        pbox += done;
+        nbox -= done;
+        if (nbox == 0)
+            break;
+        nbox--;
         if (!private->blt2d_overlapped_blt(private->blt2d_self,
                                            (uint32_t *)src, (uint32_t *)dst,
                                            srcStride, dstStride,
@@ -151,8 +198,21 @@ xCopyNtoN(DrawablePtr pSrcDrawable,
     fbGetDrawable(pSrcDrawable, src, srcStride, srcBpp, srcXoff, srcYoff);
     fbGetDrawable(pDstDrawable, dst, dstStride, dstBpp, dstXoff, dstYoff);
 
-    while (nbox--) {
-        /* first try G2D */
+    SunxiPixmapHeap_Touch(pScreen, pSrcDrawable);
+    SunxiPixmapHeap_Touch(pScreen, pDstDrawable);
+
+    while (nbox > 0) {
+        /* first try G2D (or the other backend) for many boxes at once */
+        int nboxes_done = xCopyBoxes(private, src, dst, srcStride, dstStride,
+                                     srcBpp, dstBpp, dx + srcXoff, dy + srcYoff,
+                                     dstXoff, dstYoff, pbox, nbox);
+        pbox += nboxes_done;
+        nbox -= nboxes_done;
+        if (nbox == 0)
+            break;
+        nbox--;
+
+        /* then G2D for the single box */
         Bool done = private->blt2d_overlapped_blt(
                              private->blt2d_self,
                              (uint32_t *)src, (uint32_t *)dst,
@@ -205,6 +265,7 @@ xCopyArea(DrawablePtr pSrcDrawable,
         return miDoCopy(pSrcDrawable, pDstDrawable, pGC, xIn, yIn,
                     widthSrc, heightSrc, xOut, yOut, xCopyNtoN, 0, 0);
     }
+    xSync(pDstDrawable->pScreen);
     return fbCopyArea(pSrcDrawable,
                       pDstDrawable,
                       pGC,
@@ -233,6 +294,8 @@ static void xPutImage(DrawablePtr pDrawable,
     BoxPtr pbox;
     int x1, y1, x2, y2;
 
+    xSync(pDrawable->pScreen);
+
     if (format == XYBitmap || format == XYPixmap ||
     pDrawable->bitsPerPixel != BitsPerPixel(pDrawable->depth)) {
         fbPutImage(pDrawable, pGC, depth, x, y, w, h, leftPad, format, pImage);
@@ -300,6 +363,298 @@ static void xPutImage(DrawablePtr pDrawable,
     fbFinishAccess(pDrawable);
 }
 
+/*
+ * Solid fills. Large rectangles go to G2D (or the other backend), the rest
+ * is done by pixman_fill, which has NEON and SSE2 implementations. These
+ * only write to the framebuffer and are fine for the uncached memory.
+ */
+
+static Bool
+xCanFillSolid(DrawablePtr pDrawable, GCPtr pGC)
+{
+    return pGC->fillStyle == FillSolid && pGC->alu == GXcopy &&
+           fbGetGCPrivate(pGC)->pm == FB_ALLONES &&
+           (pDrawable->bitsPerPixel == 16 || pDrawable->bitsPerPixel == 32);
+}
+
+static void
+xFillBox(ScreenPtr pScreen, FbBits *dst, FbStride dstStride, int dstBpp,
+         int x, int y, int w, int h, FbBits color)
+{
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiG2D *private = SUNXI_G2D(pScrn);
+
+    if (private->blt2d_fill &&
+        private->blt2d_fill(private->blt2d_self, (uint32_t *)dst, dstStride,
+                            dstBpp, x, y, w, h, color))
+        return;
+
+    xSync(pScreen);
+    if (!pixman_fill((uint32_t *)dst, dstStride, dstBpp, x, y, w, h, color))
+        fbSolid(dst + y * dstStride, dstStride, x * dstBpp, dstBpp,
+                w * dstBpp, h, 0, color);
+}
+
+/*
+ * The code below is adapted from "xserver/fb/fbfillrect.c"
+ */
+
+static void
+xPolyFillRect(DrawablePtr pDrawable, GCPtr pGC, int nrect, xRectangle *prect)
+{
+    ScreenPtr pScreen = pDrawable->pScreen;
+    RegionPtr pClip = fbGetCompositeClip(pGC);
+    FbBits color = fbGetGCPrivate(pGC)->xor;
+    FbBits *dst;
+    FbStride dstStride;
+    int dstBpp;
+    int dstXoff, dstYoff;
+    int xorg = pDrawable->x;
+    int yorg = pDrawable->y;
+
+    if (!xCanFillSolid(pDrawable, pGC)) {
+        xSync(pScreen);
+        fbPolyFillRect(pDrawable, pGC, nrect, prect);
+        return;
+    }
+
+    fbGetDrawable(pDrawable, dst, dstStride, dstBpp, dstXoff, dstYoff);
+    SunxiPixmapHeap_Touch(pScreen, pDrawable);
+
+    for (; nrect--; prect++) {
+        int fullX1 = prect->x + xorg;
+        int fullY1 = prect->y + yorg;
+        int fullX2 = fullX1 + (int)prect->width;
+        int fullY2 = fullY1 + (int)prect->height;
+        BoxPtr pbox = RegionRects(pClip);
+        int nbox = RegionNumRects(pClip);
+
+        for (; nbox--; pbox++) {
+            int x1 = max(fullX1, pbox->x1);
+            int y1 = max(fullY1, pbox->y1);
+            int x2 = min(fullX2, pbox->x2);
+            int y2 = min(fullY2, pbox->y2);
+            if (x1 >= x2 || y1 >= y2)
+                continue;
+            xFillBox(pScreen, dst, dstStride, dstBpp, x1 + dstXoff,
+                     y1 + dstYoff, x2 - x1, y2 - y1, color);
+        }
+    }
+
+    fbFinishAccess(pDrawable);
+}
+
+/*
+ * The code below is adapted from "xserver/fb/fbfill.c". The consecutive
+ * spans with the same horizontal position (such as the ones produced for
+ * the filled rectangles and polygons) are merged into rectangles, which
+ * may be big enough for G2D.
+ */
+
+static void
+xFillSpans(DrawablePtr pDrawable, GCPtr pGC, int n, DDXPointPtr ppt,
+           int *pwidth, int fSorted)
+{
+    ScreenPtr pScreen = pDrawable->pScreen;
+    RegionPtr pClip = fbGetCompositeClip(pGC);
+    FbBits color = fbGetGCPrivate(pGC)->xor;
+    FbBits *dst;
+    FbStride dstStride;
+    int dstBpp;
+    int dstXoff, dstYoff;
+    BoxRec pending = { 0, 0, 0, 0 };
+
+    if (!xCanFillSolid(pDrawable, pGC)) {
+        xSync(pScreen);
+        fbFillSpans(pDrawable, pGC, n, ppt, pwidth, fSorted);
+        return;
+    }
+
+    fbGetDrawable(pDrawable, dst, dstStride, dstBpp, dstXoff, dstYoff);
+    SunxiPixmapHeap_Touch(pScreen, pDrawable);
+
+    for (; n--; ppt++, pwidth++) {
+        int fullX1 = ppt->x;
+        int fullX2 = fullX1 + *pwidth;
+        int y = ppt->y;
+        BoxPtr pbox = RegionRects(pClip);
+        int nbox = RegionNumRects(pClip);
+
+        for (; nbox--; pbox++) {
+            int x1, x2;
+            if (y < pbox->y1 || y >= pbox->y2)
+                continue;
+            x1 = max(fullX1, pbox->x1);
+            x2 = min(fullX2, pbox->x2);
+            if (x1 >= x2)
+                continue;
+            if (x1 == pending.x1 && x2 == pending.x2 && y == pending.y2) {
+                pending.y2++;
+                continue;
+            }
+            if (pending.y1 < pending.y2)
+                xFillBox(pScreen, dst, dstStride, dstBpp,
+                         pending.x1 + dstXoff, pending.y1 + dstYoff,
+                         pending.x2 - pending.x1, pending.y2 - pending.y1,
+                         color);
+            pending.x1 = x1;
+            pending.x2 = x2;
+            pending.y1 = y;
+            pending.y2 = y + 1;
+        }
+    }
+    if (pending.y1 < pending.y2)
+        xFillBox(pScreen, dst, dstStride, dstBpp,
+                 pending.x1 + dstXoff, pending.y1 + dstYoff,
+                 pending.x2 - pending.x1, pending.y2 - pending.y1, color);
+
+    fbFinishAccess(pDrawable);
+}
+
+/*
+ * The wrappers for the rest of GC ops, which are only installed when the
+ * blits are done asynchronously. All of them may access the framebuffer.
+ */
+
+#define FB_GC_OPS(pScreen) (SUNXI_G2D(xf86Screens[(pScreen)->myNum])->pFbGCOps)
+
+static void
+xSyncSetSpans(DrawablePtr pDrawable, GCPtr pGC, char *psrc, DDXPointPtr ppt,
+              int *pwidth, int nspans, int fSorted)
+{
+    xSync(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable->pScreen)->SetSpans(pDrawable, pGC, psrc, ppt,
+                                            pwidth, nspans, fSorted);
+}
+
+static RegionPtr
+xSyncCopyPlane(DrawablePtr pSrcDrawable, DrawablePtr pDstDrawable, GCPtr pGC,
+               int srcx, int srcy, int w, int h, int dstx, int dsty,
+               unsigned long bitPlane)
+{
+    xSync(pDstDrawable->pScreen);
+    return FB_GC_OPS(pDstDrawable->pScreen)->CopyPlane(pSrcDrawable,
+                                pDstDrawable, pGC, srcx, srcy, w, h,
+                                dstx, dsty, bitPlane);
+}
+
+static void
+xSyncPolyPoint(DrawablePtr pDrawable, GCPtr pGC, int mode, int npt,
+               DDXPointPtr ppt)
+{
+    xSync(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable->pScreen)->PolyPoint(pDrawable, pGC, mode, npt, ppt);
+}
+
+static void
+xSyncPolylines(DrawablePtr pDrawable, GCPtr pGC, int mode, int npt,
+               DDXPointPtr ppt)
+{
+    xSync(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable->pScreen)->Polylines(pDrawable, pGC, mode, npt, ppt);
+}
+
+static void
+xSyncPolySegment(DrawablePtr pDrawable, GCPtr pGC, int nseg, xSegment *pseg)
+{
+    xSync(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable->pScreen)->PolySegment(pDrawable, pGC, nseg, pseg);
+}
+
+static void
+xSyncPolyRectangle(DrawablePtr pDrawable, GCPtr pGC, int nrects,
+                   xRectangle *prect)
+{
+    xSync(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable->pScreen)->PolyRectangle(pDrawable, pGC, nrects, prect);
+}
+
+static void
+xSyncPolyArc(DrawablePtr pDrawable, GCPtr pGC, int narcs, xArc *parcs)
+{
+    xSync(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable->pScreen)->PolyArc(pDrawable, pGC, narcs, parcs);
+}
+
+static void
+xSyncFillPolygon(DrawablePtr pDrawable, GCPtr pGC, int shape, int mode,
+                 int count, DDXPointPtr ppt)
+{
+    xSync(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable->pScreen)->FillPolygon(pDrawable, pGC, shape, mode,
+                                               count, ppt);
+}
+
+static void
+xSyncPolyFillArc(DrawablePtr pDrawable, GCPtr pGC, int narcs, xArc *parcs)
+{
+    xSync(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable->pScreen)->PolyFillArc(pDrawable, pGC, narcs, parcs);
+}
+
+static int
+xSyncPolyText8(DrawablePtr pDrawable, GCPtr pGC, int x, int y, int count,
+               char *chars)
+{
+    xSync(pDrawable->pScreen);
+    return FB_GC_OPS(pDrawable->pScreen)->PolyText8(pDrawable, pGC, x, y,
+                                                    count, chars);
+}
+
+static int
+xSyncPolyText16(DrawablePtr pDrawable, GCPtr pGC, int x, int y, int count,
+                unsigned short *chars)
+{
+    xSync(pDrawable->pScreen);
+    return FB_GC_OPS(pDrawable->pScreen)->PolyText16(pDrawable, pGC, x, y,
+                                                     count, chars);
+}
+
+static void
+xSyncImageText8(DrawablePtr pDrawable, GCPtr pGC, int x, int y, int count,
+                char *chars)
+{
+    xSync(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable->pScreen)->ImageText8(pDrawable, pGC, x, y,
+                                              count, chars);
+}
+
+static void
+xSyncImageText16(DrawablePtr pDrawable, GCPtr pGC, int x, int y, int count,
+                 unsigned short *chars)
+{
+    xSync(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable->pScreen)->ImageText16(pDrawable, pGC, x, y,
+                                               count, chars);
+}
+
+static void
+xSyncImageGlyphBlt(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
+                   unsigned int nglyph, CharInfoPtr *ppci, void *pglyphBase)
+{
+    xSync(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable->pScreen)->ImageGlyphBlt(pDrawable, pGC, x, y,
+                                                 nglyph, ppci, pglyphBase);
+}
+
+static void
+xSyncPolyGlyphBlt(DrawablePtr pDrawable, GCPtr pGC, int x, int y,
+                  unsigned int nglyph, CharInfoPtr *ppci, void *pglyphBase)
+{
+    xSync(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable->pScreen)->PolyGlyphBlt(pDrawable, pGC, x, y,
+                                                nglyph, ppci, pglyphBase);
+}
+
+static void
+xSyncPushPixels(GCPtr pGC, PixmapPtr pBitMap, DrawablePtr pDrawable,
+                int w, int h, int x, int y)
+{
+    xSync(pDrawable->pScreen);
+    FB_GC_OPS(pDrawable->pScreen)->PushPixels(pGC, pBitMap, pDrawable,
+                                              w, h, x, y);
+}
+
 static Bool
 xCreateGC(GCPtr pGC)
 {
@@ -319,6 +674,35 @@ xCreateGC(GCPtr pGC)
         self->pGCOps->CopyArea = xCopyArea;
         /* Add our own hook for PutImage */
         self->pGCOps->PutImage = xPutImage;
+
+        if (self->blt2d_sync) {
+            self->pFbGCOps = calloc(1, sizeof(GCOps));
+            memcpy(self->pFbGCOps, pGC->ops, sizeof(GCOps));
+
+            self->pGCOps->SetSpans      = xSyncSetSpans;
+            self->pGCOps->CopyPlane     = xSyncCopyPlane;
+            self->pGCOps->PolyPoint     = xSyncPolyPoint;
+            self->pGCOps->Polylines     = xSyncPolylines;
+            self->pGCOps->PolySegment   = xSyncPolySegment;
+            self->pGCOps->PolyRectangle = xSyncPolyRectangle;
+            self->pGCOps->PolyArc       = xSyncPolyArc;
+            self->pGCOps->FillPolygon   = xSyncFillPolygon;
+            self->pGCOps->PolyFillArc   = xSyncPolyFillArc;
+            self->pGCOps->PolyText8     = xSyncPolyText8;
+            self->pGCOps->PolyText16    = xSyncPolyText16;
+            self->pGCOps->ImageText8    = xSyncImageText8;
+            self->pGCOps->ImageText16   = xSyncImageText16;
+            self->pGCOps->ImageGlyphBlt = xSyncImageGlyphBlt;
+            self->pGCOps->PolyGlyphBlt  = xSyncPolyGlyphBlt;
+            self->pGCOps->PushPixels    = xSyncPushPixels;
+        }
+
+        /*
+         * Add our own hooks for solid fills (these also take care of
+         * painting the window backgrounds, which is done via PolyFillRect)
+         */
+        self->pGCOps->FillSpans    = xFillSpans;
+        self->pGCOps->PolyFillRect = xPolyFillRect;
     }
     pGC->ops = self->pGCOps;
 
@@ -327,6 +711,579 @@ xCreateGC(GCPtr pGC)
 
 /*****************************************************************************/
 
+/* Reading the framebuffer also needs the asynchronous blits to be complete */
+
+static void
+xGetImage(DrawablePtr pDrawable, int x, int y, int w, int h,
+          unsigned int format, unsigned long planeMask, char *d)
+{
+    ScreenPtr pScreen = pDrawable->pScreen;
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiG2D *private = SUNXI_G2D(pScrn);
+
+    xSync(pScreen);
+    pScreen->GetImage = private->GetImage;
+    (*pScreen->GetImage) (pDrawable, x, y, w, h, format, planeMask, d);
+    private->GetImage = pScreen->GetImage;
+    pScreen->GetImage = xGetImage;
+}
+
+static void
+xGetSpans(DrawablePtr pDrawable, int wMax, DDXPointPtr ppt, int *pwidth,
+          int nspans, char *pdstStart)
+{
+    ScreenPtr pScreen = pDrawable->pScreen;
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiG2D *private = SUNXI_G2D(pScrn);
+
+    xSync(pScreen);
+    pScreen->GetSpans = private->GetSpans;
+    (*pScreen->GetSpans) (pDrawable, wMax, ppt, pwidth, nspans, pdstStart);
+    private->GetSpans = pScreen->GetSpans;
+    pScreen->GetSpans = xGetSpans;
+}
+
+/*****************************************************************************/
+
+#ifdef RENDER
+
+static void
+xComposite(CARD8 op, PicturePtr pSrc, PicturePtr pMask, PicturePtr pDst,
+           INT16 xSrc, INT16 ySrc, INT16 xMask, INT16 yMask,
+           INT16 xDst, INT16 yDst, CARD16 width, CARD16 height);
+
+static void
+xCompositeFallback(CARD8 op, PicturePtr pSrc, PicturePtr pMask,
+                   PicturePtr pDst, INT16 xSrc, INT16 ySrc, INT16 xMask,
+                   INT16 yMask, INT16 xDst, INT16 yDst,
+                   CARD16 width, CARD16 height)
+{
+    ScreenPtr pScreen = pDst->pDrawable->pScreen;
+    PictureScreenPtr ps = GetPictureScreen(pScreen);
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiG2D *private = SUNXI_G2D(pScrn);
+
+    xSync(pScreen);
+    ps->Composite = private->Composite;
+    (*ps->Composite) (op, pSrc, pMask, pDst, xSrc, ySrc, xMask, yMask,
+                      xDst, yDst, width, height);
+    private->Composite = ps->Composite;
+    ps->Composite = xComposite;
+}
+
+/*
+ * Check whether the Render operation is just a copy of pixels, possibly with
+ * r5g6b5 <-> a8r8g8b8/x8r8g8b8 conversion (which the blt2d_i interface can
+ * do when the bpp of source and destination differs). The core protocol
+ * CopyArea always has the same depth for the source and the destination,
+ * so Render is the only way to get mixed-depth copies.
+ */
+static Bool
+xCompositeIsCopyFormat(CARD8 op, PicturePtr pSrc, PicturePtr pDst)
+{
+    /* OVER is the same as SRC if the source has no alpha channel */
+    if (op != PictOpSrc &&
+        !(op == PictOpOver && PICT_FORMAT_A(pSrc->format) == 0))
+        return FALSE;
+
+    switch (pSrc->format) {
+    case PICT_a8r8g8b8:
+        return pDst->format == PICT_a8r8g8b8 ||
+               pDst->format == PICT_x8r8g8b8 ||
+               pDst->format == PICT_r5g6b5;
+    case PICT_x8r8g8b8:
+        /* x8r8g8b8 -> a8r8g8b8 would need to set the alpha channel */
+        return pDst->format == PICT_x8r8g8b8 ||
+               pDst->format == PICT_r5g6b5;
+    case PICT_r5g6b5:
+        /* r5g6b5 -> a8r8g8b8 conversion sets alpha to 0xFF */
+        return pDst->format == PICT_a8r8g8b8 ||
+               pDst->format == PICT_x8r8g8b8 ||
+               pDst->format == PICT_r5g6b5;
+    default:
+        return FALSE;
+    }
+}
+
+static Bool
+xCompositeIsCopy(CARD8 op, PicturePtr pSrc, PicturePtr pMask, PicturePtr pDst)
+{
+    if (pMask || !pSrc->pDrawable || pSrc->transform || pSrc->repeat ||
+        pSrc->alphaMap || pDst->alphaMap)
+        return FALSE;
+
+    return xCompositeIsCopyFormat(op, pSrc, pDst);
+}
+
+/*
+ * Check whether the source transform is a pure scale (possibly with
+ * a translation) and the operation is otherwise a copy, so that it can
+ * be done by blt2d_i.stretch_blt. The nearest filter is left to pixman,
+ * because the results of G2D scaling are not pixel exact.
+ */
+static Bool
+xCompositeIsScale(CARD8 op, PicturePtr pSrc, PicturePtr pMask, PicturePtr pDst)
+{
+    PictTransformPtr t = pSrc->transform;
+
+    if (pMask || !pSrc->pDrawable || !t || pSrc->repeat || pSrc->clientClip ||
+        pSrc->alphaMap || pDst->alphaMap)
+        return FALSE;
+
+    if (t->matrix[0][1] != 0 || t->matrix[1][0] != 0 ||
+        t->matrix[2][0] != 0 || t->matrix[2][1] != 0 ||
+        t->matrix[2][2] != pixman_fixed_1 ||
+        t->matrix[0][0] <= 0 || t->matrix[1][1] <= 0)
+        return FALSE;
+
+    if (pSrc->filter != PictFilterBilinear && pSrc->filter != PictFilterGood &&
+        pSrc->filter != PictFilterBest)
+        return FALSE;
+
+    return xCompositeIsCopyFormat(op, pSrc, pDst);
+}
+
+/*
+ * Map a destination coordinate to the source coordinate through the scale
+ * transform. Returns FALSE if the result is not (close enough to) an integer
+ * number, because G2D can't handle fractional source rectangles.
+ */
+static Bool
+xScaleCoordinate(pixman_fixed_t scale, pixman_fixed_t offset, int x, int *result)
+{
+    int64_t v = (int64_t)scale * x + offset;
+    int64_t r = (v + pixman_fixed_1 / 2) >> 16;
+    if (v - (r << 16) > pixman_fixed_1 / 256 || (r << 16) - v > pixman_fixed_1 / 256)
+        return FALSE;
+    *result = r;
+    return TRUE;
+}
+
+static void
+xCompositeScale(CARD8 op, PicturePtr pSrc, PicturePtr pDst,
+                INT16 xSrc, INT16 ySrc, INT16 xDst, INT16 yDst,
+                CARD16 width, CARD16 height)
+{
+    FbBits *src;
+    FbStride srcStride;
+    int srcBpp;
+    int srcXoff, srcYoff;
+    FbBits *dst;
+    FbStride dstStride;
+    int dstBpp;
+    int dstXoff, dstYoff;
+    ScreenPtr pScreen = pDst->pDrawable->pScreen;
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiG2D *private = SUNXI_G2D(pScrn);
+    PictTransformPtr t = pSrc->transform;
+    RegionRec region;
+    BoxRec box;
+    BoxPtr pbox;
+    int nbox;
+
+    xDst += pDst->pDrawable->x;
+    yDst += pDst->pDrawable->y;
+
+    /*
+     * Only the destination clip is applied here, the source bounds are
+     * checked for each box after the transform.
+     */
+    box.x1 = xDst;
+    box.y1 = yDst;
+    box.x2 = xDst + width;
+    box.y2 = yDst + height;
+    RegionInit(&region, &box, 1);
+    RegionIntersect(&region, &region, pDst->pCompositeClip);
+
+    fbGetDrawable(pSrc->pDrawable, src, srcStride, srcBpp, srcXoff, srcYoff);
+    fbGetDrawable(pDst->pDrawable, dst, dstStride, dstBpp, dstXoff, dstYoff);
+
+    nbox = RegionNumRects(&region);
+    pbox = RegionRects(&region);
+    while (nbox--) {
+        int sx1, sy1, sx2, sy2;
+        if (xScaleCoordinate(t->matrix[0][0], t->matrix[0][2],
+                             pbox->x1 - xDst + xSrc, &sx1) &&
+            xScaleCoordinate(t->matrix[0][0], t->matrix[0][2],
+                             pbox->x2 - xDst + xSrc, &sx2) &&
+            xScaleCoordinate(t->matrix[1][1], t->matrix[1][2],
+                             pbox->y1 - yDst + ySrc, &sy1) &&
+            xScaleCoordinate(t->matrix[1][1], t->matrix[1][2],
+                             pbox->y2 - yDst + ySrc, &sy2) &&
+            sx1 >= 0 && sy1 >= 0 && sx1 < sx2 && sy1 < sy2 &&
+            sx2 <= pSrc->pDrawable->width && sy2 <= pSrc->pDrawable->height &&
+            private->blt2d_stretch_blt(private->blt2d_self,
+                                       (uint32_t *)src, (uint32_t *)dst,
+                                       srcStride, dstStride, srcBpp, dstBpp,
+                                       sx1 + pSrc->pDrawable->x + srcXoff,
+                                       sy1 + pSrc->pDrawable->y + srcYoff,
+                                       sx2 - sx1, sy2 - sy1,
+                                       pbox->x1 + dstXoff, pbox->y1 + dstYoff,
+                                       pbox->x2 - pbox->x1,
+                                       pbox->y2 - pbox->y1)) {
+            pbox++;
+            continue;
+        }
+        /* fallback to the wrapped function for this box */
+        xCompositeFallback(op, pSrc, NULL, pDst,
+                           pbox->x1 - xDst + xSrc, pbox->y1 - yDst + ySrc,
+                           0, 0,
+                           pbox->x1 - pDst->pDrawable->x,
+                           pbox->y1 - pDst->pDrawable->y,
+                           pbox->x2 - pbox->x1, pbox->y2 - pbox->y1);
+        pbox++;
+    }
+
+    fbFinishAccess(pDst->pDrawable);
+    fbFinishAccess(pSrc->pDrawable);
+    RegionUninit(&region);
+}
+
+/*
+ * Check whether the Render operation is the alpha blending of an a8r8g8b8
+ * source without a mask, which can be done by blt2d_i.blend_over. This is
+ * used for translucent menus, shadows and the output of the compositing
+ * window managers.
+ */
+static Bool
+xCompositeIsBlend(CARD8 op, PicturePtr pSrc, PicturePtr pMask, PicturePtr pDst)
+{
+    if (pMask || !pSrc->pDrawable || pSrc->transform || pSrc->repeat ||
+        pSrc->alphaMap || pDst->alphaMap)
+        return FALSE;
+
+    return op == PictOpOver && pSrc->format == PICT_a8r8g8b8 &&
+           (pDst->format == PICT_x8r8g8b8 || pDst->format == PICT_r5g6b5);
+}
+
+/* The size of the cached buffer for the read-modify-write compositing */
+#define RMW_SCRATCH_SIZE (64 * 1024)
+
+static PixmapPtr
+xGetDrawablePixmap(DrawablePtr pDrawable)
+{
+    if (pDrawable->type == DRAWABLE_WINDOW)
+        return pDrawable->pScreen->GetWindowPixmap((WindowPtr)pDrawable);
+    return (PixmapPtr)pDrawable;
+}
+
+/*
+ * Check whether the Render operation needs to read the destination, which
+ * is in the uncached framebuffer. Reading it pixel by pixel is very slow,
+ * so it is better to fetch the destination rows into a cached buffer with
+ * the same method as the CPU blits use, composite there and write the
+ * result back. Returns the CPU backend to be used for this or NULL.
+ */
+static cpu_backend_t *
+xCompositeIsRMW(CARD8 op, PicturePtr pSrc, PicturePtr pMask, PicturePtr pDst)
+{
+    ScreenPtr pScreen = pDst->pDrawable->pScreen;
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    cpu_backend_t *cpu_backend = FBDEVPTR(pScrn)->cpu_backend_private;
+    PixmapPtr pDstPixmap;
+    uint8_t *bits;
+
+    if (!cpu_backend || !cpu_backend->aligned_fetch || pDst->alphaMap)
+        return NULL;
+    /* these operations don't need to read the destination */
+    if (!pMask && (op == PictOpClear || op == PictOpSrc))
+        return NULL;
+    if (op > PictOpAdd)
+        return NULL;
+    if (pDst->pDrawable->bitsPerPixel != 16 &&
+        pDst->pDrawable->bitsPerPixel != 32)
+        return NULL;
+
+    pDstPixmap = xGetDrawablePixmap(pDst->pDrawable);
+    bits = pDstPixmap->devPrivate.ptr;
+    if (bits < cpu_backend->uncached_area_begin ||
+        bits >= cpu_backend->uncached_area_end)
+        return NULL;
+
+    /* the copy of the destination in the buffer would be stale */
+    if ((pSrc->pDrawable && xGetDrawablePixmap(pSrc->pDrawable) == pDstPixmap) ||
+        (pMask && pMask->pDrawable &&
+         xGetDrawablePixmap(pMask->pDrawable) == pDstPixmap))
+        return NULL;
+
+    return cpu_backend;
+}
+
+/*
+ * Do the Render operation on a temporary picture, which wraps the cached
+ * copy of the destination rows, in bands of up to RMW_SCRATCH_SIZE bytes.
+ */
+static void
+xCompositeRMW(cpu_backend_t *cpu_backend, CARD8 op, PicturePtr pSrc,
+              PicturePtr pMask, PicturePtr pDst, INT16 xSrc, INT16 ySrc,
+              INT16 xMask, INT16 yMask, INT16 xDst, INT16 yDst,
+              CARD16 width, CARD16 height)
+{
+    FbBits *dst;
+    FbStride dstStride;
+    int dstBpp;
+    int dstXoff, dstYoff;
+    ScreenPtr pScreen = pDst->pDrawable->pScreen;
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiG2D *private = SUNXI_G2D(pScrn);
+    PixmapPtr pPixmap;
+    PicturePtr pTmp;
+    RegionRec region;
+    BoxPtr pbox;
+    int nbox, error, bytespp, tmpStride, maxRows;
+    int x = xDst + pDst->pDrawable->x;
+    int y = yDst + pDst->pDrawable->y;
+
+    if (!private->rmw_scratch &&
+        !(private->rmw_scratch = malloc(RMW_SCRATCH_SIZE))) {
+        xCompositeFallback(op, pSrc, pMask, pDst, xSrc, ySrc, xMask, yMask,
+                           xDst, yDst, width, height);
+        return;
+    }
+
+    if (!miComputeCompositeRegion(&region, pSrc, pMask, pDst,
+                    xSrc + (pSrc->pDrawable ? pSrc->pDrawable->x : 0),
+                    ySrc + (pSrc->pDrawable ? pSrc->pDrawable->y : 0),
+                    xMask + (pMask && pMask->pDrawable ? pMask->pDrawable->x : 0),
+                    yMask + (pMask && pMask->pDrawable ? pMask->pDrawable->y : 0),
+                    x, y, width, height))
+        return;
+
+    /* The pending copies may still be writing to the fetched rows */
+    xSync(pScreen);
+
+    bytespp = pDst->pDrawable->bitsPerPixel / 8;
+    tmpStride = ((region.extents.x2 - region.extents.x1) * bytespp + 31) & ~31;
+    maxRows = RMW_SCRATCH_SIZE / tmpStride;
+    if (maxRows > region.extents.y2 - region.extents.y1)
+        maxRows = region.extents.y2 - region.extents.y1;
+
+    pPixmap = maxRows < 1 ? NULL : GetScratchPixmapHeader(pScreen,
+                                     region.extents.x2 - region.extents.x1,
+                                     maxRows, pDst->pDrawable->depth,
+                                     pDst->pDrawable->bitsPerPixel,
+                                     tmpStride, private->rmw_scratch);
+    pTmp = pPixmap ? CreatePicture(0, &pPixmap->drawable, pDst->pFormat, 0,
+                                   NULL, serverClient, &error) : NULL;
+    if (!pTmp) {
+        if (pPixmap)
+            FreeScratchPixmapHeader(pPixmap);
+        RegionUninit(&region);
+        xCompositeFallback(op, pSrc, pMask, pDst, xSrc, ySrc, xMask, yMask,
+                           xDst, yDst, width, height);
+        return;
+    }
+
+    fbGetDrawable(pDst->pDrawable, dst, dstStride, dstBpp, dstXoff, dstYoff);
+
+    nbox = RegionNumRects(&region);
+    pbox = RegionRects(&region);
+    while (nbox--) {
+        int w = pbox->x2 - pbox->x1;
+        int by, n;
+        for (by = pbox->y1; by < pbox->y2; by += n) {
+            uint8_t *fb = (uint8_t *)(dst + (by + dstYoff) * dstStride) +
+                          (pbox->x1 + dstXoff) * bytespp;
+            n = pbox->y2 - by < maxRows ? pbox->y2 - by : maxRows;
+            cpu_backend_fetch_rows(cpu_backend, private->rmw_scratch,
+                                   tmpStride, fb, dstStride * sizeof(FbBits),
+                                   w * bytespp, n);
+            xCompositeFallback(op, pSrc, pMask, pTmp,
+                               xSrc + pbox->x1 - x, ySrc + by - y,
+                               xMask + pbox->x1 - x, yMask + by - y,
+                               0, 0, w, n);
+            cpu_backend_writeback_rows(cpu_backend, fb,
+                                       dstStride * sizeof(FbBits),
+                                       private->rmw_scratch, tmpStride,
+                                       w * bytespp, n);
+        }
+        pbox++;
+    }
+
+    fbFinishAccess(pDst->pDrawable);
+    FreePicture(pTmp, 0);
+    FreeScratchPixmapHeader(pPixmap);
+    RegionUninit(&region);
+}
+
+static void
+xComposite(CARD8 op, PicturePtr pSrc, PicturePtr pMask, PicturePtr pDst,
+           INT16 xSrc, INT16 ySrc, INT16 xMask, INT16 yMask,
+           INT16 xDst, INT16 yDst, CARD16 width, CARD16 height)
+{
+    FbBits *src;
+    FbStride srcStride;
+    int srcBpp;
+    int srcXoff, srcYoff;
+    FbBits *dst;
+    FbStride dstStride;
+    int dstBpp;
+    int dstXoff, dstYoff;
+    ScreenPtr pScreen = pDst->pDrawable->pScreen;
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiG2D *private = SUNXI_G2D(pScrn);
+    RegionRec region;
+    BoxPtr pbox;
+    int nbox, dx, dy;
+    Bool blend = FALSE;
+
+    if (!xCompositeIsCopy(op, pSrc, pMask, pDst)) {
+        if (private->blt2d_stretch_blt &&
+            xCompositeIsScale(op, pSrc, pMask, pDst)) {
+            xCompositeScale(op, pSrc, pDst, xSrc, ySrc, xDst, yDst,
+                            width, height);
+            return;
+        }
+        if (!private->blt2d_blend_over ||
+            !xCompositeIsBlend(op, pSrc, pMask, pDst)) {
+            cpu_backend_t *cpu_backend = xCompositeIsRMW(op, pSrc, pMask, pDst);
+            if (cpu_backend)
+                xCompositeRMW(cpu_backend, op, pSrc, pMask, pDst, xSrc, ySrc,
+                              xMask, yMask, xDst, yDst, width, height);
+            else
+                xCompositeFallback(op, pSrc, pMask, pDst, xSrc, ySrc,
+                                   xMask, yMask, xDst, yDst, width, height);
+            return;
+        }
+        blend = TRUE;
+    }
+
+    xDst += pDst->pDrawable->x;
+    yDst += pDst->pDrawable->y;
+    xSrc += pSrc->pDrawable->x;
+    ySrc += pSrc->pDrawable->y;
+
+    if (!miComputeCompositeRegion(&region, pSrc, NULL, pDst, xSrc, ySrc,
+                                  0, 0, xDst, yDst, width, height))
+        return;
+
+    dx = xSrc - xDst;
+    dy = ySrc - yDst;
+
+    fbGetDrawable(pSrc->pDrawable, src, srcStride, srcBpp, srcXoff, srcYoff);
+    fbGetDrawable(pDst->pDrawable, dst, dstStride, dstBpp, dstXoff, dstYoff);
+
+    nbox = RegionNumRects(&region);
+    pbox = RegionRects(&region);
+    while (nbox > 0) {
+        int done = 0;
+        if (!blend)
+            done = xCopyBoxes(private, src, dst, srcStride, dstStride,
+                              srcBpp, dstBpp, dx + srcXoff, dy + srcYoff,
+                              dstXoff, dstYoff, pbox, nbox);
+        pbox += done;
+        nbox -= done;
+        if (nbox == 0)
+            break;
+        nbox--;
+        if (!(blend ? private->blt2d_blend_over :
+                      private->blt2d_overlapped_blt)(private->blt2d_self,
+                                           (uint32_t *)src, (uint32_t *)dst,
+                                           srcStride, dstStride,
+                                           srcBpp, dstBpp,
+                                           pbox->x1 + dx + srcXoff,
+                                           pbox->y1 + dy + srcYoff,
+                                           pbox->x1 + dstXoff,
+                                           pbox->y1 + dstYoff,
+                                           pbox->x2 - pbox->x1,
+                                           pbox->y2 - pbox->y1)) {
+            /* fallback to the wrapped function for this box */
+            xCompositeFallback(op, pSrc, NULL, pDst,
+                               pbox->x1 + dx - pSrc->pDrawable->x,
+                               pbox->y1 + dy - pSrc->pDrawable->y, 0, 0,
+                               pbox->x1 - pDst->pDrawable->x,
+                               pbox->y1 - pDst->pDrawable->y,
+                               pbox->x2 - pbox->x1, pbox->y2 - pbox->y1);
+        }
+        pbox++;
+    }
+
+    fbFinishAccess(pDst->pDrawable);
+    fbFinishAccess(pSrc->pDrawable);
+    RegionUninit(&region);
+}
+
+/*
+ * The glyphs are rendered with miGlyphs if the destination is in the
+ * uncached framebuffer, because it goes through xComposite (and can use
+ * the read-modify-write there) instead of accessing the destination
+ * directly like fbGlyphs does.
+ */
+static void
+xGlyphs(CARD8 op, PicturePtr pSrc, PicturePtr pDst, PictFormatPtr maskFormat,
+        INT16 xSrc, INT16 ySrc, int nlist, GlyphListPtr list, GlyphPtr *glyphs)
+{
+    ScreenPtr pScreen = pDst->pDrawable->pScreen;
+    PictureScreenPtr ps = GetPictureScreen(pScreen);
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiG2D *private = SUNXI_G2D(pScrn);
+
+    xSync(pScreen);
+    if (xCompositeIsRMW(op, pSrc, NULL, pDst)) {
+        miGlyphs(op, pSrc, pDst, maskFormat, xSrc, ySrc, nlist, list, glyphs);
+        return;
+    }
+    ps->Glyphs = private->Glyphs;
+    (*ps->Glyphs) (op, pSrc, pDst, maskFormat, xSrc, ySrc, nlist, list, glyphs);
+    private->Glyphs = ps->Glyphs;
+    ps->Glyphs = xGlyphs;
+}
+
+/* The rest of Render operations are wrapped only to call xSync */
+
+static void
+xTrapezoids(CARD8 op, PicturePtr pSrc, PicturePtr pDst,
+            PictFormatPtr maskFormat, INT16 xSrc, INT16 ySrc,
+            int ntrap, xTrapezoid *traps)
+{
+    ScreenPtr pScreen = pDst->pDrawable->pScreen;
+    PictureScreenPtr ps = GetPictureScreen(pScreen);
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiG2D *private = SUNXI_G2D(pScrn);
+
+    xSync(pScreen);
+    ps->Trapezoids = private->Trapezoids;
+    (*ps->Trapezoids) (op, pSrc, pDst, maskFormat, xSrc, ySrc, ntrap, traps);
+    private->Trapezoids = ps->Trapezoids;
+    ps->Trapezoids = xTrapezoids;
+}
+
+static void
+xTriangles(CARD8 op, PicturePtr pSrc, PicturePtr pDst,
+           PictFormatPtr maskFormat, INT16 xSrc, INT16 ySrc,
+           int ntri, xTriangle *tris)
+{
+    ScreenPtr pScreen = pDst->pDrawable->pScreen;
+    PictureScreenPtr ps = GetPictureScreen(pScreen);
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiG2D *private = SUNXI_G2D(pScrn);
+
+    xSync(pScreen);
+    ps->Triangles = private->Triangles;
+    (*ps->Triangles) (op, pSrc, pDst, maskFormat, xSrc, ySrc, ntri, tris);
+    private->Triangles = ps->Triangles;
+    ps->Triangles = xTriangles;
+}
+
+static void
+xAddTraps(PicturePtr pPicture, INT16 xOff, INT16 yOff, int ntrap, xTrap *traps)
+{
+    ScreenPtr pScreen = pPicture->pDrawable->pScreen;
+    PictureScreenPtr ps = GetPictureScreen(pScreen);
+    ScrnInfoPtr pScrn = xf86Screens[pScreen->myNum];
+    SunxiG2D *private = SUNXI_G2D(pScrn);
+
+    xSync(pScreen);
+    ps->AddTraps = private->AddTraps;
+    (*ps->AddTraps) (pPicture, xOff, yOff, ntrap, traps);
+    private->AddTraps = ps->AddTraps;
+    ps->AddTraps = xAddTraps;
+}
+
+#endif
+
+/*****************************************************************************/
+
 SunxiG2D *SunxiG2D_Init(ScreenPtr pScreen, blt2d_i *blt2d)
 {
     SunxiG2D *private = calloc(1, sizeof(SunxiG2D));
@@ -339,6 +1296,11 @@ SunxiG2D *SunxiG2D_Init(ScreenPtr pScreen, blt2d_i *blt2d)
     /* Cache the pointers from blt2d_i here */
     private->blt2d_self = blt2d->self;
     private->blt2d_overlapped_blt = blt2d->overlapped_blt;
+    private->blt2d_sync = blt2d->sync;
+    private->blt2d_overlapped_blt_boxes = blt2d->overlapped_blt_boxes;
+    private->blt2d_blend_over = blt2d->blend_over;
+    private->blt2d_stretch_blt = blt2d->stretch_blt;
+    private->blt2d_fill = blt2d->fill;
 
     /* Wrap the current CopyWindow function */
     private->CopyWindow = pScreen->CopyWindow;
@@ -348,6 +1310,35 @@ SunxiG2D *SunxiG2D_Init(ScreenPtr pScreen, blt2d_i *blt2d)
     private->CreateGC = pScreen->CreateGC;
     pScreen->CreateGC = xCreateGC;
 
+#ifdef RENDER
+    /* Wrap the current Composite function */
+    if (GetPictureScreenIfSet(pScreen)) {
+        PictureScreenPtr ps = GetPictureScreen(pScreen);
+        private->Composite = ps->Composite;
+        ps->Composite = xComposite;
+
+        private->Glyphs = ps->Glyphs;
+        ps->Glyphs = xGlyphs;
+
+        if (private->blt2d_sync) {
+            private->Trapezoids = ps->Trapezoids;
+            ps->Trapezoids = xTrapezoids;
+            private->Triangles = ps->Triangles;
+            ps->Triangles = xTriangles;
+            private->AddTraps = ps->AddTraps;
+            ps->AddTraps = xAddTraps;
+        }
+    }
+#endif
+
+    if (private->blt2d_sync) {
+        /* Wrap the current GetImage and GetSpans functions */
+        private->GetImage = pScreen->GetImage;
+        pScreen->GetImage = xGetImage;
+        private->GetSpans = pScreen->GetSpans;
+        pScreen->GetSpans = xGetSpans;
+    }
+
     return private;
 }
 
@@ -359,7 +1350,29 @@ void SunxiG2D_Close(ScreenPtr pScreen)
     pScreen->CopyWindow = private->CopyWindow;
     pScreen->CreateGC   = private->CreateGC;
 
+    if (private->GetImage)
+        pScreen->GetImage = private->GetImage;
+    if (private->GetSpans)
+        pScreen->GetSpans = private->GetSpans;
+
+#ifdef RENDER
+    if (private->Composite) {
+        PictureScreenPtr ps = GetPictureScreen(pScreen);
+        ps->Composite = private->Composite;
+        ps->Glyphs    = private->Glyphs;
+        if (private->Trapezoids) {
+            ps->Trapezoids = private->Trapezoids;
+            ps->Triangles  = private->Triangles;
+            ps->AddTraps   = private->AddTraps;
+        }
+    }
+#endif
+
     if (private->pGCOps) {
         free(private->pGCOps);
     }
+    if (private->pFbGCOps) {
+        free(private->pFbGCOps);
+    }
+    free(private->rmw_scratch);
 }
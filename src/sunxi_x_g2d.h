@@ -26,11 +26,29 @@
 
 #include "interfaces.h"
 
+#ifdef RENDER
+#include "picturestr.h"
+#endif
+
 typedef struct {
     GCOps                  *pGCOps;
+    /* The original fb GC ops, which are wrapped to call blt2d_sync */
+    GCOps                  *pFbGCOps;
 
     CopyWindowProcPtr       CopyWindow;
     CreateGCProcPtr         CreateGC;
+    GetImageProcPtr         GetImage;
+    GetSpansProcPtr         GetSpans;
+#ifdef RENDER
+    CompositeProcPtr        Composite;
+    GlyphsProcPtr           Glyphs;
+    TrapezoidsProcPtr       Trapezoids;
+    TrianglesProcPtr        Triangles;
+    AddTrapsProcPtr         AddTraps;
+#endif
+
+    /* The cached copy of framebuffer rows for the Render read-modify-write */
+    uint8_t                *rmw_scratch;
 
     /* SunxiG2D_Init copies these pointers here from blt2d_i struct */
     void *blt2d_self;
@@ -47,6 +65,62 @@ typedef struct {
                                 int       dst_y,
                                 int       w,
                                 int       h);
+    /* Optional, NULL if the blits are not done asynchronously */
+    void (*blt2d_sync)(void *self);
+    /* Optional, NULL if the boxes need to be copied one by one */
+    int (*blt2d_overlapped_blt_boxes)(void        *self,
+                                      uint32_t    *src_bits,
+                                      uint32_t    *dst_bits,
+                                      int          src_stride,
+                                      int          dst_stride,
+                                      int          src_bpp,
+                                      int          dst_bpp,
+                                      int          src_x,
+                                      int          src_y,
+                                      int          dst_x,
+                                      int          dst_y,
+                                      blt2d_box_t *boxes,
+                                      int          nboxes);
+    /* Optional, NULL if alpha blending is not accelerated */
+    int (*blt2d_blend_over)(void     *self,
+                            uint32_t *src_bits,
+                            uint32_t *dst_bits,
+                            int       src_stride,
+                            int       dst_stride,
+                            int       src_bpp,
+                            int       dst_bpp,
+                            int       src_x,
+                            int       src_y,
+                            int       dst_x,
+                            int       dst_y,
+                            int       w,
+                            int       h);
+    /* Optional, NULL if scaling is not accelerated */
+    int (*blt2d_stretch_blt)(void     *self,
+                             uint32_t *src_bits,
+                             uint32_t *dst_bits,
+                             int       src_stride,
+                             int       dst_stride,
+                             int       src_bpp,
+                             int       dst_bpp,
+                             int       src_x,
+                             int       src_y,
+                             int       src_w,
+                             int       src_h,
+                             int       dst_x,
+                             int       dst_y,
+                             int       dst_w,
+                             int       dst_h);
+    /* Optional, NULL if solid fills are not accelerated */
+    int (*blt2d_fill)(void     *self,
+                      uint32_t *bits,
+                      int       stride,
+                      int       bpp,
+                      int       x,
+                      int       y,
+                      int       w,
+                      int       h,
+                      uint32_t  color);
 } SunxiG2D;
 
 SunxiG2D *SunxiG2D_Init(ScreenPtr pScreen, blt2d_i *blt2d);
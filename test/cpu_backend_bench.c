@@ -0,0 +1,710 @@
+/*
+ * Copyright © 2013 Siarhei Siamashka <siarhei.siamashka@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Correctness test and benchmark for the CPU backend (the two-pass blitter
+ * which deals with uncached framebuffer reads). It does not need any special
+ * hardware, so it can be also run on a build host under qemu user mode
+ * emulation (for example "qemu-aarch64 ./cpu_backend_bench"). If a
+ * framebuffer device is given as the command line argument, then the
+ * benchmark is additionally run on the real framebuffer memory.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <linux/fb.h>
+
+#include "../src/cpu_backend.h"
+
+#define NTESTS     20000
+#define NBENCH     20
+#define NTHREADS   4
+
+/* The size of the emulated framebuffer used for the correctness tests */
+#define TEST_XRES  640
+#define TEST_YRES  64
+/* Guard area around the emulated framebuffer */
+#define TEST_GUARD 64
+
+double gettime(void)
+{
+    struct timeval tv;
+    gettimeofday (&tv, NULL);
+    return (double)((int64_t)tv.tv_sec * 1000000 + tv.tv_usec) / 1000000.;
+}
+
+/* The reference implementation, which copies data via a temporary buffer */
+static void ref_blt(uint8_t *bits, int stride, int bpp,
+                    int src_x, int src_y, int dst_x, int dst_y, int w, int h)
+{
+    int bytes_pp = bpp / 8, y;
+    uint8_t *tmp = malloc(w * bytes_pp * h);
+
+    for (y = 0; y < h; y++)
+        memcpy(tmp + y * w * bytes_pp,
+               bits + (src_y + y) * stride + src_x * bytes_pp, w * bytes_pp);
+    for (y = 0; y < h; y++)
+        memcpy(bits + (dst_y + y) * stride + dst_x * bytes_pp,
+               tmp + y * w * bytes_pp, w * bytes_pp);
+    free(tmp);
+}
+
+static int rand_range(int min, int max)
+{
+    return min + rand() % (max - min + 1);
+}
+
+static int run_correctness_test(cpu_backend_t *cpu_backend, uint8_t *buf)
+{
+    int bufsize = TEST_XRES * 4 * TEST_YRES + TEST_GUARD * 2;
+    uint8_t *ref = malloc(bufsize);
+    uint8_t *fb = buf + TEST_GUARD, *ref_fb = ref + TEST_GUARD;
+    int i, j, accelerated = 0;
+
+    for (i = 0; i < NTESTS; i++) {
+        int bpp = 8 << rand_range(0, 2);
+        int xres = TEST_XRES * 32 / bpp;
+        int stride = TEST_XRES * 4;
+        int w = rand_range(1, rand() % 2 ? 16 : xres);
+        int h = rand_range(1, TEST_YRES);
+        int src_x = rand_range(0, xres - w);
+        int src_y = rand_range(0, TEST_YRES - h);
+        int dst_x, dst_y;
+
+        if (rand() % 2) {
+            /* overlapped copy with a small offset */
+            dst_x = src_x + (rand() % 4 ? rand_range(-16, 16) : 0);
+            dst_y = src_y + (rand() % 2 ? rand_range(-2, 2) :
+                                          rand_range(-16, 16));
+            if (dst_x < 0)
+                dst_x = 0;
+            if (dst_x > xres - w)
+                dst_x = xres - w;
+            if (dst_y < 0)
+                dst_y = 0;
+            if (dst_y > TEST_YRES - h)
+                dst_y = TEST_YRES - h;
+        }
+        else {
+            dst_x = rand_range(0, xres - w);
+            dst_y = rand_range(0, TEST_YRES - h);
+        }
+
+        /*
+         * both buffers stay identical as long as the tests pass, so
+         * they only need to be refilled with random data sometimes
+         */
+        if (i % 100 == 0) {
+            for (j = 0; j < bufsize; j++)
+                buf[j] = ref[j] = rand();
+        }
+
+        /* also exercise the scratch buffer sizes tried by calibration */
+        cpu_backend->scratch_size = 512 << rand_range(0, 4);
+
+        if (!cpu_backend->blt2d.overlapped_blt(cpu_backend->blt2d.self,
+                                               (uint32_t *)fb, (uint32_t *)fb,
+                                               stride / 4, stride / 4,
+                                               bpp, bpp, src_x, src_y,
+                                               dst_x, dst_y, w, h))
+            continue;
+
+        accelerated++;
+        ref_blt(ref_fb, stride, bpp, src_x, src_y, dst_x, dst_y, w, h);
+
+        if (memcmp(buf, ref, bufsize) != 0) {
+            printf("Test %d failed: bpp=%d, src=(%d, %d), dst=(%d, %d), "
+                   "size=%dx%d\n", i, bpp, src_x, src_y, dst_x, dst_y, w, h);
+            free(ref);
+            return 0;
+        }
+    }
+
+    printf("%d tests passed (%d of them accelerated)\n", NTESTS, accelerated);
+    free(ref);
+    cpu_backend->scratch_size = 2048;
+    return 1;
+}
+
+static uint32_t ref_convert(uint32_t p, int src_bpp)
+{
+    if (src_bpp == 32)
+        return ((p >> 8) & 0xF800) | ((p >> 5) & 0x07E0) | ((p >> 3) & 0x001F);
+    return 0xFF000000 | ((p & 0xF800) << 8) | ((p & 0xE000) << 3) |
+                        ((p & 0x07E0) << 5) | ((p & 0x0600) >> 1) |
+                        ((p & 0x001F) << 3) | ((p & 0x001C) >> 2);
+}
+
+/* Test r5g6b5 <-> a8r8g8b8 conversion between two different buffers */
+static int run_conversion_test(cpu_backend_t *cpu_backend,
+                               uint8_t *src_buf, uint8_t *dst_buf)
+{
+    int stride = TEST_XRES * 4;
+    int bufsize = stride * TEST_YRES;
+    uint8_t *ref = malloc(bufsize);
+    int i, j, x, y, accelerated = 0;
+
+    for (i = 0; i < NTESTS / 10; i++) {
+        int src_bpp = rand() % 2 ? 16 : 32;
+        int dst_bpp = src_bpp == 16 ? 32 : 16;
+        int w = rand_range(1, rand() % 2 ? 16 : TEST_XRES);
+        int h = rand_range(1, TEST_YRES);
+        int src_x = rand_range(0, TEST_XRES - w);
+        int src_y = rand_range(0, TEST_YRES - h);
+        int dst_x = rand_range(0, TEST_XRES - w);
+        int dst_y = rand_range(0, TEST_YRES - h);
+
+        for (j = 0; j < bufsize; j++) {
+            src_buf[j] = rand();
+            dst_buf[j] = ref[j] = rand();
+        }
+
+        for (y = 0; y < h; y++) {
+            for (x = 0; x < w; x++) {
+                uint8_t *s = src_buf + (src_y + y) * stride + (src_x + x) * src_bpp / 8;
+                uint8_t *d = ref + (dst_y + y) * stride + (dst_x + x) * dst_bpp / 8;
+                if (src_bpp == 32)
+                    *(uint16_t *)d = ref_convert(*(uint32_t *)s, 32);
+                else
+                    *(uint32_t *)d = ref_convert(*(uint16_t *)s, 16);
+            }
+        }
+
+        if (!cpu_backend->blt2d.overlapped_blt(cpu_backend->blt2d.self,
+                                               (uint32_t *)src_buf,
+                                               (uint32_t *)dst_buf,
+                                               stride / 4, stride / 4,
+                                               src_bpp, dst_bpp, src_x, src_y,
+                                               dst_x, dst_y, w, h))
+            continue;
+
+        accelerated++;
+        if (memcmp(dst_buf, ref, bufsize) != 0) {
+            printf("Test %d failed: bpp=%d->%d, src=(%d, %d), dst=(%d, %d), "
+                   "size=%dx%d\n", i, src_bpp, dst_bpp, src_x, src_y,
+                   dst_x, dst_y, w, h);
+            free(ref);
+            return 0;
+        }
+    }
+
+    printf("%d tests passed (%d of them accelerated)\n", NTESTS / 10,
+           accelerated);
+    free(ref);
+    return 1;
+}
+
+/*
+ * Test overlapped_blt_boxes with a rectangle split into a grid of boxes,
+ * ordered in the same way as miCopyRegion does for overlapped copies.
+ */
+static int run_boxes_test(cpu_backend_t *cpu_backend, uint8_t *buf)
+{
+    int bufsize = TEST_XRES * 4 * TEST_YRES + TEST_GUARD * 2;
+    uint8_t *ref = malloc(bufsize);
+    uint8_t *fb = buf + TEST_GUARD, *ref_fb = ref + TEST_GUARD;
+    blt2d_box_t boxes[64];
+    int i, j, bx, by, accelerated = 0;
+
+    for (i = 0; i < NTESTS / 10; i++) {
+        int bpp = 16 << rand_range(0, 1);
+        int xres = TEST_XRES * 32 / bpp;
+        int stride = TEST_XRES * 4;
+        int w = rand_range(8, xres / 2);
+        int h = rand_range(8, TEST_YRES / 2);
+        int src_x = rand_range(0, xres - w);
+        int src_y = rand_range(0, TEST_YRES - h);
+        int dst_x = rand() % 2 ? rand_range(0, xres - w) : src_x;
+        int dst_y = rand() % 2 ? rand_range(0, TEST_YRES - h) : src_y;
+        int nx = rand_range(1, 8), ny = rand_range(1, 8), nboxes = 0;
+
+        for (by = 0; by < ny; by++) {
+            int row = dst_y > src_y ? ny - 1 - by : by;
+            for (bx = 0; bx < nx; bx++) {
+                int col = (dst_y == src_y && dst_x > src_x) ? nx - 1 - bx : bx;
+                boxes[nboxes].x1 = w * col / nx;
+                boxes[nboxes].x2 = w * (col + 1) / nx;
+                boxes[nboxes].y1 = h * row / ny;
+                boxes[nboxes].y2 = h * (row + 1) / ny;
+                if (boxes[nboxes].x1 < boxes[nboxes].x2 &&
+                    boxes[nboxes].y1 < boxes[nboxes].y2)
+                    nboxes++;
+            }
+        }
+
+        for (j = 0; j < bufsize; j++)
+            buf[j] = ref[j] = rand();
+
+        if (cpu_backend->blt2d.overlapped_blt_boxes(cpu_backend->blt2d.self,
+                                        (uint32_t *)fb, (uint32_t *)fb,
+                                        stride / 4, stride / 4, bpp, bpp,
+                                        src_x, src_y, dst_x, dst_y,
+                                        boxes, nboxes) != nboxes)
+            continue;
+
+        accelerated++;
+        ref_blt(ref_fb, stride, bpp, src_x, src_y, dst_x, dst_y, w, h);
+
+        if (memcmp(buf, ref, bufsize) != 0) {
+            printf("Test %d failed: bpp=%d, src=(%d, %d), dst=(%d, %d), "
+                   "size=%dx%d, %dx%d boxes\n", i, bpp, src_x, src_y,
+                   dst_x, dst_y, w, h, nx, ny);
+            free(ref);
+            return 0;
+        }
+    }
+
+    printf("%d tests passed (%d of them accelerated)\n", NTESTS / 10,
+           accelerated);
+    free(ref);
+    return 1;
+}
+
+/*
+ * The reference rotation (clockwise), which works in the same way as
+ * shadowUpdateRotatePacked from the X server: each destination row is
+ * written pixel by pixel, while the source is read column by column.
+ */
+static void ref_rotate(uint8_t *src, uint8_t *dst, int src_stride,
+                       int dst_stride, int bpp, int src_w, int src_h,
+                       int x, int y, int w, int h, int degrees_cw)
+{
+    int bytes_pp = bpp / 8, dx, dy, dx1, dy1, dx2, dy2;
+
+    switch (degrees_cw) {
+    case 90:
+        dx1 = src_h - y - h;
+        dy1 = x;
+        dx2 = src_h - y;
+        dy2 = x + w;
+        break;
+    case 270:
+        dx1 = y;
+        dy1 = src_w - x - w;
+        dx2 = y + h;
+        dy2 = src_w - x;
+        break;
+    default:
+        dx1 = src_w - x - w;
+        dy1 = src_h - y - h;
+        dx2 = src_w - x;
+        dy2 = src_h - y;
+        break;
+    }
+
+    for (dy = dy1; dy < dy2; dy++) {
+        for (dx = dx1; dx < dx2; dx++) {
+            int sx, sy;
+            switch (degrees_cw) {
+            case 90:
+                sx = dy;
+                sy = src_h - 1 - dx;
+                break;
+            case 270:
+                sx = src_w - 1 - dy;
+                sy = dx;
+                break;
+            default:
+                sx = src_w - 1 - dx;
+                sy = src_h - 1 - dy;
+                break;
+            }
+            if (bytes_pp == 4)
+                *(uint32_t *)(dst + dy * dst_stride + dx * 4) =
+                    *(uint32_t *)(src + sy * src_stride + sx * 4);
+            else
+                *(uint16_t *)(dst + dy * dst_stride + dx * 2) =
+                    *(uint16_t *)(src + sy * src_stride + sx * 2);
+        }
+    }
+}
+
+static int run_rotate_test(cpu_backend_t *cpu_backend, uint8_t *buf,
+                           uint8_t *cached_buf)
+{
+    /* the source is TEST_XRES x TEST_YRES pixels, the same for both bpp */
+    int bufsize = TEST_XRES * TEST_YRES * 4;
+    uint8_t *ref = malloc(bufsize);
+    int i, j;
+
+    for (j = 0; j < bufsize; j++)
+        cached_buf[j] = rand();
+
+    for (i = 0; i < NTESTS / 10; i++) {
+        int bpp = rand() % 2 ? 16 : 32;
+        int degrees_cw = 90 * rand_range(1, 3);
+        int src_w = TEST_XRES, src_h = TEST_YRES;
+        int w = rand_range(1, rand() % 2 ? 20 : src_w);
+        int h = rand_range(1, src_h);
+        int x = rand_range(0, src_w - w);
+        int y = rand_range(0, src_h - h);
+        int src_stride = src_w * bpp / 8;
+        int dst_stride = (degrees_cw == 180 ? src_w : src_h) * bpp / 8;
+
+        if (i % 100 == 0) {
+            for (j = 0; j < bufsize; j++)
+                buf[j] = ref[j] = rand();
+        }
+
+        if (!cpu_backend_rotate_blt(cpu_backend, (uint32_t *)cached_buf,
+                                    (uint32_t *)buf, src_stride / 4,
+                                    dst_stride / 4, bpp, src_w, src_h,
+                                    x, y, w, h, degrees_cw)) {
+            printf("Rotation is not supported for bpp=%d\n", bpp);
+            free(ref);
+            return 0;
+        }
+        ref_rotate(cached_buf, ref, src_stride, dst_stride, bpp, src_w, src_h,
+                   x, y, w, h, degrees_cw);
+
+        if (memcmp(buf, ref, bufsize) != 0) {
+            printf("Test %d failed: bpp=%d, rotation=%d, box=(%d, %d), "
+                   "size=%dx%d\n", i, bpp, degrees_cw, x, y, w, h);
+            free(ref);
+            return 0;
+        }
+    }
+
+    printf("%d tests passed\n", NTESTS / 10);
+    free(ref);
+    return 1;
+}
+
+/* Fetch rows from 'buf' and write them back shifted by a random offset */
+static int run_rows_test(cpu_backend_t *cpu_backend, uint8_t *buf,
+                         uint8_t *cached_buf)
+{
+    int stride = TEST_XRES * 4;
+    int bufsize = stride * TEST_YRES;
+    uint8_t *ref = malloc(bufsize);
+    int i, j;
+
+    for (i = 0; i < NTESTS / 10; i++) {
+        int width = rand_range(1, rand() % 2 ? 64 : stride);
+        int height = rand_range(1, TEST_YRES / 2);
+        int src_x = rand_range(0, stride - width);
+        int src_y = rand_range(0, TEST_YRES - height);
+        int dst_x = rand_range(0, stride - width);
+        int dst_y = rand_range(0, TEST_YRES - height);
+        int tmp_stride = rand_range(width, stride);
+
+        if (i % 100 == 0) {
+            for (j = 0; j < bufsize; j++)
+                buf[j] = ref[j] = rand();
+        }
+
+        if (!cpu_backend_fetch_rows(cpu_backend, cached_buf, tmp_stride,
+                                    buf + src_y * stride + src_x, stride,
+                                    width, height)) {
+            printf("Fetching rows is not supported\n");
+            free(ref);
+            return 1;
+        }
+        for (j = 0; j < height; j++) {
+            if (memcmp(cached_buf + j * tmp_stride,
+                       ref + (src_y + j) * stride + src_x, width) != 0)
+                break;
+        }
+        cpu_backend_writeback_rows(cpu_backend, buf + dst_y * stride + dst_x,
+                                   stride, cached_buf, tmp_stride,
+                                   width, height);
+        for (j = 0; j < height; j++)
+            memcpy(ref + (dst_y + j) * stride + dst_x,
+                   cached_buf + j * tmp_stride, width);
+
+        if (j < height || memcmp(buf, ref, bufsize) != 0) {
+            printf("Test %d failed: src=(%d, %d), dst=(%d, %d), "
+                   "size=%dx%d\n", i, src_x, src_y, dst_x, dst_y,
+                   width, height);
+            free(ref);
+            return 0;
+        }
+    }
+
+    printf("%d tests passed\n", NTESTS / 10);
+    free(ref);
+    return 1;
+}
+
+static void run_benchmark(cpu_backend_t *cpu_backend, uint8_t *fb,
+                          int xres, int yres, int stride, int bpp)
+{
+    struct {
+        const char *name;
+        int src_x, src_y, dst_x, dst_y;
+    } *t, tests[] = {
+        { "scroll up",    0, 1, 0, 0 },
+        { "scroll down",  0, 0, 0, 1 },
+        { "move left",    1, 0, 0, 0 },
+        { "move right",   0, 0, 1, 0 },
+    };
+    int w = xres - 1, h = yres - 1;
+    int i;
+    double t1, t2;
+
+    for (t = tests; t < tests + sizeof(tests) / sizeof(tests[0]); t++) {
+        int ok = 1;
+        t1 = gettime();
+        for (i = 0; i < NBENCH && ok; i++) {
+            ok = cpu_backend->blt2d.overlapped_blt(cpu_backend->blt2d.self,
+                                    (uint32_t *)fb, (uint32_t *)fb,
+                                    stride / 4, stride / 4, bpp, bpp,
+                                    t->src_x, t->src_y, t->dst_x, t->dst_y,
+                                    w, h);
+        }
+        t2 = gettime();
+        if (!ok) {
+            printf("%-12s: not accelerated\n", t->name);
+            continue;
+        }
+        printf("%-12s: %.2f MPix/s (%.2f MB/s)\n", t->name,
+               (double)w * h * NBENCH / (t2 - t1) / 1000000.,
+               (double)w * h * NBENCH / (t2 - t1) / 1000000. * bpp / 8);
+    }
+}
+
+/* Narrow blits (scrollbars, text cursor), which are dominated by per-row costs */
+static void run_narrow_benchmark(cpu_backend_t *cpu_backend, uint8_t *fb,
+                                 int xres, int yres, int stride, int bpp)
+{
+    int w, i, h = yres - 1, n = NBENCH * 50;
+    double t1, t2;
+
+    for (w = 1; w <= 128 && w < xres; w *= 2) {
+        int ok = 1;
+        t1 = gettime();
+        for (i = 0; i < n && ok; i++) {
+            ok = cpu_backend->blt2d.overlapped_blt(cpu_backend->blt2d.self,
+                                    (uint32_t *)fb, (uint32_t *)fb,
+                                    stride / 4, stride / 4, bpp, bpp,
+                                    (i * 8) % (xres - w), 1,
+                                    (i * 8) % (xres - w), 0, w, h);
+        }
+        t2 = gettime();
+        if (!ok) {
+            printf("%3d px wide : not accelerated\n", w);
+            continue;
+        }
+        printf("%3d px wide : %.2f MPix/s (%.2f MB/s)\n", w,
+               (double)w * h * n / (t2 - t1) / 1000000.,
+               (double)w * h * n / (t2 - t1) / 1000000. * bpp / 8);
+    }
+}
+
+/*
+ * The full screen update of a rotated display ('fb' is the xres x yres
+ * visible part of the framebuffer), compared with the reference code,
+ * which works like the stock shadow update from the X server.
+ */
+static void run_rotate_benchmark(cpu_backend_t *cpu_backend, uint8_t *fb,
+                                 int xres, int yres, int stride, int bpp)
+{
+    int degrees_cw, i, n = NBENCH / 4;
+    uint8_t *shadow = malloc(xres * yres * bpp / 8);
+    double t1, t2, t3;
+
+    if (!shadow || (bpp != 16 && bpp != 32)) {
+        free(shadow);
+        return;
+    }
+    memset(shadow, 0x55, xres * yres * bpp / 8);
+
+    for (degrees_cw = 90; degrees_cw <= 270; degrees_cw += 90) {
+        /* the dimensions of the shadow framebuffer */
+        int src_w = degrees_cw == 180 ? xres : yres;
+        int src_h = degrees_cw == 180 ? yres : xres;
+        int src_stride = src_w * bpp / 8;
+
+        t1 = gettime();
+        for (i = 0; i < n; i++)
+            ref_rotate(shadow, fb, src_stride, stride, bpp, src_w, src_h,
+                       0, 0, src_w, src_h, degrees_cw);
+        t2 = gettime();
+        for (i = 0; i < n; i++)
+            cpu_backend_rotate_blt(cpu_backend, (uint32_t *)shadow,
+                                   (uint32_t *)fb, src_stride / 4, stride / 4,
+                                   bpp, src_w, src_h, 0, 0, src_w, src_h,
+                                   degrees_cw);
+        t3 = gettime();
+        printf("rotate %3d  : per pixel %.2f MPix/s, tiled %.2f MPix/s\n",
+               degrees_cw,
+               (double)xres * yres * n / (t2 - t1) / 1000000.,
+               (double)xres * yres * n / (t3 - t2) / 1000000.);
+    }
+    free(shadow);
+}
+
+int main(int argc, char *argv[])
+{
+    cpu_backend_t *cpu_backend;
+    uint8_t *buf, *cached_buf;
+    int xres = 1920, yres = 1080, bpp = 32, stride = xres * 4;
+    int bufsize = stride * yres;
+
+    if (!(buf = malloc(bufsize)) || !(cached_buf = malloc(bufsize))) {
+        printf("malloc failed\n");
+        return 1;
+    }
+
+    /* Pretend that this buffer is uncached, just like a framebuffer */
+    cpu_backend = cpu_backend_init(buf, bufsize);
+    if (!cpu_backend) {
+        printf("cpu_backend_init() failed\n");
+        return 1;
+    }
+    printf("processor: %s\n", cpu_backend->cpuinfo->processor_name);
+    printf("implementation: %s\n", cpu_backend->blt2d_impl_name);
+
+    printf("\nRunning correctness tests\n");
+    if (!run_correctness_test(cpu_backend, buf))
+        return 1;
+
+    /* Split even the smallest blits in order to test the threads */
+    printf("\nRunning correctness tests (%d threads)\n",
+           cpu_backend_start_threads(cpu_backend, NTHREADS, 0));
+    if (!run_correctness_test(cpu_backend, buf))
+        return 1;
+    cpu_backend_start_threads(cpu_backend, 1, 0);
+
+    /* Only the blits which need a special copy direction are handled */
+    printf("\nRunning correctness tests (cached memory)\n");
+    if (!run_correctness_test(cpu_backend, cached_buf))
+        return 1;
+
+    printf("\nRunning box list tests\n");
+    if (!run_boxes_test(cpu_backend, buf))
+        return 1;
+
+    printf("\nRunning format conversion tests (from uncached memory)\n");
+    if (!run_conversion_test(cpu_backend, buf, cached_buf))
+        return 1;
+    printf("\nRunning format conversion tests (from cached memory)\n");
+    if (!run_conversion_test(cpu_backend, cached_buf, buf))
+        return 1;
+
+    printf("\nRunning rotation tests\n");
+    if (!run_rotate_test(cpu_backend, buf, cached_buf))
+        return 1;
+
+    printf("\nRunning row fetch and writeback tests\n");
+    if (!run_rows_test(cpu_backend, buf, cached_buf))
+        return 1;
+
+    printf("\nRunning row fetch and writeback tests (%d threads)\n",
+           cpu_backend_start_threads(cpu_backend, NTHREADS, 0));
+    if (!run_rows_test(cpu_backend, buf, cached_buf))
+        return 1;
+    cpu_backend_start_threads(cpu_backend, 1, 0);
+
+    memset(buf, 0xCC, bufsize);
+    memset(cached_buf, 0xCC, bufsize);
+
+    printf("\nRunning benchmarks for normal RAM (%dx%d, %dbpp)\n",
+           xres, yres, bpp);
+    run_benchmark(cpu_backend, buf, xres, yres, stride, bpp);
+
+    printf("\nRunning narrow blit benchmarks for normal RAM\n");
+    run_narrow_benchmark(cpu_backend, buf, xres, yres, stride, bpp);
+
+    printf("\nRunning benchmarks for normal RAM (%d threads)\n",
+           cpu_backend_start_threads(cpu_backend, NTHREADS, 0));
+    run_benchmark(cpu_backend, buf, xres, yres, stride, bpp);
+    cpu_backend_start_threads(cpu_backend, 1, 0);
+
+    printf("\nRunning rotation benchmarks for normal RAM\n");
+    run_rotate_benchmark(cpu_backend, buf, xres, yres, stride, bpp);
+    run_rotate_benchmark(cpu_backend, buf, xres, yres, xres * 2, 16);
+
+    printf("\nRunning benchmarks for normal RAM (cached memory)\n");
+    run_benchmark(cpu_backend, cached_buf, xres, yres, stride, bpp);
+
+    if (cpu_backend_calibrate(cpu_backend, NULL))
+        printf("calibration for normal RAM: %s, %d bytes scratch buffer\n",
+               cpu_backend->blt2d_impl_name, cpu_backend->scratch_size);
+
+    free(buf);
+    free(cached_buf);
+    cpu_backend_close(cpu_backend);
+
+    if (argc > 1) {
+        struct fb_var_screeninfo fb_var;
+        struct fb_fix_screeninfo fb_fix;
+        int fd = open(argv[1], O_RDWR);
+
+        if (fd < 0 || ioctl(fd, FBIOGET_VSCREENINFO, &fb_var) < 0 ||
+                      ioctl(fd, FBIOGET_FSCREENINFO, &fb_fix) < 0) {
+            printf("can't open framebuffer device %s\n", argv[1]);
+            return 1;
+        }
+        buf = mmap(0, fb_fix.smem_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+        if (buf == MAP_FAILED) {
+            printf("can't mmap framebuffer\n");
+            return 1;
+        }
+        cpu_backend = cpu_backend_init(buf, fb_fix.smem_len);
+
+        printf("\nRunning benchmarks for framebuffer (%dx%d, %dbpp)\n",
+               fb_var.xres, fb_var.yres, fb_var.bits_per_pixel);
+        printf("guessed implementation: %s, %d bytes scratch buffer\n",
+               cpu_backend->blt2d_impl_name, cpu_backend->scratch_size);
+        run_benchmark(cpu_backend, buf, fb_var.xres, fb_var.yres,
+                      fb_fix.line_length, fb_var.bits_per_pixel);
+
+        printf("\nRunning narrow blit benchmarks for framebuffer\n");
+        run_narrow_benchmark(cpu_backend, buf, fb_var.xres, fb_var.yres,
+                             fb_fix.line_length, fb_var.bits_per_pixel);
+
+        printf("\nRunning rotation benchmarks for framebuffer\n");
+        run_rotate_benchmark(cpu_backend, buf, fb_var.xres, fb_var.yres,
+                             fb_fix.line_length, fb_var.bits_per_pixel);
+
+        if (!cpu_backend_calibrate(cpu_backend, NULL)) {
+            printf("calibration failed\n");
+        }
+        else {
+            printf("calibrated implementation: %s, %d bytes scratch buffer\n",
+                   cpu_backend->blt2d_impl_name, cpu_backend->scratch_size);
+            run_benchmark(cpu_backend, buf, fb_var.xres, fb_var.yres,
+                          fb_fix.line_length, fb_var.bits_per_pixel);
+        }
+
+        printf("\nRunning benchmarks for framebuffer (%d threads)\n",
+               cpu_backend_start_threads(cpu_backend, NTHREADS, 0));
+        run_benchmark(cpu_backend, buf, fb_var.xres, fb_var.yres,
+                      fb_fix.line_length, fb_var.bits_per_pixel);
+
+        cpu_backend_close(cpu_backend);
+        munmap(buf, fb_fix.smem_len);
+        close(fd);
+    }
+
+    return 0;
+}
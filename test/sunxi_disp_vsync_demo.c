@@ -119,12 +119,12 @@ int main(int argc, char *argv[])
     printf("This demo can be stopped by pressing Ctrl-C.\n");
 
     /* setup layer window to cover the whole screen */
-    sunxi_layer_set_output_window(disp, 0, 0, disp->xres, disp->yres);
+    sunxi_layer_set_output_window(disp, 0, 0, 0, disp->xres, disp->yres);
     /* setup the layer scanout buffer to the first page in the framebuffer */
-    sunxi_layer_set_rgb_input_buffer(disp, disp->bits_per_pixel,
+    sunxi_layer_set_rgb_input_buffer(disp, 0, disp->bits_per_pixel,
                                      0, disp->xres, disp->yres, disp->xres);
     /* make the layer visible */
-    sunxi_layer_show(disp);
+    sunxi_layer_show(disp, 0);
 
     while (1) {
         if (framenum % 2 == 1) {
@@ -149,7 +149,7 @@ int main(int argc, char *argv[])
                          color);
 
         /* schedule the change of layer scanout buffer on next vsync */
-        sunxi_layer_set_rgb_input_buffer(disp, disp->bits_per_pixel,
+        sunxi_layer_set_rgb_input_buffer(disp, 0, disp->bits_per_pixel,
                                          yoffs * disp->xres * 4,
                                          disp->xres, disp->yres, disp->xres);
         /* wait for the vsync itself */